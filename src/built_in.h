@@ -12,6 +12,10 @@
 # define __aligned_16		__attribute__((aligned(16)))
 #endif
 
+#ifndef __cacheline_aligned
+# define __cacheline_aligned	__attribute__((aligned(64)))
+#endif
+
 #ifndef likely
 # define likely(x)		__builtin_expect(!!(x), 1)
 #endif
@@ -50,6 +54,18 @@
 	build_bug_on_zero(__builtin_types_compatible_p(typeof(x), typeof(&x[0])))
 #endif
 
+#ifndef offsetof
+# define offsetof(type, member)	((size_t) &((type *) 0)->member)
+#endif
+
+#ifndef container_of
+# define container_of(ptr, type, member)			\
+	({							\
+		const typeof(((type *) 0)->member) * __mptr = (ptr);	\
+		(type *) ((char *) __mptr - offsetof(type, member));	\
+	})
+#endif
+
 #ifndef max
 # define max(a, b)			\
 	({				\
@@ -0,0 +1,244 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "built_in.h"
+#include "xmalloc.h"
+#include "capture.h"
+
+static inline uint64_t capture_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int capture_write(int fd, const char *buff, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buff, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buff += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Each worker writes a file of its own, no locking on the hot path. */
+struct capture *capture_open(const char *path, unsigned int worker)
+{
+	int fd;
+	struct capture *c;
+	struct capture_hdr hdr;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CAPTURE_MAGIC;
+	hdr.version = CAPTURE_VERSION;
+	hdr.hdrlen = sizeof(hdr);
+	hdr.worker = worker;
+	hdr.mono = capture_clock(CLOCK_MONOTONIC);
+	hdr.wall = capture_clock(CLOCK_REALTIME);
+
+	if (capture_write(fd, (char *) &hdr, sizeof(hdr)) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	c = xzmalloc(sizeof(*c));
+	c->fd = fd;
+
+	return c;
+}
+
+int capture_flush(struct capture *c)
+{
+	int ret;
+
+	if (c->len == 0)
+		return 0;
+
+	ret = capture_write(c->fd, c->buff, c->len);
+	if (ret < 0)
+		c->stats.errors++;
+
+	c->len = 0;
+	return ret;
+}
+
+/*
+ * Records are gathered in the buffer and written CAPTURE_BUFF at a
+ * time. A failed write loses that buffer, but leaves the file in
+ * whole records.
+ */
+void capture_put(struct capture *c, uint64_t ts, uint8_t dir,
+		 const struct sockaddr *addr, const void *data, size_t len)
+{
+	size_t size;
+	struct capture_rec *r;
+
+	len = min(len, (size_t) UINT16_MAX);
+	size = capture_rec_size(len);
+	if (unlikely(size > sizeof(c->buff))) {
+		c->stats.errors++;
+		return;
+	}
+
+	if (c->len + size > sizeof(c->buff))
+		capture_flush(c);
+
+	r = (struct capture_rec *) (c->buff + c->len);
+	memset(r, 0, sizeof(*r));
+	r->ts = ts;
+	r->len = len;
+	r->dir = dir;
+
+	if (addr && addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const void *) addr;
+
+		r->family = AF_INET;
+		r->port = sin->sin_port;
+		memcpy(r->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+	} else if (addr && addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void *) addr;
+
+		r->family = AF_INET6;
+		r->port = sin6->sin6_port;
+		memcpy(r->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+	}
+
+	memcpy(r->data, data, len);
+	memset(r->data + len, 0, size - sizeof(*r) - len);
+
+	c->len += size;
+	c->stats.recs++;
+	c->stats.bytes += len;
+}
+
+void capture_close(struct capture *c)
+{
+	capture_flush(c);
+	close(c->fd);
+	xfree(c);
+}
+
+int capture_map(const char *path, struct capture_map *m)
+{
+	int fd, ret;
+	void *base;
+	struct stat st;
+
+	memset(m, 0, sizeof(*m));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0)
+		goto err;
+	if (st.st_size < (off_t) sizeof(struct capture_hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		goto err;
+	close(fd);
+
+	m->base = base;
+	m->size = st.st_size;
+	m->hdr = base;
+
+	if (m->hdr->magic != CAPTURE_MAGIC ||
+	    m->hdr->version != CAPTURE_VERSION ||
+	    m->hdr->hdrlen < sizeof(struct capture_hdr) ||
+	    m->hdr->hdrlen > m->size) {
+		capture_unmap(m);
+		return -EINVAL;
+	}
+
+	madvise(m->base, m->size, MADV_SEQUENTIAL);
+	return 0;
+err:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+void capture_unmap(struct capture_map *m)
+{
+	if (m->base)
+		munmap(m->base, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Record at *off, 0 starts at the first one, and moves *off past it.
+ * NULL at the end, or where a truncated record begins.
+ */
+const struct capture_rec *capture_next(const struct capture_map *m,
+				       size_t *off)
+{
+	const struct capture_rec *r;
+
+	if (*off == 0)
+		*off = m->hdr->hdrlen;
+	if (*off + sizeof(*r) > m->size)
+		return NULL;
+
+	r = (const struct capture_rec *) (m->base + *off);
+	if (*off + capture_rec_size(r->len) > m->size)
+		return NULL;
+
+	*off += capture_rec_size(r->len);
+	return r;
+}
+
+socklen_t capture_rec_addr(const struct capture_rec *r,
+			   struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+
+	if (r->family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = r->port;
+		memcpy(&sin->sin_addr, r->addr, sizeof(sin->sin_addr));
+		return sizeof(*sin);
+	} else if (r->family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = r->port;
+		memcpy(&sin6->sin6_addr, r->addr, sizeof(sin6->sin6_addr));
+		return sizeof(*sin6);
+	}
+
+	return 0;
+}
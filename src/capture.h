@@ -0,0 +1,89 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define CAPTURE_MAGIC		0x74735043U
+#define CAPTURE_VERSION		1
+#define CAPTURE_ALIGN		8
+#define CAPTURE_BUFF		(64 * 1024)
+
+#define CAPTURE_TX		(1 << 0)
+#define CAPTURE_SHM		(1 << 1)
+
+/*
+ * A capture is this header and then records back to back, each padded
+ * to CAPTURE_ALIGN, so a mapped file can be walked in place. Fields are
+ * in host byte order, a swapped magic tells a file from another host.
+ * Record times are CLOCK_MONOTONIC ns, mono and wall of the header
+ * were taken together and turn them into wall clock time.
+ */
+struct capture_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdrlen;
+	uint32_t worker;
+	uint32_t res;
+	uint64_t mono;
+	uint64_t wall;
+};
+
+/* The peer's address, port in network byte order, v4 in addr[0..3]. */
+struct capture_rec {
+	uint64_t ts;
+	uint16_t len;
+	uint8_t dir;
+	uint8_t family;
+	uint16_t port;
+	uint16_t res;
+	uint8_t addr[16];
+	uint8_t data[0];
+};
+
+struct capture_stats {
+	uint64_t recs, bytes;
+	uint64_t errors;
+};
+
+struct capture {
+	int fd;
+	size_t len;
+	struct capture_stats stats;
+	char buff[CAPTURE_BUFF];
+};
+
+struct capture_map {
+	uint8_t *base;
+	size_t size;
+	const struct capture_hdr *hdr;
+};
+
+extern struct capture *capture_open(const char *path, unsigned int worker);
+extern void capture_put(struct capture *c, uint64_t ts, uint8_t dir,
+			const struct sockaddr *addr, const void *data,
+			size_t len);
+extern int capture_flush(struct capture *c);
+extern void capture_close(struct capture *c);
+extern int capture_map(const char *path, struct capture_map *m);
+extern void capture_unmap(struct capture_map *m);
+extern const struct capture_rec *capture_next(const struct capture_map *m,
+					       size_t *off);
+extern socklen_t capture_rec_addr(const struct capture_rec *r,
+				  struct sockaddr_storage *ss);
+
+static inline size_t capture_rec_size(size_t len)
+{
+	return (sizeof(struct capture_rec) + len + CAPTURE_ALIGN - 1) &
+	       ~((size_t) CAPTURE_ALIGN - 1);
+}
+
+#endif /* CAPTURE_H */
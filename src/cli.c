@@ -20,6 +20,7 @@
 #include "built_in.h"
 #include "call_notifier.h"
 #include "die.h"
+#include "engine.h"
 
 #define MAX_MENU_ELEMS		100
 #define FETCH_LIST		0
@@ -33,8 +34,6 @@ static char *prompt = NULL;
 
 static size_t prompt_len = 256;
 
-extern volatile sig_atomic_t stun_done;
-
 extern int print_stun_probe(char *server, int sport, int tport);
 
 extern void init_cli_cmds(int ti, int to);
@@ -43,6 +42,13 @@ static struct shell_cmd show_node[] = {
 	{ "settings", cmd_help, "Show settings", NULL, },
 	{ "pubkey", cmd_help, "Show my public key", NULL, },
 	{ "contacts", cmd_help, "Show my contacts", NULL, },
+	{ "calls", cmd_show_calls, "Show current calls", NULL, },
+	{ "stats", cmd_show_stats, "Show engine statistics", NULL, },
+	{ NULL, NULL, NULL, NULL, },
+};
+
+static struct shell_cmd set_node[] = {
+	{ "fec", cmd_set_fec, "Set FEC repair per frames <n> <k>", NULL, },
 	{ NULL, NULL, NULL, NULL, },
 };
 
@@ -55,9 +61,10 @@ static struct shell_cmd cmd_tree[] = {
 	{ "help", cmd_help, "Show help", NULL, },
 	{ "quit", cmd_quit, "Exit shell", NULL, },
 	{ "call", cmd_call, "Perform a call", NULL, },
-	{ "hangup", cmd_hangup, "Hangup the current call", NULL, },
-	{ "take", cmd_take, "Take a call", NULL, },
+	{ "hangup", cmd_hangup, "Hangup a call [id]", NULL, },
+	{ "take", cmd_take, "Take a call [id]", NULL, },
 	{ "show", NULL, "Show information", show_node, },
+	{ "set", NULL, "Change settings", set_node, },
 	{ "import", NULL, "Import things", import_node, },
 	{ NULL, NULL, NULL, NULL, },
 };
@@ -332,12 +339,12 @@ static inline void print_shell_header(void)
 	       PROGNAME_STRING " " VERSION_STRING, colorize_end());
 }
 
-static inline void init_stun(void)
+static inline void init_stun(int port)
 {
-	int ret = print_stun_probe("stunserver.org", 3478, 30111);
+	int ret = print_stun_probe("stunserver.org", 3478, port);
 	if (ret < 0)
 		printf("STUN failed!\n");
-	stun_done = 1;
+	engine_stun_done();
 	fflush(stdout);
 }
 
@@ -363,10 +370,11 @@ int cmd_help(char *args)
 int cmd_quit(char *args)
 {
 	quit = 1;
+	engine_wakeup();
 	return 0;
 }
 
-void enter_shell_loop(int ti, int to)
+void enter_shell_loop(int ti, int to, int port)
 {
 	char *line, *cmd;
 
@@ -377,7 +385,7 @@ void enter_shell_loop(int ti, int to)
 	setup_readline();
 
 	print_shell_header();
-	init_stun();
+	init_stun(port);
 
 	register_call_notifier(&call_event);
 
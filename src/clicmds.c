@@ -5,12 +5,14 @@
  * Subject to the GPL, version 2.
  */
 
+#include <stdlib.h>
 #include <errno.h>
 
 #include "clicmds.h"
 #include "xutils.h"
 #include "xmalloc.h"
 #include "die.h"
+#include "fec.h"
 
 static int tsocki, tsocko;
 
@@ -38,7 +40,6 @@ int cmd_call(char *arg)
 	strlcpy(cpkt.port, argv[1], sizeof(cpkt.port));
 
 	ret = write(tsocko, &cpkt, sizeof(cpkt));
-	ret = write(tsocko, &cpkt, sizeof(cpkt)); //XXX
 	if (ret != sizeof(cpkt)) {
 		whine("Error notifying thread!\n");
 		return -EIO;
@@ -57,6 +58,7 @@ int cmd_hangup(char *arg)
 
 	memset(&cpkt, 0, sizeof(cpkt));
 	cpkt.fin = 1;
+	cpkt.sid = strtoul(arg, NULL, 10);
 
 	ret = write(tsocko, &cpkt, sizeof(cpkt));
 	if (ret != sizeof(cpkt)) {
@@ -74,6 +76,79 @@ int cmd_take(char *arg)
 
 	memset(&cpkt, 0, sizeof(cpkt));
 	cpkt.take = 1;
+	cpkt.sid = strtoul(arg, NULL, 10);
+
+	ret = write(tsocko, &cpkt, sizeof(cpkt));
+	if (ret != sizeof(cpkt)) {
+		whine("Error notifying thread!\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int cmd_show_calls(char *arg)
+{
+	ssize_t ret;
+	struct cli_pkt cpkt;
+
+	memset(&cpkt, 0, sizeof(cpkt));
+	cpkt.list = 1;
+
+	ret = write(tsocko, &cpkt, sizeof(cpkt));
+	if (ret != sizeof(cpkt)) {
+		whine("Error notifying thread!\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int cmd_show_stats(char *arg)
+{
+	ssize_t ret;
+	struct cli_pkt cpkt;
+
+	memset(&cpkt, 0, sizeof(cpkt));
+	cpkt.stats = 1;
+
+	ret = write(tsocko, &cpkt, sizeof(cpkt));
+	if (ret != sizeof(cpkt)) {
+		whine("Error notifying thread!\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int cmd_set_fec(char *arg)
+{
+	int argc;
+	ssize_t ret;
+	unsigned long n, k;
+	char **argv = strntoargv(arg, strlen(arg), &argc);
+	struct cli_pkt cpkt;
+
+	if (argc != 2) {
+		whine("Missing arguments: set fec <frames> <repair>\n");
+		xfree(argv);
+		return -EINVAL;
+	}
+
+	n = strtoul(argv[0], NULL, 10);
+	k = strtoul(argv[1], NULL, 10);
+	xfree(argv);
+
+	if (n == 0 || n > FEC_MAX_DATA || k > FEC_MAX_PARITY) {
+		whine("Frames must be 1 to %d, repair 0 to %d!\n",
+		      FEC_MAX_DATA, FEC_MAX_PARITY);
+		return -EINVAL;
+	}
+
+	memset(&cpkt, 0, sizeof(cpkt));
+	cpkt.fec = 1;
+	cpkt.fec_data = n;
+	cpkt.fec_parity = k;
 
 	ret = write(tsocko, &cpkt, sizeof(cpkt));
 	if (ret != sizeof(cpkt)) {
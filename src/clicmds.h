@@ -16,6 +16,9 @@ extern int cmd_stat(char *args);
 extern int cmd_call(char *args);
 extern int cmd_hangup(char *args);
 extern int cmd_take(char *arg);
+extern int cmd_show_calls(char *arg);
+extern int cmd_show_stats(char *arg);
+extern int cmd_set_fec(char *arg);
 
 struct shell_cmd {
 	char *name;
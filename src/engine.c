@@ -5,13 +5,17 @@
  * Subject to the GPL, version 2.
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include <celt/celt.h>
 #include <speex/speex_jitter.h>
 #include <speex/speex_echo.h>
@@ -26,22 +30,55 @@
 #include "die.h"
 #include "xmalloc.h"
 #include "xutils.h"
+#include "engine.h"
+#include "session.h"
+#include "proto.h"
+#include "mmsg.h"
+#include "uring.h"
+#include "reactor.h"
+#include "sock.h"
+#include "siphash.h"
+#include "ratelimit.h"
+#include "resolv.h"
+#include "pace.h"
+#include "fec.h"
+#include "shm.h"
+#include "capture.h"
+#include "pktbuf.h"
+#include "locking.h"
 #include "call_notifier.h"
 
 #define SAMPLING_RATE	48000
 #define FRAME_SIZE	256
+#define FRAME_NSEC	(1000000000ULL * FRAME_SIZE / SAMPLING_RATE)
 #define PACKETSIZE	43
-#define MAX_MSG		1500
-#define PATH_MAX	512
-
-struct transsip_hdr {
-	uint32_t seq;
-	__extension__ uint8_t est:1,
-			      psh:1,
-			      bsy:1,
-			      fin:1,
-			      res1:4;
-} __attribute__((packed));
+#define PACKET_MIN	16
+#define PACKET_MAX	SESSION_FRAME_MAX
+#ifndef PATH_MAX
+# define PATH_MAX	512
+#endif
+#define CALLOUT_TIMEOUT	(120 * 1000000000ULL)
+#define RX_ROUNDS	8
+#define PROBE_RATE	10
+#define PROBE_BURST	20
+#define COOKIE_RATE	10000
+#define COOKIE_BURST	1000
+#define COOKIE_EPOCH	36
+#define RACE_DELAY	(250 * 1000000ULL)
+#define MAX_RACES	4
+#define MAX_LINGER	16
+#define RTO_INIT	(500 * 1000000ULL)
+#define RTO_MIN		(50 * 1000000ULL)
+#define RTO_MAX		(4000 * 1000000ULL)
+#define RTX_MAX		6
+#define RTT_MAX_US	10000000U
+#define MARGIN_MAX	(4 * FRAME_SIZE)
+#define REPORT_INTERVAL	(250 * 1000 * 1000ULL)
+#define REPORT_TIMEOUT	(4 * REPORT_INTERVAL)
+
+#define FEC_RECEIVED	1
+#define FEC_RECOVERED	2
+#define PACE_DELAY	FRAME_NSEC
 
 enum engine_state_num {
 	ENGINE_STATE_IDLE = CALL_STATE_MACHINE_IDLE,
@@ -55,12 +92,15 @@ enum engine_sound_type {
 	ENGINE_SOUND_DIAL = 0,
 	ENGINE_SOUND_RING,
 	ENGINE_SOUND_BUSY,
+	__ENGINE_SOUND_MAX,
 };
 
+struct engine;
+
 struct engine_state {
 	volatile enum engine_state_num state;
-	enum engine_state_num (*process)(int, int *, int, int,
-					 struct alsa_dev *);
+	enum engine_state_num (*process)(struct engine *, struct session *,
+					 const struct transsip_pkt *);
 };
 
 #define STATE_MAP_SET(s, f)  {	\
@@ -68,28 +108,281 @@ struct engine_state {
 	.process = (f)		\
 }
 
-extern volatile sig_atomic_t quit;
+struct engine_tone {
+	short *pcm;
+	size_t len;
+};
+
+struct engine_stats {
+	uint64_t periods;
+	uint64_t deadline_miss;
+	uint64_t frames;
+	uint64_t packets_tx, packets_rx;
+	uint64_t first_audio, first_audio_ns;
+};
+
+struct engine_filter_stats {
+	uint64_t hits;
+	uint64_t drops;
+};
+
+enum engine_ctl_type {
+	ENGINE_CTL_EST = 0,
+	ENGINE_CTL_PSH,
+	ENGINE_CTL_FIN,
+	__ENGINE_CTL_MAX,
+};
+
+struct engine_ctl_stats {
+	uint64_t rtx[__ENGINE_CTL_MAX];
+	uint64_t gave_up[__ENGINE_CTL_MAX];
+	uint64_t handshakes, handshake_ns;
+	uint64_t setups, setup_ns;
+};
+
+struct engine_flood_stats {
+	uint64_t limited;
+	uint64_t challenges;
+	uint64_t bad_cookies;
+	uint64_t admitted;
+};
+
+struct engine_pace_stats {
+	uint64_t frames;
+	uint64_t late;
+	uint64_t anchors;
+};
+
+struct engine_rx_stats {
+	uint64_t stamped;
+	uint64_t delay_ns, delay_max;
+	uint64_t rescued;
+};
+
+struct engine_rate_stats {
+	uint64_t reports_tx, reports_rx;
+	uint64_t increases, decreases;
+	uint64_t timeouts;
+};
+
+struct engine_fec_stats {
+	uint64_t groups;
+	uint64_t repair_tx, repair_rx;
+	uint64_t recovered;
+};
+
+struct engine_red_stats {
+	uint64_t packets, bytes;
+	uint64_t filled, plc;
+};
+
+struct engine_hold_stats {
+	uint64_t lent, played;
+	uint64_t expired, dups, stale, dropped;
+	uint64_t outside;
+};
+
+struct engine_shm_stats {
+	uint64_t offers, taken, refused;
+	uint64_t tx, rx;
+	uint64_t full, doorbells;
+};
+
+struct engine_resume_stats {
+	uint64_t challenges;
+	uint64_t migrated;
+	uint64_t bad_proofs;
+	uint64_t unproven;
+};
+
+struct engine_dial {
+	struct engine *e;
+	unsigned int gen;
+};
 
-volatile sig_atomic_t stun_done = 0;
+struct engine_dial_stats {
+	uint64_t races;
+	uint64_t first;
+	uint64_t fallback;
+	uint64_t reply_ns;
+};
 
-static char *alsadev = "plughw:0,0"; //XXX
-static char *port = "30111"; //XXX
+/*
+ * Call-out to all addresses of a host at once: candidates get a probe
+ * each, RACE_DELAY apart and alternating between the address families,
+ * and the first one to answer becomes the call's socket. A broken path
+ * of one family thus costs us RACE_DELAY instead of a timeout.
+ */
+struct engine_race {
+	int used;
+	struct engine *e;
+	struct session *s;
+	unsigned int num, started, alive;
+	int socks[RESOLV_MAX_ADDRS];
+	struct reactor_fd rf[RESOLV_MAX_ADDRS];
+	struct sockaddr_storage addrs[RESOLV_MAX_ADDRS];
+	socklen_t addrlens[RESOLV_MAX_ADDRS];
+	struct reactor_timer timer;
+	uint64_t start;
+};
 
-struct engine_curr {
-	int active;
-	int sock;
-	struct sockaddr addr;
+/*
+ * A fin outlives its call until the peer acks it, or we gave up. It
+ * keeps the call's own socket to hear the ack on.
+ */
+struct engine_linger {
+	int used;
+	struct engine *e;
+	int sock, own;
+	int version;
+	uint32_t callid;
+	uint8_t flags;
+	unsigned int tries;
+	uint64_t sent, rto;
+	struct sockaddr_storage addr;
 	socklen_t addrlen;
+	struct reactor_fd rf;
+	struct reactor_timer timer;
+};
+
+/*
+ * One engine carries all calls of one worker. Codec and jitter state
+ * live in each session, whereas echo cancellation and preprocessing
+ * belong to the sound device and thus are shared: the echo reference
+ * is the mix of all calls that is played out. Headless engines have
+ * no sound device and are paced by their clock timer instead.
+ */
+struct engine {
+	unsigned int id;
+	int headless, echo;
+	pthread_t tid;
+	int ssock;
+	int usocki, usocko;
+	int audio_on;
+	struct alsa_dev *dev;
+	CELTMode *mode;
+	SpeexEchoState *echo_state;
+	SpeexPreprocessState *preprocess;
+	struct engine_tone tones[__ENGINE_SOUND_MAX];
+	size_t busy_left, busy_pos;
+	struct session_table sessions;
+	struct session *curr;
+	struct engine_stats stats;
+	struct engine_filter_stats filters[__SOCK_FILTER_MAX];
+	int filter;
+	uint32_t filter_drops;
+	struct ratelimit *rl;
+	uint64_t cookie_tat;
+	uint8_t cookie_key[SIPHASH_KEY_LEN];
+	struct engine_flood_stats flood;
+	struct engine_resume_stats resume;
+	enum engine_pace pace;
+	int ssock_txtime;
+	int pace_armed;
+	struct pace_wheel *wheel;
+	struct reactor_timer pace_timer;
+	struct engine_pace_stats paced;
+	int lowlat, rxts;
+	uint64_t rx_at;
+	struct engine_rx_stats rxs;
+	struct engine_rate_stats rate;
+	struct engine_fec_stats fec;
+	unsigned int red;
+	struct engine_red_stats redund;
+	unsigned int ptime;
+	int shm_sock;
+	struct reactor_fd shm_rf;
+	struct engine_shm_stats local;
+	struct capture *cap;
+	struct pktbuf_pool *pool;
+	struct pktbuf *rx_buf, *rx_bufs[MMSG_BATCH];
+	struct engine_hold_stats hold;
+	struct mmsg_batch *rx, *tx;
+	struct mmsg_stats net;
+	struct uring_net *un;
+	struct reactor r;
+	struct reactor_fd ssock_rf, cli_rf, resolv_rf;
+	struct resolv *resolv;
+	struct resolv_result *relay;
+	unsigned int dialing, dial_gen;
+	struct engine_race races[MAX_RACES];
+	struct engine_dial_stats dial;
+	struct engine_linger lingers[MAX_LINGER];
+	unsigned int nlinger;
+	uint64_t srtt, rttvar, rto;
+	struct engine_ctl_stats ctl;
+	struct reactor_fd *audio_rf;
+	struct reactor_timer clock;
+	struct pollfd *apfds;
+	unsigned int anfds;
+	int audio_ready;
+};
+
+extern volatile sig_atomic_t quit;
+
+static struct mutexlock engine_lock = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_cond_t engine_stun_cond = PTHREAD_COND_INITIALIZER;
+static int engine_stun_ready = 0;
+static struct reactor *engine_reactor = NULL;
+
+static struct engine *engines[ENGINE_MAX_WORKERS];
+static unsigned int engine_workers = 0;
+/* Data frames << 8 | repair symbols per group, read by all workers. */
+static uint16_t engine_fec_conf = 0;
+
+static const char *state_names[__ENGINE_STATE_MAX] = {
+	[ENGINE_STATE_IDLE]	= "idle",
+	[ENGINE_STATE_CALLOUT]	= "call-out",
+	[ENGINE_STATE_CALLIN]	= "call-in",
+	[ENGINE_STATE_SPEAKING]	= "speaking",
+};
+
+static const char *ctl_names[__ENGINE_CTL_MAX] = {
+	[ENGINE_CTL_EST]	= "est",
+	[ENGINE_CTL_PSH]	= "psh",
+	[ENGINE_CTL_FIN]	= "fin",
 };
 
-static struct engine_curr ecurr;
+static const char *pace_names[] = {
+	[ENGINE_PACE_OFF]	= "off",
+	[ENGINE_PACE_TXTIME]	= "txtime",
+	[ENGINE_PACE_WHEEL]	= "wheel",
+};
+
+static const char *filter_names[__SOCK_FILTER_MAX] = {
+	[SOCK_FILTER_PROBE]	= "probe",
+	[SOCK_FILTER_ANY]	= "any",
+	[SOCK_FILTER_MEDIA]	= "media",
+};
+
+static inline uint64_t engine_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Kernel timestamps are CLOCK_REALTIME, we count CLOCK_MONOTONIC. */
+static inline uint64_t engine_wall_offset(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec -
+	       engine_now();
+}
 
-static void engine_play_file(struct alsa_dev *dev, enum engine_sound_type type)
+static void engine_load_tone(struct engine_tone *tone,
+			     enum engine_sound_type type)
 {
-	int fd, nfds;
+	int fd;
+	ssize_t ret;
+	struct stat sb;
 	char path[PATH_MAX];
-	short pcm[FRAME_SIZE];
-	struct pollfd *pfds = NULL;
 
 	memset(path, 0, sizeof(path));
 	switch (type) {
@@ -102,691 +395,3454 @@ static void engine_play_file(struct alsa_dev *dev, enum engine_sound_type type)
 	case ENGINE_SOUND_RING:
 		slprintf(path, sizeof(path), "%s/%s", FILE_ETCDIR, FILE_RING);
 		break;
+	default:
+		bug();
 	}
 
+	tone->pcm = NULL;
+	tone->len = 0;
+
 	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		panic("Cannot open ring file!\n");
+	if (fd < 0) {
+		whine("Cannot open tone file %s!\n", path);
+		return;
+	}
 
-	alsa_start(dev);
+	if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(*tone->pcm)) {
+		whine("Cannot use tone file %s!\n", path);
+		close(fd);
+		return;
+	}
 
-	nfds = alsa_nfds(dev);
-	pfds = xmalloc(sizeof(*pfds) * nfds);
+	tone->pcm = xmalloc(sb.st_size);
+	ret = read(fd, tone->pcm, sb.st_size);
+	if (ret < (ssize_t) sizeof(*tone->pcm)) {
+		whine("Cannot read tone file %s!\n", path);
+		xfree(tone->pcm);
+		tone->pcm = NULL;
+	} else {
+		tone->len = ret / sizeof(*tone->pcm);
+	}
 
-	alsa_getfds(dev, pfds, nfds);
+	close(fd);
+}
 
-	memset(pcm, 0, sizeof(pcm));
-	while (read(fd, pcm, sizeof(pcm)) > 0) {
-		poll(pfds, nfds, -1);
+/* Returns 1 if the tone wrapped around during this frame. */
+static int engine_mix_tone(int32_t *mix, struct engine_tone *tone,
+			   size_t *pos)
+{
+	int i, wrapped = 0;
 
-		alsa_write(dev, pcm, FRAME_SIZE);
-		memset(pcm, 0, sizeof(pcm));
+	if (unlikely(tone->len == 0))
+		return 1;
 
-		alsa_read(dev, pcm, FRAME_SIZE);
-		memset(pcm, 0, sizeof(pcm));
+	for (i = 0; i < FRAME_SIZE; ++i) {
+		mix[i] += tone->pcm[*pos];
+		if (++(*pos) == tone->len) {
+			*pos = 0;
+			wrapped = 1;
+		}
 	}
 
-	alsa_stop(dev);
-	close(fd);
-	xfree(pfds);
+	return wrapped;
 }
 
-static inline void engine_play_ring(struct alsa_dev *dev)
+static inline void engine_play_busy(struct engine *e)
 {
-	engine_play_file(dev, ENGINE_SOUND_RING);
+	e->busy_pos = 0;
+	e->busy_left = 2 * e->tones[ENGINE_SOUND_BUSY].len;
 }
 
-static inline void engine_play_busy(struct alsa_dev *dev)
+/* Datagrams as they cross the socket, for transsip-replay. */
+static inline void engine_capture(struct engine *e, uint64_t ts, uint8_t dir,
+				  const struct sockaddr *addr,
+				  const void *msg, size_t len)
 {
-	engine_play_file(dev, ENGINE_SOUND_BUSY);
+	if (unlikely(e->cap))
+		capture_put(e->cap, ts, dir, addr, msg, len);
 }
 
-static inline void engine_play_dial(struct alsa_dev *dev)
+void engine_decode_packet(uint8_t *pkt, size_t len)
 {
-	engine_play_file(dev, ENGINE_SOUND_DIAL);
+	transsip_dump(pkt, len);
 }
 
-void engine_decode_packet(uint8_t *pkt, size_t len)
+static ssize_t engine_send_pkt(int sock, struct sockaddr *addr,
+			       socklen_t addrlen,
+			       const struct transsip_pkt *pkt)
 {
-	struct transsip_hdr *hdr;
+	size_t len;
+	uint8_t msg[sizeof(struct transsip_hdr) + TRANSSIP_RELAY_LEN +
+		    TRANSSIP_COOKIE_LEN];
 
-	if (len < sizeof(*hdr)) {
-		whine("[dbg] pkt too small!\n");
-		return;
+	len = transsip_encode(msg, sizeof(msg), pkt);
+	if (unlikely(len == 0 || len + pkt->len > sizeof(msg)))
+		return -ENOMEM;
+
+	if (pkt->len)
+		memcpy(msg + len, pkt->payload, pkt->len);
+
+	return sendto(sock, msg, len + pkt->len, 0, addr, addrlen);
+}
+
+/*
+ * Probes of calls through a relay name the callee, the relay unwraps
+ * them. All else goes to the relay as is.
+ */
+static ssize_t engine_send_probe(struct session *s, int sock,
+				 struct sockaddr *addr, socklen_t addrlen,
+				 struct transsip_pkt *pkt)
+{
+	uint8_t payload[TRANSSIP_RELAY_LEN + TRANSSIP_COOKIE_LEN];
+
+	if (s->relay_tolen && transsip_is_probe(pkt) &&
+	    pkt->len <= TRANSSIP_COOKIE_LEN) {
+		if (transsip_relay_encode(payload,
+					  (struct sockaddr *) &s->relay_to,
+					  pkt->type) < 0)
+			return -EAFNOSUPPORT;
+		if (pkt->len)
+			memcpy(payload + TRANSSIP_RELAY_LEN, pkt->payload,
+			       pkt->len);
+
+		pkt->type = TRANSSIP_PT_RELAY;
+		pkt->payload = payload;
+		pkt->len += TRANSSIP_RELAY_LEN;
 	}
 
-	hdr = (struct transsip_hdr *) pkt;
-	whine("[dbg] packet:\n");
-	whine("[dbg]   seq: %d\n", hdr->seq);
-	whine("[dbg]   est: %d\n", hdr->est);
-	whine("[dbg]   psh: %d\n", hdr->psh);
-	whine("[dbg]   bsy: %d\n", hdr->bsy);
-	whine("[dbg]   fin: %d\n", hdr->fin);
-	whine("[dbg]   res1: %d\n", hdr->res1);
+	return engine_send_pkt(sock, addr, addrlen, pkt);
 }
 
-static enum engine_state_num engine_do_callout(int ssock, int *csock, int usocki,
-					       int usocko, struct alsa_dev *dev)
+static ssize_t engine_send_ctl_to(int sock, struct sockaddr *addr,
+				  socklen_t addrlen, int version,
+				  uint32_t callid, uint8_t flags)
 {
-	int one, mtu, tries, i;
-	ssize_t ret;
-	struct cli_pkt cpkt;
-	struct addrinfo hints, *ahead, *ai;
-	char msg[MAX_MSG];
-	struct pollfd fds[2];
-	struct sockaddr raddr;
-	socklen_t raddrlen;
-	struct transsip_hdr *thdr;
+	struct transsip_pkt pkt;
 
-	assert(ecurr.active == 0);
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = version;
+	pkt.flags = flags;
+	pkt.type = TRANSSIP_PT_CTL;
+	pkt.callid = callid;
 
-	memset(&cpkt, 0, sizeof(cpkt));
-	ret = read(usocki, &cpkt, sizeof(cpkt));
-	if (ret != sizeof(cpkt)) {
-		whine("Read error from cli!\n");
-		return ENGINE_STATE_IDLE;
-	}
-	if (cpkt.ring == 0) {
-		whine("Read no ring flag from cli!\n");
-		return ENGINE_STATE_IDLE;
-	}
+	return engine_send_pkt(sock, addr, addrlen, &pkt);
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
-	hints.ai_flags = AI_NUMERICSERV;
+static inline ssize_t engine_send_ctl(struct session *s, uint8_t flags)
+{
+	return engine_send_ctl_to(s->sock, (struct sockaddr *) &s->addr,
+				  s->addrlen, s->version, s->callid, flags);
+}
 
-	ret = getaddrinfo(cpkt.address, cpkt.port, &hints, &ahead);
-	if (ret < 0) {
-		whine("Cannot get address info for %s:%s!\n",
-		      cpkt.address, cpkt.port);
-		return ENGINE_STATE_IDLE;
-	}
+/*
+ * The top byte of the call id sits where legacy peers expect their
+ * flags. Forcing it to read as a bare est lets a legacy callee ring on
+ * our probe; its legacy answer then switches the session over.
+ */
+static uint32_t engine_new_callid(struct engine *e)
+{
+	uint32_t callid;
 
-	*csock = -1;
+	do {
+		urandom_bytes(&callid, sizeof(callid));
+		callid &= ~(0x0fU << 24);
+		callid |= (uint32_t) TRANSSIP_EST << 24;
+	} while (session_lookup_callid(&e->sessions, callid));
 
-	for (ai = ahead; ai != NULL && *csock < 0; ai = ai->ai_next) {
-		*csock = socket(ai->ai_family, ai->ai_socktype,
-				ai->ai_protocol);
-		if (*csock < 0)
-			continue;
+	return callid;
+}
 
-		ret = connect(*csock, ai->ai_addr, ai->ai_addrlen);
-		if (ret < 0) {
-			whine("Cannot connect to remote!\n");
-			close(*csock);
-			*csock = -1;
-			continue;
-		}
+/*
+ * Call setup cookie, a keyed hash over the caller's address, the call
+ * id and a coarse epoch. We keep no state until a caller echoes it, so
+ * spoofed probes never get to ring or allocate a call. A cookie stays
+ * good for one to two epochs of ~68s.
+ */
+static uint64_t engine_cookie(struct engine *e, const struct sockaddr *addr,
+			      uint32_t callid, uint64_t epoch)
+{
+	size_t len = 0;
+	uint8_t buff[sizeof(epoch) + sizeof(callid) + 2 + 16];
+
+	memcpy(buff + len, &epoch, sizeof(epoch));
+	len += sizeof(epoch);
+	memcpy(buff + len, &callid, sizeof(callid));
+	len += sizeof(callid);
+
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void *) addr;
+
+		memcpy(buff + len, &sin6->sin6_port, 2);
+		memcpy(buff + len + 2, &sin6->sin6_addr, 16);
+		len += 2 + 16;
+	} else {
+		const struct sockaddr_in *sin = (const void *) addr;
+
+		memcpy(buff + len, &sin->sin_port, 2);
+		memcpy(buff + len + 2, &sin->sin_addr, 4);
+		len += 2 + 4;
+	}
 
-		one = 1;
-		setsockopt(*csock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	return siphash24(e->cookie_key, buff, len);
+}
 
-		mtu = IP_PMTUDISC_DONT;
-		setsockopt(*csock, SOL_IP, IP_MTU_DISCOVER, &mtu, sizeof(mtu));
+static int engine_cookie_ok(struct engine *e, const struct sockaddr *addr,
+			    const struct transsip_pkt *pkt, uint64_t now)
+{
+	uint64_t cookie, epoch = now >> COOKIE_EPOCH;
 
-		memcpy(&ecurr.addr, ai->ai_addr, ai->ai_addrlen);
-		ecurr.addrlen = ai->ai_addrlen;
-		ecurr.sock = *csock;
-		ecurr.active = 0;
-	}
-	freeaddrinfo(ahead);
+	if (pkt->type != TRANSSIP_PT_COOKIE ||
+	    pkt->len != TRANSSIP_COOKIE_LEN)
+		return 0;
 
-	if (*csock < 0) {
-		whine("Cannot connect to server!\n");
-		return ENGINE_STATE_IDLE;
-	}
+	memcpy(&cookie, pkt->payload, sizeof(cookie));
 
-	tries = 0;
+	return cookie == engine_cookie(e, addr, pkt->callid, epoch) ||
+	       cookie == engine_cookie(e, addr, pkt->callid, epoch - 1);
+}
 
-	memset(msg, 0, sizeof(msg));
-	thdr = (struct transsip_hdr *) msg;
-	thdr->est = 1;
+/* Challenges are budgeted globally, a spoofed flood must not be mirrored. */
+static void engine_send_cookie(struct engine *e, int sock,
+			       struct sockaddr *addr, socklen_t addrlen,
+			       uint32_t callid, uint64_t now)
+{
+	uint64_t cookie;
+	struct transsip_pkt pkt;
 
-	ret = sendto(*csock, msg, sizeof(*thdr), 0, &ecurr.addr,
-		     ecurr.addrlen);
-	if (ret <= 0) {
-		whine("Cannot send ring probe to server!\n");
-		goto out_err;
+	if (!gcra_allow(&e->cookie_tat, now, 1000000000ULL / COOKIE_RATE,
+			1000000000ULL / COOKIE_RATE * COOKIE_BURST)) {
+		e->flood.limited++;
+		return;
 	}
 
-	fds[0].fd = *csock;
-	fds[0].events = POLLIN;
-	fds[1].fd = usocki;
-	fds[1].events = POLLIN;
+	cookie = engine_cookie(e, addr, callid, now >> COOKIE_EPOCH);
 
-	while (!quit && tries++ < 100) {
-		poll(fds, array_size(fds), 1500);
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = TRANSSIP_VERSION;
+	pkt.flags = TRANSSIP_EST;
+	pkt.type = TRANSSIP_PT_COOKIE;
+	pkt.callid = callid;
+	pkt.payload = (uint8_t *) &cookie;
+	pkt.len = sizeof(cookie);
 
-		for (i = 0; i < array_size(fds); ++i) {
-			if ((fds[i].revents & POLLERR) == POLLERR) {
-				printf("Destination unreachable?\n");
-				goto out_err;
-			}
-			if ((fds[i].revents & POLLIN) != POLLIN)
-				continue;
+	if (engine_send_pkt(sock, addr, addrlen, &pkt) > 0)
+		e->flood.challenges++;
+}
 
-			if (fds[i].fd == usocki) {
-				ret = read(usocki, &cpkt, sizeof(cpkt));
-				if (ret <= 0) {
-					whine("Read error from cli!\n");
-					continue;
-				}
-				if (cpkt.fin) {
-					memset(&msg, 0, sizeof(msg));
-					thdr = (struct transsip_hdr *) msg;
-					thdr->bsy = 1;
-					thdr->fin = 1;
-
-					sendto(*csock, msg, sizeof(*thdr), 0,
-					       &ecurr.addr, ecurr.addrlen);
-
-					whine("You aborted call!\n");
-					goto out_err;
-				}
-			}
+/*
+ * Gate for probes that have no call yet: every source gets a small
+ * token bucket, and v2 callers must echo our cookie first. Legacy
+ * peers know no cookies and are only rate limited.
+ */
+static int engine_admit(struct engine *e, int sock, struct sockaddr *addr,
+			socklen_t addrlen, const struct transsip_pkt *pkt)
+{
+	uint64_t now = engine_now();
 
-			if (fds[i].fd == *csock) {
-				memset(msg, 0, sizeof(msg));
-				raddrlen = sizeof(raddr);
-				ret = recvfrom(*csock, msg, sizeof(msg), 0,
-					       &raddr, &raddrlen);
-				if (ret <= 0)
-					continue;
-
-				if (raddrlen != ecurr.addrlen)
-					continue;
-				if (memcmp(&raddr, &ecurr.addr, raddrlen))
-					continue;
-
-				thdr = (struct transsip_hdr *) msg;
-				if (thdr->est == 1 && thdr->psh == 1) {
-					ecurr.active = 1;
-					whine("Call established!\n");
-					return ENGINE_STATE_SPEAKING;
-				}
-				if (thdr->bsy == 1 || thdr->fin == 1) {
-					whine("Remote end busy!\n");
-					engine_play_busy(dev);
-					engine_play_busy(dev);
-					goto out_err;
-				}
-			}
-		}
+	if (!ratelimit_allow(e->rl, addr, now)) {
+		e->flood.limited++;
+		return 0;
+	}
 
-		engine_play_dial(dev);
+	if (pkt->version == TRANSSIP_VERSION &&
+	    !engine_cookie_ok(e, addr, pkt, now)) {
+		if (pkt->type == TRANSSIP_PT_COOKIE)
+			e->flood.bad_cookies++;
+		else
+			engine_send_cookie(e, sock, addr, addrlen,
+					   pkt->callid, now);
+		return 0;
 	}
 
-out_err:
-	close(*csock);
-	*csock = 0;
- 	return ENGINE_STATE_IDLE;
+	e->flood.admitted++;
+	return 1;
 }
 
-static enum engine_state_num engine_do_callin(int ssock, int *csock, int usocki,
-					      int usocko, struct alsa_dev *dev)
+/*
+ * Frames stay in their pool buffers, so the jitter buffer must neither
+ * copy nor free them; references are dropped by engine_hold_release().
+ */
+static void engine_jitter_keep(void *data)
 {
-	int i;
-	ssize_t ret;
-	char msg[MAX_MSG];
-	struct sockaddr raddr;
-	socklen_t raddrlen;
-	struct transsip_hdr *thdr;
-	char hbuff[256], sbuff[256];
-	struct pollfd fds[2];
-	struct cli_pkt cpkt;
-
-	assert(ecurr.active == 0);
+}
 
-	memset(&msg, 0, sizeof(msg));
-	raddrlen = sizeof(raddr);
-	ret = recvfrom(ssock, msg, sizeof(msg), 0, &raddr, &raddrlen);
-	if (ret <= 0) {
-		whine("Receive error %s!\n", strerror(errno));
-		return ENGINE_STATE_IDLE;
-	}
+static inline void engine_hold_release(struct engine *e,
+				       struct session_hold *h)
+{
+	pktbuf_put(e->pool, h->buf);
+	h->buf = NULL;
+}
 
-	thdr = (struct transsip_hdr *) msg;
-	if (thdr->est != 1)
-		return ENGINE_STATE_IDLE;
+static void engine_session_media_init(struct engine *e, struct session *s)
+{
+	int tmp = FRAME_SIZE;
 
-	memcpy(&ecurr.addr, &raddr, raddrlen);
-	ecurr.addrlen = raddrlen;
-	ecurr.sock = ssock;
-	ecurr.active = 0;
+	s->encoder = celt_encoder_create(e->mode, 1, NULL);
+	s->decoder = celt_decoder_create(e->mode, 1, NULL);
 
-	memset(hbuff, 0, sizeof(hbuff));
-	memset(sbuff, 0, sizeof(sbuff));
-	getnameinfo((struct sockaddr *) &raddr, raddrlen, hbuff, sizeof(hbuff),
-		    sbuff, sizeof(sbuff), NI_NUMERICHOST | NI_NUMERICSERV);
+	s->jitter = jitter_buffer_init(FRAME_SIZE);
+	jitter_buffer_ctl(s->jitter, JITTER_BUFFER_SET_MARGIN, &tmp);
+	jitter_buffer_ctl(s->jitter, JITTER_BUFFER_SET_DESTROY_CALLBACK,
+			  (void *) engine_jitter_keep);
+	s->margin = tmp;
+	s->rc.size = PACKETSIZE;
 
-	printf("New incoming connection from %s:%s!\n", hbuff, sbuff);
-	printf("Answer it with: take\n");
-	printf("Reject it with: hangup\n");
-	fflush(stdout);
+	if (e->red)
+		s->red_encoder = celt_encoder_create(e->mode, 1, NULL);
+	s->red_len = 0;
+	s->bundled = 0;
 
-	fds[0].fd = ssock;
-	fds[0].events = POLLIN;
-	fds[1].fd = usocki;
-	fds[1].events = POLLIN;
+	s->send_seq = 0;
+	s->recv_started = 0;
+}
 
-	while (likely(!quit)) {
-		poll(fds, array_size(fds), 1500);
+static void engine_session_media_destroy(struct engine *e,
+					  struct session *s)
+{
+	int i;
 
-		for (i = 0; i < array_size(fds); ++i) {
-			if ((fds[i].revents & POLLIN) != POLLIN)
-				continue;
+	if (s->encoder)
+		celt_encoder_destroy(s->encoder);
+	if (s->decoder)
+		celt_decoder_destroy(s->decoder);
+	if (s->red_encoder)
+		celt_encoder_destroy(s->red_encoder);
+	if (s->jitter)
+		jitter_buffer_destroy(s->jitter);
+	for (i = 0; i < SESSION_HOLD_RING; ++i) {
+		if (s->held[i].buf)
+			engine_hold_release(e, &s->held[i]);
+	}
+	s->synced = 0;
 
-			if (fds[i].fd == ssock) {
-				memset(msg, 0, sizeof(msg));
-				raddrlen = sizeof(raddr);
-				ret = recvfrom(ssock, msg, sizeof(msg), 0,
-					       &raddr, &raddrlen);
-				if (ret <= 0)
-					continue;
-				if (raddrlen != ecurr.addrlen)
-					continue;
-				if (memcmp(&raddr, &ecurr.addr, raddrlen))
-					continue;
-
-				if (thdr->fin == 1 || thdr->bsy == 1) {
-					whine("Remote end hung up!\n");
-					engine_play_busy(dev);
-					engine_play_busy(dev);
-					goto out_err;
-				}
+	if (s->fec)
+		xfree(s->fec);
 
-			}
+	s->encoder = NULL;
+	s->decoder = NULL;
+	s->red_encoder = NULL;
+	s->jitter = NULL;
+	s->fec = NULL;
+}
 
-			if (fds[i].fd == usocki) {
-				ret = read(usocki, &cpkt, sizeof(cpkt));
-				if (ret <= 0) {
-					whine("Error reading from cli!\n");
-					continue;
-				}
-				if (cpkt.fin) {
-					memset(&msg, 0, sizeof(msg));
-					thdr = (struct transsip_hdr *) msg;
-					thdr->bsy = 1;
-					thdr->fin = 1;
-
-					sendto(ssock, msg, sizeof(*thdr), 0,
-					       &ecurr.addr, ecurr.addrlen);
-
-					whine("You aborted call!\n");
-					goto out_err;
-				}
-				if (cpkt.take) {
-					memset(&msg, 0, sizeof(msg));
-					thdr = (struct transsip_hdr *) msg;
-					thdr->est = 1;
-					thdr->psh = 1;
-
-					ret = sendto(ssock, msg, sizeof(*thdr), 0,
-						     &ecurr.addr, ecurr.addrlen);
-					if (ret <= 0) {
-						whine("Error sending ack!\n");
-						goto out_err;
-					}
-
-					ecurr.active = 1;
-					whine("Call established!\n");
-					return ENGINE_STATE_SPEAKING;
-				}
-			}
-		}
+static void engine_on_audio(struct reactor_fd *rf, uint32_t events)
+{
+	unsigned int i;
+	struct engine *e = rf->arg;
 
-		engine_play_ring(dev);
+	for (i = 0; i < e->anfds; ++i) {
+		if (e->apfds[i].fd == rf->fd)
+			e->apfds[i].revents |= events;
 	}
 
-out_err:
-	return ENGINE_STATE_IDLE;
+	e->audio_ready = 1;
 }
 
-static enum engine_state_num engine_do_speaking(int ssock, int *csock,
-						int usocki, int usocko,
-						struct alsa_dev *dev)
+static void engine_audio_attach(struct engine *e)
 {
-	ssize_t ret;
-	int recv_started = 0, nfds = 0, tmp, i, one;
-	struct pollfd *pfds = NULL;
-	char msg[MAX_MSG];
-	uint32_t send_seq = 0;
-	CELTMode *mode;
-	CELTEncoder *encoder;
-	CELTDecoder *decoder;
-	JitterBuffer *jitter;
-	SpeexPreprocessState *preprocess;
-	SpeexEchoState *echo_state;
-	struct sockaddr raddr;
-	struct transsip_hdr *thdr;
-	socklen_t raddrlen;
-	struct cli_pkt cpkt;
+	int ret;
+	unsigned int i, j;
 
-	assert(ecurr.active == 1);
+	alsa_getfds(e->dev, e->apfds, e->anfds);
 
-	mode = celt_mode_create(SAMPLING_RATE, FRAME_SIZE, NULL);
-	encoder = celt_encoder_create(mode, 1, NULL);
-	decoder = celt_decoder_create(mode, 1, NULL);
+	for (i = 0; i < e->anfds; ++i) {
+		ret = reactor_add(&e->r, &e->audio_rf[i], e->apfds[i].fd,
+				  e->apfds[i].events, engine_on_audio, e);
+		if (ret != -EEXIST)
+			continue;
 
-	jitter = jitter_buffer_init(FRAME_SIZE);
-	tmp = FRAME_SIZE;
-	jitter_buffer_ctl(jitter, JITTER_BUFFER_SET_MARGIN, &tmp);
+		/* Capture and playback may share a descriptor. */
+		e->audio_rf[i].fd = -1;
+		for (j = 0; j < i; ++j) {
+			if (e->audio_rf[j].fd != e->apfds[i].fd)
+				continue;
+			reactor_mod(&e->r, &e->audio_rf[j],
+				    e->audio_rf[j].events |
+				    e->apfds[i].events);
+			break;
+		}
+	}
+}
 
-	echo_state = speex_echo_state_init(FRAME_SIZE, 10 * FRAME_SIZE);
-	tmp = SAMPLING_RATE;
-	speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &tmp);
+static void engine_audio_detach(struct engine *e)
+{
+	unsigned int i;
 
-	one = 1;
-	preprocess = speex_preprocess_state_init(FRAME_SIZE, SAMPLING_RATE);
-	speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_DENOISE, &one);
-	speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_AGC, &one);
-	speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_DEREVERB, &one);
-	speex_preprocess_ctl(preprocess, SPEEX_PREPROCESS_SET_ECHO_STATE,
-			     echo_state);
+	for (i = 0; i < e->anfds; ++i)
+		reactor_del(&e->r, &e->audio_rf[i]);
 
-	nfds = alsa_nfds(dev);
-	pfds = xmalloc(sizeof(*pfds) * (nfds + 2));
+	e->audio_ready = 0;
+}
 
-	alsa_getfds(dev, pfds, nfds);
+static void engine_audio_update(struct engine *e)
+{
+	int want = e->sessions.count > 0 || e->busy_left > 0;
+
+	if (e->headless) {
+		if (want && !e->audio_on)
+			reactor_timer_arm(&e->clock, FRAME_NSEC, FRAME_NSEC);
+		else if (!want && e->audio_on)
+			reactor_timer_disarm(&e->clock);
+		e->audio_on = want;
+		return;
+	}
 
-	pfds[nfds].fd = ecurr.sock;
-	pfds[nfds].events = POLLIN;
-	pfds[nfds + 1].fd = usocki;
-	pfds[nfds + 1].events = POLLIN;
+	if (want && !e->audio_on) {
+		speex_echo_state_reset(e->echo_state);
+		alsa_start(e->dev);
+		engine_audio_attach(e);
+		e->audio_on = 1;
+	} else if (!want && e->audio_on) {
+		engine_audio_detach(e);
+		alsa_stop(e->dev);
+		e->audio_on = 0;
+	}
+}
 
-	alsa_start(dev);
+static void engine_notify_state(struct engine *e)
+{
+	int arg = ENGINE_STATE_IDLE;
+	struct session *s;
 
-	while (likely(!quit)) {
-		poll(pfds, nfds + 2, -1);
+	/* Only the cli worker drives the prompt. */
+	if (e->id > 0)
+		return;
 
-		if (pfds[nfds + 1].revents & POLLIN) {
-			ret = read(usocki, &cpkt, sizeof(cpkt));
-			if (ret <= 0) {
-				whine("Read error from cli!\n");
-				continue;
-			}
-			if (cpkt.fin) {
-				whine("You aborted call!\n");
-				goto out_err;
-			}
+	if (!e->curr) {
+		for_each_session(&e->sessions, s) {
+			e->curr = s;
+			break;
 		}
+	}
+	if (e->curr)
+		arg = e->curr->state;
 
-		if (pfds[nfds].revents & POLLIN) {
-			JitterBufferPacket packet;
+	call_notifier_exec(CALL_STATE_MACHINE_CHANGED, &arg);
+}
 
-			memset(msg, 0, sizeof(msg));
-			raddrlen = sizeof(raddr);
-			ret = recvfrom(ecurr.sock, msg, sizeof(msg), 0,
-				       &raddr, &raddrlen);
-			if (unlikely(ret <= 0))
-				continue;
+/* Drops since the last look are booked on the filter that was active. */
+static void engine_filter_account(struct engine *e, int sock, int filter,
+				  uint32_t *drops)
+{
+	uint32_t now = sock_drops(sock);
 
-			if (raddrlen != ecurr.addrlen ||
-			    memcmp(&raddr, &ecurr.addr, raddrlen)) {
-				memset(msg, 0, sizeof(msg));
+	if (filter >= 0)
+		e->filters[filter].drops += now - *drops;
+	*drops = now;
+}
 
-				thdr = (struct transsip_hdr *) msg;
-				thdr->bsy = 1;
-				thdr->fin = 1;
+static void engine_filter_set(struct engine *e, int sock, int *filter,
+			      uint32_t *drops, int type)
+{
+	engine_filter_account(e, sock, *filter, drops);
+	if (*filter == type)
+		return;
 
-				sendto(ecurr.sock, msg, sizeof(*thdr), 0,
-				       &raddr, raddrlen);
+	if (sock_attach_filter(sock, type) < 0) {
+		whine("Cannot attach socket filter!\n");
+		type = -1;
+	}
 
-				goto out_alsa;
-			}
+	*filter = type;
+}
 
-			thdr = (struct transsip_hdr *) msg;
-			if (thdr->fin == 1) {
-				whine("Remote end hung up!\n");
-				goto out_err;
-			}
+/*
+ * While we have no calls, only probes can be of use on the listener,
+ * unless a fin still waits for its ack.
+ * A call's own socket takes anything well-formed until the call is
+ * up, then only media and hangups.
+ */
+static void engine_filter_listener(struct engine *e)
+{
+	engine_filter_set(e, e->ssock, &e->filter, &e->filter_drops,
+			  e->sessions.count || e->nlinger ? SOCK_FILTER_ANY :
+			  SOCK_FILTER_PROBE);
+}
 
-			packet.data = msg + sizeof(*thdr);
-			packet.len = ret - sizeof(*thdr);
-			packet.timestamp = ntohl(thdr->seq);
-			packet.span = FRAME_SIZE;
-			packet.sequence = 0;
+static void engine_filter_update(struct engine *e, struct session *s)
+{
+	engine_filter_listener(e);
 
-			jitter_buffer_put(jitter, &packet);
-			recv_started = 1;
-		}
-out_alsa:
-		if (alsa_play_ready(dev, pfds, nfds)) {
-			short pcm[FRAME_SIZE];
-
-			if (recv_started) {
-				JitterBufferPacket packet;
-
-				memset(msg, 0, sizeof(msg));
-				packet.data = msg;
-				packet.len  = MAX_MSG;
-
-				jitter_buffer_tick(jitter);
-				jitter_buffer_get(jitter, &packet,
-						  FRAME_SIZE, NULL);
-				if (packet.len == 0)
-					packet.data = NULL;
-
-				celt_decode(decoder, (const unsigned char *)
-					    packet.data, packet.len, pcm);
-			} else {
-				for (i = 0; i < FRAME_SIZE; ++i)
-					pcm[i] = 0;
-			}
+	if (s->used && s->sock >= 0 && s->sock != e->ssock)
+		engine_filter_set(e, s->sock, &s->filter, &s->drops,
+				  s->state == ENGINE_STATE_SPEAKING ?
+				  SOCK_FILTER_MEDIA : SOCK_FILTER_ANY);
+}
 
-			if (alsa_write(dev, pcm, FRAME_SIZE))
-				speex_echo_state_reset(echo_state);
-			speex_echo_playback(echo_state, pcm);
-		}
+static void engine_on_session_sock(struct reactor_fd *rf, uint32_t events);
+static void engine_on_race_sock(struct reactor_fd *rf, uint32_t events);
+static void engine_on_rtx_timer(struct reactor_timer *t, uint64_t expired);
+static unsigned int engine_recv(struct engine *e, int sock);
+static void engine_on_session_timer(struct reactor_timer *t,
+				    uint64_t expired);
+static void engine_on_shm(struct reactor_fd *rf, uint32_t events);
 
-		if (alsa_cap_ready(dev, pfds, nfds)) {
-			short pcm[FRAME_SIZE];
-			short pcm2[FRAME_SIZE];
+static void engine_session_set_sock(struct engine *e, struct session *s,
+				    int sock)
+{
+	s->sock = sock;
+	s->filter = -1;
+	s->txtime = 0;
+
+	if (e->pace == ENGINE_PACE_TXTIME && sock >= 0)
+		s->txtime = sock == e->ssock ? e->ssock_txtime :
+			    sock_enable_txtime(sock) == 0;
+
+	if (sock >= 0 && sock != e->ssock) {
+		engine_filter_set(e, sock, &s->filter, &s->drops,
+				  SOCK_FILTER_ANY);
+		reactor_add(&e->r, &s->rf, sock, EPOLLIN,
+			    engine_on_session_sock, e);
+	}
+}
 
-			memset(msg, 0, sizeof(msg));
+/* Racing call-outs have no socket until a candidate answered. */
+static void engine_session_attach(struct engine *e, struct session *s,
+				  int sock)
+{
+	s->state = ENGINE_STATE_IDLE;
+	engine_session_set_sock(e, s, sock);
 
-			alsa_read(dev, pcm, FRAME_SIZE);
+	reactor_timer_init(&e->r, &s->timer, engine_on_session_timer, e);
+	reactor_timer_init(&e->r, &s->rtx_timer, engine_on_rtx_timer, e);
+}
 
-			speex_echo_capture(echo_state, pcm, pcm2);
-			for (i = 0; i < FRAME_SIZE; ++i)
-				pcm[i] = pcm2[i];
+/* Slots stay put, the reactor may still hold events for a freed one. */
+static void engine_race_free(struct engine *e, struct engine_race *race)
+{
+	unsigned int i;
 
-			speex_preprocess_run(preprocess, pcm);
+	reactor_timer_destroy(&e->r, &race->timer);
 
-			celt_encode(encoder, pcm, NULL, (unsigned char *)
-				    (msg + sizeof(*thdr)), PACKETSIZE);
+	for (i = 0; i < race->num; ++i) {
+		if (race->socks[i] < 0)
+			continue;
+		reactor_del(&e->r, &race->rf[i]);
+		close(race->socks[i]);
+	}
 
-			thdr = (struct transsip_hdr *) msg;
-			thdr->psh = 1;
-			thdr->est = 1;
-			thdr->seq = htonl(send_seq);
-			send_seq += FRAME_SIZE;
+	race->used = 0;
+}
 
-			ret = sendto(ecurr.sock, msg,
-				     PACKETSIZE + sizeof(*thdr), 0,
-				     &ecurr.addr, ecurr.addrlen);
-			if (ret <= 0) {
-				whine("Send datagram failed!\n");
-				goto out_err;
-			}
-		}
+static struct engine_race *engine_race_find(struct engine *e,
+					    struct session *s)
+{
+	int i;
+
+	for (i = 0; i < MAX_RACES; ++i) {
+		if (e->races[i].used && e->races[i].s == s)
+			return &e->races[i];
 	}
 
-out_err:
-	alsa_stop(dev);
+	return NULL;
+}
+
+static void engine_session_detach(struct engine *e, struct session *s)
+{
+	struct engine_race *race = engine_race_find(e, s);
 
-	memset(msg, 0, sizeof(msg));
-	thdr = (struct transsip_hdr *) msg;
-	thdr->fin = 1;
+	if (race)
+		engine_race_free(e, race);
 
-	sendto(ecurr.sock, msg, sizeof(*thdr), 0, &ecurr.addr,
-	       ecurr.addrlen);
+	reactor_timer_destroy(&e->r, &s->timer);
+	reactor_timer_destroy(&e->r, &s->rtx_timer);
 
-	if (ecurr.sock == *csock) {
-		close(*csock);
-		*csock = 0;
+	if (s->sock >= 0 && s->sock != e->ssock) {
+		engine_filter_account(e, s->sock, s->filter, &s->drops);
+		reactor_del(&e->r, &s->rf);
+		close(s->sock);
 	}
 
-	celt_encoder_destroy(encoder);
-	celt_decoder_destroy(decoder);
-	celt_mode_destroy(mode);
+	s->sock = -1;
+}
 
-	speex_preprocess_state_destroy(preprocess);
-	jitter_buffer_destroy(jitter);
+static inline enum engine_ctl_type engine_ctl_type(uint8_t flags)
+{
+	if (flags & TRANSSIP_FIN)
+		return ENGINE_CTL_FIN;
+	if (flags & TRANSSIP_PSH)
+		return ENGINE_CTL_PSH;
+	return ENGINE_CTL_EST;
+}
 
-	xfree(pfds);
+/* RFC 6298 with ns granularity. */
+static void engine_rtt_update(uint64_t *srtt, uint64_t *rttvar, uint64_t rtt)
+{
+	uint64_t err;
+
+	if (*srtt == 0) {
+		*srtt = rtt;
+		*rttvar = rtt / 2;
+	} else {
+		err = *srtt > rtt ? *srtt - rtt : rtt - *srtt;
+		*rttvar = (3 * *rttvar + err) / 4;
+		*srtt = (7 * *srtt + rtt) / 8;
+	}
+}
 
-	ecurr.active = 0;
-	return ENGINE_STATE_IDLE;
+static inline uint64_t engine_rto(uint64_t srtt, uint64_t rttvar)
+{
+	return min(max(srtt + 4 * rttvar, RTO_MIN), RTO_MAX);
 }
 
-static inline void engine_drop_from_queue(int sock)
+/* Samples of control packets follow Karn's rule. */
+static void engine_rtt_sample(struct engine *e, uint64_t rtt)
 {
-	char msg[MAX_MSG];
-	recv(sock, msg, sizeof(msg), 0);
+	engine_rtt_update(&e->srtt, &e->rttvar, rtt);
+	e->rto = engine_rto(e->srtt, e->rttvar);
 }
 
-static enum engine_state_num engine_do_idle(int ssock, int *csock, int usocki,
-					    int usocko, struct alsa_dev *dev)
+/* Calls that timed their own path go by it, see engine_rtt_echo(). */
+static uint64_t engine_session_rto(struct engine *e, struct session *s)
 {
-	int i;
-	ssize_t ret;
-	struct pollfd fds[2];
-	char msg[MAX_MSG];
-	struct transsip_hdr *thdr;
-	struct cli_pkt cpkt;
+	return s->srtt ? engine_rto(s->srtt, s->rttvar) : e->rto;
+}
 
-	assert(ecurr.active == 0);
+static void engine_ctl_fill(struct engine *e, struct session *s,
+			    struct transsip_pkt *pkt)
+{
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->version = s->version;
+	pkt->flags = s->rtx_flags;
+	pkt->type = TRANSSIP_PT_CTL;
+	pkt->callid = s->callid;
+	pkt->ptime = e->ptime;
+
+	if (s->cookie && engine_ctl_type(pkt->flags) == ENGINE_CTL_EST) {
+		pkt->type = TRANSSIP_PT_COOKIE;
+		pkt->payload = (uint8_t *) &s->cookie;
+		pkt->len = sizeof(s->cookie);
+	}
+}
 
-	fds[0].fd = ssock;
-	fds[0].events = POLLIN;
-	fds[1].fd = usocki;
-	fds[1].events = POLLIN;
+/* A racing call-out has no socket yet, all live candidates get it. */
+static void engine_ctl_xmit(struct engine *e, struct session *s)
+{
+	unsigned int i;
+	struct engine_race *race;
+	struct transsip_pkt pkt;
+
+	if (s->sock >= 0) {
+		engine_ctl_fill(e, s, &pkt);
+		engine_send_probe(s, s->sock, (struct sockaddr *) &s->addr,
+				  s->addrlen, &pkt);
+		return;
+	}
 
-	while (likely(!quit)) {
-		memset(msg, 0, sizeof(msg));
+	race = engine_race_find(e, s);
+	for (i = 0; race && i < race->num; ++i) {
+		if (race->socks[i] < 0)
+			continue;
+		engine_ctl_fill(e, s, &pkt);
+		engine_send_probe(s, race->socks[i], NULL, 0, &pkt);
+	}
+}
 
-		poll(fds, array_size(fds), 1000);
+/*
+ * Sends a control packet and keeps resending it with exponential
+ * backoff until the peer's reply acks it. Probes are only limited by
+ * CALLOUT_TIMEOUT, answers are given up after RTX_MAX tries.
+ */
+static void engine_ctl_start(struct engine *e, struct session *s,
+			     uint8_t flags, int send)
+{
+	s->rtx_flags = flags;
+	s->rtx_count = 0;
+	s->rtx_sent = engine_now();
+	s->rto = engine_session_rto(e, s);
+
+	if (send)
+		engine_ctl_xmit(e, s);
+
+	reactor_timer_arm(&s->rtx_timer, s->rto, 0);
+}
+
+/*
+ * Only replies the peer sends right away are timed. A probe may also
+ * be acked by the answer, which waits for someone to pick up.
+ */
+static void engine_ctl_ack(struct engine *e, struct session *s, int timed)
+{
+	uint64_t now = engine_now();
+
+	if (!s->rtx_flags)
+		return;
+
+	if (timed && s->rtx_count == 0)
+		engine_rtt_sample(e, now - s->rtx_sent);
+	if (timed && engine_ctl_type(s->rtx_flags) == ENGINE_CTL_EST) {
+		e->ctl.handshakes++;
+		e->ctl.handshake_ns += now - s->rtx_sent;
+	}
+
+	s->rtx_flags = 0;
+	reactor_timer_disarm(&s->rtx_timer);
+}
+
+static void engine_hangup(struct engine *e, struct session *s);
+
+static void engine_on_rtx_timer(struct reactor_timer *t, uint64_t expired)
+{
+	struct engine *e = t->arg;
+	struct session *s = container_of(t, struct session, rtx_timer);
+	enum engine_ctl_type type = engine_ctl_type(s->rtx_flags);
+
+	if (!s->rtx_flags)
+		return;
+
+	if (type != ENGINE_CTL_EST && s->rtx_count >= RTX_MAX) {
+		whine("No ack from remote end!\n");
+		e->ctl.gave_up[type]++;
+		s->rtx_flags = 0;
+		engine_hangup(e, s);
+		return;
+	}
+
+	s->rtx_count++;
+	e->ctl.rtx[type]++;
+	engine_ctl_xmit(e, s);
+
+	s->rto = min(2 * s->rto, RTO_MAX);
+	reactor_timer_arm(&s->rtx_timer, s->rto, 0);
+}
+
+static void engine_linger_free(struct engine *e, struct engine_linger *l)
+{
+	reactor_timer_destroy(&e->r, &l->timer);
+
+	if (l->own) {
+		reactor_del(&e->r, &l->rf);
+		close(l->sock);
+	}
+
+	l->used = 0;
+	e->nlinger--;
+	engine_filter_listener(e);
+}
+
+static void engine_linger_xmit(struct engine_linger *l)
+{
+	engine_send_ctl_to(l->sock, (struct sockaddr *) &l->addr, l->addrlen,
+			   l->version, l->callid, l->flags);
+}
+
+static void engine_on_linger_timer(struct reactor_timer *t, uint64_t expired)
+{
+	struct engine_linger *l = container_of(t, struct engine_linger, timer);
+	struct engine *e = l->e;
+
+	if (l->tries >= RTX_MAX) {
+		e->ctl.gave_up[ENGINE_CTL_FIN]++;
+		engine_linger_free(e, l);
+		return;
+	}
+
+	l->tries++;
+	e->ctl.rtx[ENGINE_CTL_FIN]++;
+	engine_linger_xmit(l);
+
+	l->rto = min(2 * l->rto, RTO_MAX);
+	reactor_timer_arm(&l->timer, l->rto, 0);
+}
+
+static void engine_on_linger_sock(struct reactor_fd *rf, uint32_t events)
+{
+	struct engine_linger *l = container_of(rf, struct engine_linger, rf);
+
+	/* Whatever else comes in finds no call and goes nowhere. */
+	engine_recv(l->e, rf->fd);
+}
+
+static struct engine_linger *engine_linger_find(struct engine *e,
+						uint32_t callid)
+{
+	int i;
+
+	for (i = 0; i < MAX_LINGER; ++i) {
+		if (e->lingers[i].used && e->lingers[i].callid == callid)
+			return &e->lingers[i];
+	}
+
+	return NULL;
+}
+
+/* Both ends hung up at once, the peer waits for our ack as we for its. */
+static int engine_fin_lingers(struct engine *e, uint32_t callid,
+			      const struct sockaddr *raddr)
+{
+	struct engine_linger *l = engine_linger_find(e, callid);
+
+	return l && sock_addr_equal((struct sockaddr *) &l->addr, raddr);
+}
+
+static void engine_linger_ack(struct engine *e, uint32_t callid)
+{
+	struct engine_linger *l = engine_linger_find(e, callid);
+
+	if (!l)
+		return;
+
+	if (l->tries == 0)
+		engine_rtt_sample(e, engine_now() - l->sent);
+	engine_linger_free(e, l);
+}
+
+/*
+ * Sends the fin and hands it to a linger slot that resends it until
+ * acked; the call itself can go right away. Legacy peers never ack,
+ * they get RTX_MAX copies. Without a free slot the fin goes out once.
+ */
+static void engine_send_fin(struct engine *e, struct session *s,
+			    uint8_t flags)
+{
+	int i;
+	struct engine_linger *l = NULL;
+
+	for (i = 0; i < MAX_LINGER && !l; ++i) {
+		if (!e->lingers[i].used)
+			l = &e->lingers[i];
+	}
+
+	if (!l) {
+		engine_send_ctl(s, flags);
+		return;
+	}
+
+	memset(l, 0, sizeof(*l));
+	l->used = 1;
+	l->e = e;
+	l->sock = s->sock;
+	l->version = s->version;
+	l->callid = s->callid;
+	l->flags = flags;
+	l->sent = engine_now();
+	l->rto = engine_session_rto(e, s);
+	memcpy(&l->addr, &s->addr, s->addrlen);
+	l->addrlen = s->addrlen;
+	l->rf.fd = -1;
+
+	/* The call's own socket is ours now, detach must not close it. */
+	if (s->sock != e->ssock) {
+		engine_filter_account(e, s->sock, s->filter, &s->drops);
+		reactor_del(&e->r, &s->rf);
+		s->sock = -1;
+
+		l->own = 1;
+		reactor_add(&e->r, &l->rf, l->sock, EPOLLIN,
+			    engine_on_linger_sock, e);
+	}
+
+	reactor_timer_init(&e->r, &l->timer, engine_on_linger_timer, e);
+	reactor_timer_arm(&l->timer, l->rto, 0);
+
+	e->nlinger++;
+	engine_linger_xmit(l);
+}
+
+/*
+ * Resumption proofs are keyed by the setup cookie and bound to the call
+ * id. The cookie goes over the wire in clear, in the COOKIE exchange,
+ * so this only keeps out off-path attackers. One who saw the setup can
+ * forge proofs and move the call.
+ */
+static void engine_call_key(struct session *s, uint8_t *key)
+{
+	memset(key, 0, SIPHASH_KEY_LEN);
+	memcpy(key, &s->cookie, sizeof(s->cookie));
+	memcpy(key + sizeof(s->cookie), &s->callid, sizeof(s->callid));
+}
+
+static uint64_t engine_resume_mac(struct session *s, uint64_t nonce)
+{
+	uint8_t key[SIPHASH_KEY_LEN];
+
+	engine_call_key(s, key);
+	return siphash24(key, &nonce, sizeof(nonce));
+}
+
+/*
+ * Ring offers prove the call the same way, so the cookie is not handed
+ * to the local socket. The tag makes the input longer than a nonce, a
+ * token is thus no resumption proof.
+ */
+static uint64_t engine_shm_token(struct session *s)
+{
+	uint8_t key[SIPHASH_KEY_LEN];
+	uint32_t tag[3] = { SHM_MAGIC, s->callid, 0 };
+
+	engine_call_key(s, key);
+	return siphash24(key, tag, sizeof(tag));
+}
+
+static void engine_shm_attach(struct engine *e, struct session *s,
+			      struct shm_chan *c)
+{
+	s->shm = xmalloc(sizeof(*s->shm));
+	memcpy(s->shm, c, sizeof(*c));
+	reactor_add(&e->r, &s->shm_rf, c->rx_efd, EPOLLIN, engine_on_shm, e);
+}
+
+static void engine_shm_close(struct engine *e, struct session *s)
+{
+	if (!s->shm)
+		return;
+
+	reactor_del(&e->r, &s->shm_rf);
+	shm_chan_destroy(s->shm);
+	xfree(s->shm);
+	s->shm = NULL;
+	s->shm_tx = 0;
+}
+
+/*
+ * Media of calls to a peer on this host skips the UDP stack. The
+ * caller offers a ring to all workers of the callee's port, the one
+ * that has the call takes it and answers through it, which is when
+ * our media follows. Control stays on UDP.
+ */
+static void engine_shm_offer(struct engine *e, struct session *s)
+{
+	unsigned int i;
+	uint16_t port = sock_addr_port((struct sockaddr *) &s->addr);
+	struct shm_chan c;
+	struct shm_offer o;
+
+	if (e->shm_sock < 0 || s->version != TRANSSIP_VERSION || s->shm ||
+	    !s->cookie || s->relay_tolen ||
+	    !sock_addr_is_local((struct sockaddr *) &s->addr))
+		return;
+
+	if (shm_chan_create(&c) < 0)
+		return;
+
+	o.magic = SHM_MAGIC;
+	o.callid = s->callid;
+	o.token = engine_shm_token(s);
+	for (i = 0; i < ENGINE_MAX_WORKERS; ++i) {
+		if (shm_offer(port, i, &o, &c) < 0)
+			break;
+	}
+
+	if (i == 0) {
+		shm_chan_destroy(&c);
+		return;
+	}
+
+	engine_shm_attach(e, s, &c);
+	e->local.offers++;
+}
+
+static void engine_set_state(struct engine *e, struct session *s,
+			     enum engine_state_num state)
+{
+	/* Early media: be ready to play the frame carried by the answer. */
+	if (state != ENGINE_STATE_IDLE && !s->encoder)
+		engine_session_media_init(e, s);
+
+	if (state == ENGINE_STATE_IDLE) {
+		engine_shm_close(e, s);
+		engine_session_media_destroy(e, s);
+		engine_session_detach(e, s);
+		session_free(&e->sessions, s);
+		if (e->curr == s)
+			e->curr = NULL;
+	} else {
+		if (state == ENGINE_STATE_CALLOUT)
+			reactor_timer_arm(&s->timer, CALLOUT_TIMEOUT, 0);
+		else
+			reactor_timer_disarm(&s->timer);
+
+		if (state == ENGINE_STATE_SPEAKING &&
+		    s->state == ENGINE_STATE_CALLOUT)
+			engine_shm_offer(e, s);
+
+		s->state = state;
+		e->curr = s;
+	}
+
+	engine_filter_update(e, s);
+	engine_audio_update(e);
+	engine_notify_state(e);
+}
+
+static void engine_hangup(struct engine *e, struct session *s)
+{
+	unsigned int i;
+	struct engine_race *race;
+
+	reactor_timer_disarm(&s->timer);
+	reactor_timer_disarm(&s->rtx_timer);
+
+	switch (s->state) {
+	case ENGINE_STATE_CALLOUT:
+		/* Any candidate that got our probe may be ringing. */
+		race = engine_race_find(e, s);
+		for (i = 0; race && i < race->num; ++i) {
+			if (race->socks[i] >= 0)
+				engine_send_ctl_to(race->socks[i], NULL, 0,
+						   s->version, s->callid,
+						   TRANSSIP_BSY |
+						   TRANSSIP_FIN);
+		}
+		/* fall through */
+	case ENGINE_STATE_CALLIN:
+		if (s->sock >= 0)
+			engine_send_fin(e, s, TRANSSIP_BSY | TRANSSIP_FIN);
+		break;
+	case ENGINE_STATE_SPEAKING:
+		engine_send_fin(e, s, TRANSSIP_FIN);
+		break;
+	default:
+		break;
+	}
+
+	engine_set_state(e, s, ENGINE_STATE_IDLE);
+}
+
+static void engine_list_sessions(struct engine *e)
+{
+	struct session *s;
+	char hbuff[256], sbuff[256];
+
+	if (e->sessions.count == 0) {
+		printf("No active calls!\n");
+		goto out;
+	}
+
+	printf("%3s %-9s %-8s %-32s %10s %10s %8s %8s %8s %5s %6s\n", "id",
+	       "state", "callid", "peer", "rx", "tx", "plc", "rtt ms",
+	       "var ms", "bytes", "loss %");
+
+	for_each_session(&e->sessions, s) {
+		memset(hbuff, 0, sizeof(hbuff));
+		memset(sbuff, 0, sizeof(sbuff));
+		getnameinfo((struct sockaddr *) &s->addr, s->addrlen,
+			    hbuff, sizeof(hbuff), sbuff, sizeof(sbuff),
+			    NI_NUMERICHOST | NI_NUMERICSERV);
+
+		printf("%3d %-9s %08x %s:%-*s %10llu %10llu %8llu %8.2f "
+		       "%8.2f %5d %6.1f\n", s->id, state_names[s->state],
+		       s->callid, hbuff,
+		       (int) max(1, 31 - (int) strlen(hbuff)), sbuff,
+		       (unsigned long long) s->stats.frames_rx,
+		       (unsigned long long) s->stats.frames_tx,
+		       (unsigned long long) s->stats.frames_plc,
+		       s->srtt / 1e6, s->rttvar / 1e6, s->rc.size,
+		       s->rc.fraction * 100.0 / 256);
+	}
+out:
+	fflush(stdout);
+}
+
+static uint64_t engine_cpu_time(struct engine *e)
+{
+	clockid_t cid;
+	struct timespec ts;
+
+	if (pthread_getcpuclockid(e->tid, &cid) ||
+	    clock_gettime(cid, &ts))
+		return 0;
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Counters of other workers are read racily, good enough for stats. */
+static void engine_dump_stats(void)
+{
+	int j;
+	unsigned int i;
+	char name[32];
+	uint64_t cpu, drops, packets;
+	struct engine *e;
+
+	for (i = 0; i < engine_workers; ++i) {
+		e = engines[i];
+		cpu = engine_cpu_time(e);
+
+		printf("worker %u (%s): calls: %u, periods: %llu, missed frame "
+		       "deadlines: %llu\n", e->id, e->un ? "io_uring" : "poll",
+		       e->sessions.count,
+		       (unsigned long long) e->stats.periods,
+		       (unsigned long long) e->stats.deadline_miss);
+		printf("worker %u cpu: %.3fs, %.2fus per frame\n", e->id,
+		       cpu / 1e9, e->stats.frames ?
+		       cpu / 1e3 / e->stats.frames : 0.0);
+		packets = e->stats.packets_tx + e->stats.packets_rx;
+		printf("worker %u media: ptime %u, %llu packets out, %llu in, "
+		       "%.2f frames and %.2fus per packet\n", e->id, e->ptime,
+		       (unsigned long long) e->stats.packets_tx,
+		       (unsigned long long) e->stats.packets_rx,
+		       packets ? (double) e->stats.frames / packets : 0.0,
+		       packets ? cpu / 1e3 / packets : 0.0);
+		printf("worker %u buffers: %u of %u in use, %u peak, %llu "
+		       "taken, %llu times empty, %.2f taken and %.1f bytes "
+		       "copied per frame\n", e->id, e->pool->used, PKTBUF_NUM,
+		       e->pool->stats.peak,
+		       (unsigned long long) e->pool->stats.gets,
+		       (unsigned long long) e->pool->stats.empty,
+		       e->hold.lent ?
+		       (double) e->pool->stats.gets / e->hold.lent : 0.0,
+		       e->hold.lent ?
+		       (double) e->pool->stats.copied / e->hold.lent : 0.0);
+		printf("worker %u jitter: %llu frames lent, %llu played, "
+		       "%llu expired, %llu duplicate, %llu stale, %llu "
+		       "outside window, %llu dropped\n", e->id,
+		       (unsigned long long) e->hold.lent,
+		       (unsigned long long) e->hold.played,
+		       (unsigned long long) e->hold.expired,
+		       (unsigned long long) e->hold.dups,
+		       (unsigned long long) e->hold.stale,
+		       (unsigned long long) e->hold.outside,
+		       (unsigned long long) e->hold.dropped);
+		printf("worker %u answer to first audio: %.2fms avg over "
+		       "%llu calls\n", e->id, e->stats.first_audio ?
+		       e->stats.first_audio_ns / 1e6 / e->stats.first_audio :
+		       0.0, (unsigned long long) e->stats.first_audio);
+
+		/* The listener's running drops are not booked yet. */
+		for (j = 0; j < __SOCK_FILTER_MAX; ++j) {
+			drops = e->filters[j].drops;
+			if (j == e->filter)
+				drops += sock_drops(e->ssock) - e->filter_drops;
+
+			printf("worker %u filter %s: %llu passed, %llu "
+			       "dropped\n", e->id, filter_names[j],
+			       (unsigned long long) e->filters[j].hits,
+			       (unsigned long long) drops);
+		}
+
+		printf("worker %u setup: %llu admitted, %llu rate limited, "
+		       "%llu cookies sent, %llu bad cookies\n", e->id,
+		       (unsigned long long) e->flood.admitted,
+		       (unsigned long long) e->flood.limited,
+		       (unsigned long long) e->flood.challenges,
+		       (unsigned long long) e->flood.bad_cookies);
+		printf("worker %u resume: %llu challenges, %llu calls "
+		       "moved, %llu bad proofs, %llu unproven frames\n",
+		       e->id,
+		       (unsigned long long) e->resume.challenges,
+		       (unsigned long long) e->resume.migrated,
+		       (unsigned long long) e->resume.bad_proofs,
+		       (unsigned long long) e->resume.unproven);
+
+		printf("worker %u ctl: srtt %.2fms, rto %.2fms, %llu "
+		       "handshakes in %.2fms avg, %llu call-outs answered "
+		       "in %.2fms avg\n", e->id, e->srtt / 1e6, e->rto / 1e6,
+		       (unsigned long long) e->ctl.handshakes,
+		       e->ctl.handshakes ?
+		       e->ctl.handshake_ns / 1e6 / e->ctl.handshakes : 0.0,
+		       (unsigned long long) e->ctl.setups, e->ctl.setups ?
+		       e->ctl.setup_ns / 1e6 / e->ctl.setups : 0.0);
+		for (j = 0; j < __ENGINE_CTL_MAX; ++j)
+			printf("worker %u ctl %s: %llu retransmits, %llu "
+			       "given up\n", e->id, ctl_names[j],
+			       (unsigned long long) e->ctl.rtx[j],
+			       (unsigned long long) e->ctl.gave_up[j]);
+
+		printf("worker %u fec: %llu groups, %llu repair sent, %llu "
+		       "received, %llu frames recovered\n", e->id,
+		       (unsigned long long) e->fec.groups,
+		       (unsigned long long) e->fec.repair_tx,
+		       (unsigned long long) e->fec.repair_rx,
+		       (unsigned long long) e->fec.recovered);
+		if (e->shm_sock >= 0)
+			printf("worker %u local: %llu offers, %llu taken, "
+			       "%llu refused, %llu packets out, %llu in, "
+			       "%llu ring full, %llu doorbells\n", e->id,
+			       (unsigned long long) e->local.offers,
+			       (unsigned long long) e->local.taken,
+			       (unsigned long long) e->local.refused,
+			       (unsigned long long) e->local.tx,
+			       (unsigned long long) e->local.rx,
+			       (unsigned long long) e->local.full,
+			       (unsigned long long) e->local.doorbells);
+		if (e->cap)
+			printf("worker %u capture: %llu records, %llu "
+			       "bytes, %llu errors\n", e->id,
+			       (unsigned long long) e->cap->stats.recs,
+			       (unsigned long long) e->cap->stats.bytes,
+			       (unsigned long long) e->cap->stats.errors);
+		if (e->red)
+			printf("worker %u red: %llu packets with %.1f extra "
+			       "bytes avg, %llu of %llu lost frames filled "
+			       "(%.1f%%)\n", e->id,
+			       (unsigned long long) e->redund.packets,
+			       e->redund.packets ? (double) e->redund.bytes /
+			       e->redund.packets : 0.0,
+			       (unsigned long long) e->redund.filled,
+			       (unsigned long long) (e->redund.filled +
+						     e->redund.plc),
+			       e->redund.filled + e->redund.plc ?
+			       100.0 * e->redund.filled /
+			       (e->redund.filled + e->redund.plc) : 0.0);
+		printf("worker %u rate: %llu reports sent, %llu received, "
+		       "%llu increases, %llu decreases, %llu timeouts\n",
+		       e->id, (unsigned long long) e->rate.reports_tx,
+		       (unsigned long long) e->rate.reports_rx,
+		       (unsigned long long) e->rate.increases,
+		       (unsigned long long) e->rate.decreases,
+		       (unsigned long long) e->rate.timeouts);
+
+		if (e->lowlat)
+			printf("worker %u rx: %llu kernel stamped, %.2fus "
+			       "avg / %.2fus max until read, %llu frames "
+			       "read past a tick\n", e->id,
+			       (unsigned long long) e->rxs.stamped,
+			       e->rxs.stamped ?
+			       e->rxs.delay_ns / 1e3 / e->rxs.stamped : 0.0,
+			       e->rxs.delay_max / 1e3,
+			       (unsigned long long) e->rxs.rescued);
+
+		if (e->pace != ENGINE_PACE_OFF) {
+			printf("worker %u pace %s: %llu frames, %llu late, "
+			       "%llu re-anchored\n", e->id, pace_names[e->pace],
+			       (unsigned long long) e->paced.frames,
+			       (unsigned long long) e->paced.late,
+			       (unsigned long long) e->paced.anchors);
+			if (e->wheel) {
+				struct pace_stats *ps = &e->wheel->stats;
+
+				printf("worker %u wheel: %llu queued, %llu "
+				       "overflowed, %llu clamped\n", e->id,
+				       (unsigned long long) ps->queued,
+				       (unsigned long long) ps->overflow,
+				       (unsigned long long) ps->clamped);
+			}
+		}
+
+		slprintf(name, sizeof(name), "worker %u net", e->id);
+		mmsg_dump_stats(name, &e->net);
+
+		if (e->resolv) {
+			slprintf(name, sizeof(name), "worker %u dns", e->id);
+			resolv_dump_stats(name, e->resolv);
+
+			printf("worker %u dial: %llu races, %llu won by the "
+			       "first candidate, %llu by a fallback, %.2fms "
+			       "to first answer\n", e->id,
+			       (unsigned long long) e->dial.races,
+			       (unsigned long long) e->dial.first,
+			       (unsigned long long) e->dial.fallback,
+			       e->dial.first + e->dial.fallback ?
+			       e->dial.reply_ns / 1e6 /
+			       (e->dial.first + e->dial.fallback) : 0.0);
+		}
+	}
+
+	fflush(stdout);
+}
+
+static void engine_send_resume(struct session *s, int sock,
+			       struct sockaddr *addr, socklen_t addrlen,
+			       const uint64_t *payload, size_t len)
+{
+	struct transsip_pkt pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = TRANSSIP_VERSION;
+	pkt.flags = TRANSSIP_EST | TRANSSIP_PSH;
+	pkt.type = TRANSSIP_PT_RESUME;
+	pkt.callid = s->callid;
+	pkt.payload = (const uint8_t *) payload;
+	pkt.len = len;
+
+	engine_send_pkt(sock, addr, addrlen, &pkt);
+}
+
+/* RFC 3550, A.3 and A.8, with arrival in samples. */
+static void engine_rr_update(struct engine *e, struct session *s,
+			     const struct transsip_pkt *pkt)
+{
+	struct session_rr *rr = &s->rr;
+	uint32_t transit, last = pkt->seq + (pkt->frames - 1) * FRAME_SIZE;
+	int32_t d;
+
+	if (!rr->received) {
+		rr->base = pkt->seq;
+		rr->highest = last;
+	} else if ((int32_t) (last - rr->highest) > 0) {
+		rr->highest = last;
+	}
+
+	transit = e->rx_at / 1000 * SAMPLING_RATE / 1000000 - pkt->seq;
+	if (rr->received) {
+		d = transit - rr->transit;
+		rr->jitter += abs(d) - ((rr->jitter + 8) >> 4);
+	}
+	rr->transit = transit;
+	rr->received += pkt->frames;
+
+	/* Frames whose slot was played or concealed already. */
+	d = s->played - pkt->seq;
+	if (s->tick_at && d > 0)
+		rr->late += min((uint32_t) (d + FRAME_SIZE - 1) / FRAME_SIZE,
+				(uint32_t) pkt->frames);
+}
+
+static void engine_send_report(struct engine *e, struct session *s)
+{
+	int32_t lost;
+	uint32_t expected, interval, received;
+	uint8_t payload[TRANSSIP_REPORT_LEN];
+	struct session_rr *rr = &s->rr;
+	struct transsip_report rep;
+	struct transsip_pkt pkt;
+
+	expected = (rr->highest - rr->base) / FRAME_SIZE + 1;
+	lost = expected - rr->received;
+	interval = expected - rr->expected_prior;
+	received = rr->received - rr->received_prior;
+	rr->expected_prior = expected;
+	rr->received_prior = rr->received;
+
+	memset(&rep, 0, sizeof(rep));
+	if (interval > received)
+		rep.fraction = ((interval - received) << 8) / interval;
+	rep.lost = max(lost, 0);
+	rep.highest = rr->highest;
+	rep.jitter = rr->jitter >> 4;
+	rep.late = rr->late;
+	transsip_report_encode(payload, &rep);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = s->version;
+	pkt.flags = TRANSSIP_EST | TRANSSIP_PSH;
+	pkt.type = TRANSSIP_PT_REPORT;
+	pkt.callid = s->callid;
+	pkt.payload = payload;
+	pkt.len = sizeof(payload);
+
+	engine_send_pkt(s->sock, (struct sockaddr *) &s->addr, s->addrlen,
+			&pkt);
+	rr->sent_at = e->rx_at;
+	e->rate.reports_tx++;
+}
+
+/*
+ * Loss based control after GCC (draft-ietf-rmcat-gcc-02): back off in
+ * proportion to loss above 10%, probe upwards by 5% below 2% and hold
+ * in between. Frames the peer played late count as lost, its jitter
+ * buffer could not hide the delay they took.
+ */
+static void engine_on_report(struct engine *e, struct session *s,
+			     const struct transsip_pkt *pkt)
+{
+	int size;
+	uint32_t frames, late, loss;
+	struct transsip_report rep;
+	struct session_rate *rc = &s->rc;
+
+	if (transsip_report_decode(pkt, &rep) < 0)
+		return;
+
+	e->rate.reports_rx++;
+
+	frames = (rep.highest - rc->highest_prior) / FRAME_SIZE;
+	late = rep.late - rc->late_prior;
+	rc->highest_prior = rep.highest;
+	rc->late_prior = rep.late;
+	rc->fraction = rep.fraction;
+	rc->jitter = rep.jitter;
+	rc->report_at = engine_now();
+
+	loss = rep.fraction;
+	if (frames && late)
+		loss = min(loss + late * 256 / frames, 255U);
+
+	size = rc->size;
+	if (loss > 26)
+		size = size * (512 - loss) / 512;
+	else if (loss < 5)
+		size = size * 105 / 100 + 1;
+	size = min(max(size, PACKET_MIN), PACKET_MAX);
+
+	if (size < rc->size)
+		e->rate.decreases++;
+	else if (size > rc->size)
+		e->rate.increases++;
+	rc->size = size;
+}
+
+/*
+ * The hold window runs from SESSION_HOLD_LAG frames behind the playout
+ * point to the end of the ring ahead of it, one frame per slot. Frames
+ * outside could only sit in the ring until the playout point caught up
+ * with them, or forever if it never does.
+ *
+ * The playout point means nothing until the jitter buffer played a
+ * frame, and speex resyncs to whatever comes next after some twenty
+ * concealed ones in a row. Meanwhile s->synced is 0 and any frame is
+ * taken, or a peer that jumped ahead could never be heard again.
+ */
+static inline int engine_hold_near(const struct session *s, uint32_t seq)
+{
+	int32_t d = seq - s->played;
+
+	return d > -SESSION_HOLD_LAG * FRAME_SIZE &&
+	       d < (SESSION_HOLD_RING - SESSION_HOLD_LAG) * FRAME_SIZE;
+}
+
+/*
+ * The jitter buffer takes the time of the put as arrival, counted in
+ * playout ticks. A frame that reached the kernel before the last tick
+ * but was read after it would look one tick late and push the buffer
+ * delay up for nothing. With kernel timestamps we tell the buffer how
+ * much of the played frame was still left when the frame came in.
+ *
+ * Frames of the datagram at hand share its buffer, anything else, such
+ * as frames repaired by FEC or off the ring, is copied into one. Only
+ * frames in the hold window are taken, so a slot that is taken holds
+ * a duplicate, a frame the jitter buffer dropped as late, or one that
+ * went out of the window.
+ */
+static void engine_jitter_put(struct engine *e, struct session *s,
+			      uint32_t seq, const uint8_t *frame, size_t len)
+{
+	uint32_t rem = 0;
+	JitterBufferPacket packet;
+	struct session_hold *h;
+	struct pktbuf *b;
+
+	if (s->synced && !engine_hold_near(s, seq)) {
+		e->hold.outside++;
+		return;
+	}
+
+	h = &s->held[(seq / FRAME_SIZE) % SESSION_HOLD_RING];
+	if (h->buf) {
+		if (h->seq == seq) {
+			e->hold.dups++;
+			return;
+		}
+		if ((int32_t) (seq - h->seq) < 0 &&
+		    engine_hold_near(s, h->seq)) {
+			e->hold.stale++;
+			return;
+		}
+
+		engine_hold_release(e, h);
+		e->hold.expired++;
+	}
+
+	if (pktbuf_has(e->rx_buf, frame, len)) {
+		b = e->rx_buf;
+		pktbuf_ref(b);
+	} else {
+		b = pktbuf_copy(e->pool, frame, len);
+		if (!b) {
+			e->hold.dropped++;
+			return;
+		}
+		frame = (uint8_t *) b->data;
+	}
+
+	h->buf = b;
+	h->seq = seq;
+	e->hold.lent++;
+
+	packet.data = (char *) frame;
+	packet.len = len;
+	packet.timestamp = seq;
+	packet.span = FRAME_SIZE;
+	packet.sequence = 0;
+
+	if (e->rx_at < s->tick_at)
+		rem = min(s->tick_at - e->rx_at, (uint64_t) FRAME_NSEC) *
+		      SAMPLING_RATE / 1000000000ULL;
+
+	if (rem) {
+		jitter_buffer_remaining_span(s->jitter, rem);
+		jitter_buffer_put(s->jitter, &packet);
+		jitter_buffer_remaining_span(s->jitter, 0);
+		e->rxs.rescued++;
+	} else {
+		jitter_buffer_put(s->jitter, &packet);
+	}
+}
+
+static inline unsigned int engine_fec_slot(uint32_t seq)
+{
+	return (seq / FRAME_SIZE) % SESSION_FEC_RING;
+}
+
+/* Returns 1 if FEC got the frame to us already. */
+static int engine_fec_store(struct session *s, uint32_t seq,
+			    const uint8_t *frame, size_t len)
+{
+	struct session_fec *f = s->fec;
+	unsigned int slot = engine_fec_slot(seq);
+	uint8_t *sym = f->ring[slot];
+
+	if (f->state[slot] == FEC_RECOVERED && f->seq[slot] == seq)
+		return 1;
+
+	f->seq[slot] = seq;
+	f->state[slot] = 0;
+	if (len + 2 > SESSION_FEC_SYM)
+		return 0;
+
+	sym[0] = len >> 8;
+	sym[1] = len;
+	memcpy(sym + 2, frame, len);
+	memset(sym + 2 + len, 0, SESSION_FEC_SYM - 2 - len);
+	f->state[slot] = FEC_RECEIVED;
+
+	return 0;
+}
+
+static void engine_fec_repair(struct engine *e, struct session *s)
+{
+	int have[FEC_MAX_DATA];
+	uint8_t *data[FEC_MAX_DATA], *parity[FEC_MAX_PARITY], *sym;
+	unsigned int i, slot, missing = 0, avail = 0;
+	struct session_fec *f = s->fec;
+	uint32_t seq;
+	size_t len;
+
+	for (i = 0; i < f->rndata; ++i) {
+		seq = f->rbase + i * FRAME_SIZE;
+		slot = engine_fec_slot(seq);
+		data[i] = f->ring[slot];
+		have[i] = f->state[slot] && f->seq[slot] == seq;
+		missing += !have[i];
+	}
+	for (i = 0; i < f->rnparity; ++i) {
+		parity[i] = f->parity[i];
+		avail += f->phave[i];
+	}
+
+	if (missing > avail)
+		return;
+
+	f->rdone = 1;
+	if (missing == 0 || fec_decode(f->rndata, f->rnparity, data, have,
+				       parity, f->phave, f->rlen) <= 0)
+		return;
+
+	for (i = 0; i < f->rndata; ++i) {
+		if (have[i])
+			continue;
+
+		seq = f->rbase + i * FRAME_SIZE;
+		slot = engine_fec_slot(seq);
+		sym = f->ring[slot];
+		len = sym[0] << 8 | sym[1];
+
+		f->seq[slot] = seq;
+		f->state[slot] = 0;
+		if (len == 0 || len + 2 > f->rlen)
+			continue;
+
+		f->state[slot] = FEC_RECOVERED;
+		engine_jitter_put(e, s, seq, sym + 2, len);
+		e->fec.recovered++;
+	}
+}
+
+/*
+ * Repair symbols of a group are collected until they can fill all of
+ * its holes. Frames of groups older than the ring would be gone.
+ */
+static void engine_on_fec(struct engine *e, struct session *s,
+			  const struct transsip_pkt *pkt)
+{
+	uint32_t base;
+	size_t len;
+	struct transsip_fec fh;
+	struct session_fec *f;
+
+	if (pkt->len <= sizeof(fh))
+		return;
+
+	memcpy(&fh, pkt->payload, sizeof(fh));
+	base = ntohl(fh.base);
+	len = pkt->len - sizeof(fh);
+	if (fh.ndata == 0 || fh.ndata > FEC_MAX_DATA ||
+	    fh.nparity > FEC_MAX_PARITY || fh.index >= fh.nparity ||
+	    len > SESSION_FEC_SYM)
+		return;
+
+	e->fec.repair_rx++;
+	if (s->rr.received && (int32_t) (s->rr.highest - base) >
+	    (SESSION_FEC_RING - FEC_MAX_DATA) * FRAME_SIZE)
+		return;
+
+	if (!s->fec)
+		s->fec = xzmalloc(sizeof(*s->fec));
+	f = s->fec;
+
+	if (!f->rvalid || f->rbase != base) {
+		f->rvalid = 1;
+		f->rdone = 0;
+		f->rbase = base;
+		f->rndata = fh.ndata;
+		f->rnparity = fh.nparity;
+		f->rlen = len;
+		memset(f->phave, 0, sizeof(f->phave));
+	}
+
+	if (f->rdone || len != f->rlen || fh.ndata != f->rndata ||
+	    fh.nparity != f->rnparity)
+		return;
+
+	memcpy(f->parity[fh.index], pkt->payload + sizeof(fh), len);
+	f->phave[fh.index] = 1;
+
+	engine_fec_repair(e, s);
+}
+
+/* Applies to the next group of each call, no repair turns FEC off. */
+static void engine_set_fec(unsigned int ndata, unsigned int nparity)
+{
+	__atomic_store_n(&engine_fec_conf, ndata << 8 | nparity,
+			 __ATOMIC_RELAXED);
+}
+
+/* Keeps the copy of the frame before, prim gets the frame itself. */
+static int engine_red_put(struct session *s, const struct transsip_pkt *pkt,
+			  struct transsip_pkt *prim)
+{
+	uint8_t len = pkt->payload[0];
+	uint32_t seq = pkt->seq - FRAME_SIZE;
+	struct session_red *r;
+
+	if (1 + len >= pkt->len)
+		return -EINVAL;
+
+	if (len > 0 && len <= SESSION_RED_MAX) {
+		r = &s->red[(seq / FRAME_SIZE) % SESSION_RED_RING];
+		r->seq = seq;
+		r->len = len;
+		memcpy(r->data, pkt->payload + 1, len);
+	}
+
+	*prim = *pkt;
+	prim->type = TRANSSIP_PT_CELT;
+	prim->payload += 1 + len;
+	prim->len -= 1 + len;
+
+	return 0;
+}
+
+/* Bundled frames go into the jitter buffer one by one. */
+static void engine_media_put(struct engine *e, struct session *s,
+			     const struct transsip_pkt *pkt)
+{
+	unsigned int i;
+	size_t len;
+	uint32_t seq;
+	const uint8_t *frame;
+	struct transsip_pkt prim;
+
+	if (pkt->type == TRANSSIP_PT_RED) {
+		if (engine_red_put(s, pkt, &prim) < 0)
+			return;
+		pkt = &prim;
+	}
+
+	len = pkt->len / pkt->frames;
+	if (len == 0 || len * pkt->frames != pkt->len)
+		return;
+
+	/* Ready before the first repair, or its group could not be fixed. */
+	if (!s->fec && s->version == TRANSSIP_VERSION)
+		s->fec = xzmalloc(sizeof(*s->fec));
+
+	for (i = 0; i < pkt->frames; ++i) {
+		seq = pkt->seq + i * FRAME_SIZE;
+		frame = pkt->payload + i * len;
+		if (!s->fec || !engine_fec_store(s, seq, frame, len))
+			engine_jitter_put(e, s, seq, frame, len);
+	}
+
+	s->stats.frames_rx += pkt->frames;
+	e->stats.frames += pkt->frames;
+	e->stats.packets_rx++;
+
+	engine_rr_update(e, s, pkt);
+	if (s->version == TRANSSIP_VERSION &&
+	    e->rx_at - s->rr.sent_at >= REPORT_INTERVAL)
+		engine_send_report(e, s);
+
+	if (!s->recv_started && s->answer_at) {
+		e->stats.first_audio++;
+		e->stats.first_audio_ns += engine_now() - s->answer_at;
+	}
+	s->recv_started = 1;
+}
+
+static inline uint32_t engine_ts(uint64_t ns)
+{
+	return ns / 1000;
+}
+
+/*
+ * Half the round trip variation is taken as one way jitter and put on
+ * top of the jitter buffer's own safety margin of one frame.
+ */
+static void engine_jitter_margin(struct session *s)
+{
+	int margin;
+
+	margin = FRAME_SIZE + (s->rttvar / 2) * SAMPLING_RATE / 1000000000ULL;
+	margin = min(margin, MARGIN_MAX);
+	margin -= margin % (FRAME_SIZE / 4);
+	if (margin == s->margin || !s->jitter)
+		return;
+
+	jitter_buffer_ctl(s->jitter, JITTER_BUFFER_SET_MARGIN, &margin);
+	s->margin = margin;
+}
+
+/*
+ * Media frames echo the peer's last send time, see struct transsip_tse.
+ * Our own echo comes back less the peer's hold time, which leaves the
+ * round trip. Arrival is the kernel's when we have it.
+ */
+static void engine_rtt_echo(struct engine *e, struct session *s,
+			    const struct transsip_pkt *pkt)
+{
+	uint32_t rtt;
+
+	s->ts_recent = pkt->ts;
+	s->ts_recent_at = e->rx_at;
+
+	if (!pkt->echo)
+		return;
+
+	/* Reordered or from before a migration. */
+	rtt = engine_ts(e->rx_at) - pkt->echo - pkt->hold;
+	if (rtt > RTT_MAX_US)
+		return;
+
+	engine_rtt_update(&s->srtt, &s->rttvar, rtt * 1000ULL);
+	engine_jitter_margin(s);
+}
+
+static enum engine_state_num engine_do_callout(struct engine *e,
+					       struct session *s,
+					       const struct transsip_pkt *pkt)
+{
+	/* Anything from the callee acks our probe. */
+	engine_ctl_ack(e, s, pkt->type == TRANSSIP_PT_COOKIE);
+
+	/* Callee wants proof that we own our address, ring again. */
+	if (pkt->type == TRANSSIP_PT_COOKIE && transsip_is_probe(pkt) &&
+	    pkt->len == sizeof(s->cookie)) {
+		memcpy(&s->cookie, pkt->payload, sizeof(s->cookie));
+		engine_ctl_start(e, s, TRANSSIP_EST, 1);
+		return ENGINE_STATE_CALLOUT;
+	}
+
+	if ((pkt->flags & (TRANSSIP_EST | TRANSSIP_PSH)) ==
+	    (TRANSSIP_EST | TRANSSIP_PSH)) {
+		whine("Call established!\n");
+		s->answer_at = engine_now();
+		e->ctl.setups++;
+		e->ctl.setup_ns += s->answer_at - s->setup_start;
+
+		/* The answer may already carry the callee's first frame. */
+		if (transsip_is_media(pkt))
+			engine_media_put(e, s, pkt);
+		return ENGINE_STATE_SPEAKING;
+	}
+	if (pkt->flags & (TRANSSIP_BSY | TRANSSIP_FIN)) {
+		whine("Remote end busy!\n");
+		engine_play_busy(e);
+		return ENGINE_STATE_IDLE;
+	}
+
+	return ENGINE_STATE_CALLOUT;
+}
+
+static enum engine_state_num engine_do_callin(struct engine *e,
+					      struct session *s,
+					      const struct transsip_pkt *pkt)
+{
+	if (pkt->flags & (TRANSSIP_BSY | TRANSSIP_FIN)) {
+		whine("Remote end hung up!\n");
+		engine_play_busy(e);
+		return ENGINE_STATE_IDLE;
+	}
+
+	return ENGINE_STATE_CALLIN;
+}
+
+static enum engine_state_num engine_do_speaking(struct engine *e,
+						struct session *s,
+						const struct transsip_pkt *pkt)
+{
+	uint64_t resp[2];
+
+	if (pkt->flags & TRANSSIP_FIN) {
+		whine("Remote end hung up!\n");
+		return ENGINE_STATE_IDLE;
+	}
+
+	/* We moved, prove to the peer that it is still us. */
+	if (pkt->type == TRANSSIP_PT_RESUME &&
+	    pkt->len == sizeof(uint64_t) && s->cookie) {
+		memcpy(&resp[0], pkt->payload, sizeof(resp[0]));
+		resp[1] = engine_resume_mac(s, resp[0]);
+		engine_send_resume(s, s->sock, (struct sockaddr *) &s->addr,
+				   s->addrlen, resp, sizeof(resp));
+		return ENGINE_STATE_SPEAKING;
+	}
+
+	/* A probe again means the caller missed our answer. */
+	if (s->rtx_flags && transsip_is_probe(pkt)) {
+		s->rtx_count++;
+		e->ctl.rtx[ENGINE_CTL_PSH]++;
+		engine_ctl_xmit(e, s);
+		return ENGINE_STATE_SPEAKING;
+	}
+
+	engine_ctl_ack(e, s, 1);
+	if (transsip_is_media(pkt))
+		engine_media_put(e, s, pkt);
+	else if (pkt->type == TRANSSIP_PT_REPORT)
+		engine_on_report(e, s, pkt);
+	else if (pkt->type == TRANSSIP_PT_FEC)
+		engine_on_fec(e, s, pkt);
+
+	return ENGINE_STATE_SPEAKING;
+}
+
+/*
+ * Every media frame carries est|psh, so for v2 callers our first frame
+ * is the answer and audio flows with it. Legacy peers get a bare
+ * answer first, as they always did.
+ */
+static void engine_answer(struct engine *e, struct session *s)
+{
+	s->answer_at = engine_now();
+	engine_ctl_start(e, s, TRANSSIP_EST | TRANSSIP_PSH,
+			 s->version == TRANSSIP_VERSION_LEGACY);
+}
+
+static enum engine_state_num engine_do_idle(struct engine *e,
+					    struct session *s,
+					    const struct transsip_pkt *pkt)
+{
+	char hbuff[256], sbuff[256];
+
+	if (!transsip_is_probe(pkt))
+		return ENGINE_STATE_IDLE;
+
+	/* Echo workers have no cli and answer right away. */
+	if (e->echo) {
+		engine_answer(e, s);
+		return ENGINE_STATE_SPEAKING;
+	}
+
+	memset(hbuff, 0, sizeof(hbuff));
+	memset(sbuff, 0, sizeof(sbuff));
+	getnameinfo((struct sockaddr *) &s->addr, s->addrlen, hbuff,
+		    sizeof(hbuff), sbuff, sizeof(sbuff),
+		    NI_NUMERICHOST | NI_NUMERICSERV);
+
+	printf("New incoming connection from %s:%s (call %d)!\n",
+	       hbuff, sbuff, s->id);
+	printf("Answer it with: take %d\n", s->id);
+	printf("Reject it with: hangup %d\n", s->id);
+	fflush(stdout);
+
+	return ENGINE_STATE_CALLIN;
+}
+
+struct engine_state state_machine[__ENGINE_STATE_MAX] __read_mostly = {
+	STATE_MAP_SET(ENGINE_STATE_IDLE, engine_do_idle),
+	STATE_MAP_SET(ENGINE_STATE_CALLOUT, engine_do_callout),
+	STATE_MAP_SET(ENGINE_STATE_CALLIN, engine_do_callin),
+	STATE_MAP_SET(ENGINE_STATE_SPEAKING, engine_do_speaking),
+};
+
+/*
+ * A call that is up heard from its peer at a new address, e.g. after
+ * a roam or NAT rebinding. Nothing from there is taken until it proved
+ * to know the call's cookie: it gets a nonce bound to that address,
+ * like a setup cookie, and must return it with a MAC. Until then its
+ * audio is dropped, so an off-path spoofer who guessed a call id can
+ * neither inject frames nor point the call at a victim.
+ */
+static void engine_migrate(struct engine *e, struct session *s, int sock,
+			   const struct transsip_pkt *pkt,
+			   struct sockaddr *raddr, socklen_t raddrlen)
+{
+	uint64_t now, nonce, resp[2];
+
+	if (s->state != ENGINE_STATE_SPEAKING || !s->cookie ||
+	    sock != s->sock || pkt->version != TRANSSIP_VERSION)
+		return;
+
+	now = engine_now();
+
+	if (pkt->type == TRANSSIP_PT_RESUME &&
+	    pkt->len == TRANSSIP_RESUME_LEN) {
+		memcpy(resp, pkt->payload, sizeof(resp));
+
+		if ((resp[0] != engine_cookie(e, raddr, s->callid,
+					      now >> COOKIE_EPOCH) &&
+		     resp[0] != engine_cookie(e, raddr, s->callid,
+					      (now >> COOKIE_EPOCH) - 1)) ||
+		    resp[1] != engine_resume_mac(s, resp[0])) {
+			e->resume.bad_proofs++;
+			return;
+		}
+
+		session_set_addr(&e->sessions, s, raddr, raddrlen);
+		s->srtt = s->rttvar = 0;
+		e->resume.migrated++;
+		return;
+	}
+
+	if (transsip_is_media(pkt))
+		e->resume.unproven++;
+
+	if (!ratelimit_allow(e->rl, raddr, now)) {
+		e->flood.limited++;
+		return;
+	}
+
+	nonce = engine_cookie(e, raddr, s->callid, now >> COOKIE_EPOCH);
+	engine_send_resume(s, sock, raddr, raddrlen, &nonce, sizeof(nonce));
+	e->resume.challenges++;
+}
+
+static void engine_process(struct engine *e, int sock, char *msg,
+			   size_t len, struct sockaddr *raddr,
+			   socklen_t raddrlen)
+{
+	struct session *s;
+	struct transsip_pkt pkt;
+	enum engine_state_num next;
+
+	if (unlikely(transsip_decode((uint8_t *) msg, len, &pkt) < 0))
+		return;
+	if (unlikely(transsip_is_fin_ack(&pkt))) {
+		engine_linger_ack(e, pkt.callid);
+		return;
+	}
+
+	if (pkt.callid) {
+		s = session_lookup_callid(&e->sessions, pkt.callid);
+		if (s && !sock_addr_equal((struct sockaddr *) &s->addr,
+					  raddr)) {
+			engine_migrate(e, s, sock, &pkt, raddr, raddrlen);
+			return;
+		}
+	} else {
+		s = session_lookup_addr(&e->sessions, raddr, raddrlen);
+	}
+
+	/*
+	 * Resent fins of calls that are long gone get their ack too, but
+	 * as anyone can claim to have had a call with us, only at the
+	 * probe rate of the source.
+	 */
+	if (unlikely(pkt.flags & TRANSSIP_FIN) &&
+	    pkt.version == TRANSSIP_VERSION &&
+	    (s || engine_fin_lingers(e, pkt.callid, raddr) ||
+	     ratelimit_allow(e->rl, raddr, engine_now())))
+		engine_send_ctl_to(sock, raddr, raddrlen, pkt.version,
+				   pkt.callid, TRANSSIP_FIN | TRANSSIP_PSH);
+
+	if (!s) {
+		if (!transsip_is_probe(&pkt))
+			return;
+		if (!engine_admit(e, sock, raddr, raddrlen, &pkt))
+			return;
+
+		s = session_alloc(&e->sessions, raddr, raddrlen);
+		if (!s) {
+			engine_send_ctl_to(sock, raddr, raddrlen, pkt.version,
+					   pkt.callid, TRANSSIP_BSY |
+					   TRANSSIP_FIN);
+			return;
+		}
+
+		s->version = pkt.version;
+		session_set_callid(&e->sessions, s, pkt.callid);
+		engine_session_attach(e, s, sock);
+
+		/* Both ends know the cookie now, it keys resumption. */
+		if (pkt.type == TRANSSIP_PT_COOKIE)
+			memcpy(&s->cookie, pkt.payload, sizeof(s->cookie));
+	} else if (unlikely(pkt.version != s->version)) {
+		s->version = TRANSSIP_VERSION_LEGACY;
+	}
+
+	if (pkt.flags & TRANSSIP_TSE)
+		engine_rtt_echo(e, s, &pkt);
+	if (pkt.ptime)
+		s->peer_ptime = pkt.ptime;
+
+	next = state_machine[s->state].process(e, s, &pkt);
+	if (next != s->state || next == ENGINE_STATE_IDLE)
+		engine_set_state(e, s, next);
+}
+
+/*
+ * Datagrams are processed in the ring, as if they came from the peer's
+ * address. The first one tells the caller its offer was taken.
+ */
+static void engine_on_shm(struct reactor_fd *rf, uint32_t events)
+{
+	size_t len;
+	char *msg;
+	struct engine *e = rf->arg;
+	struct session *s = container_of(rf, struct session, shm_rf);
+	struct shm_chan *c = s->shm;
+
+	do {
+		while ((msg = shm_rx_data(c, &len))) {
+			s->shm_tx = 1;
+			e->rx_at = engine_now();
+			e->local.rx++;
+
+			engine_capture(e, e->rx_at, CAPTURE_SHM,
+				       (struct sockaddr *) &s->addr, msg, len);
+			engine_process(e, s->sock, msg, len,
+				       (struct sockaddr *) &s->addr,
+				       s->addrlen);
+			/* The call may be gone and the ring with it. */
+			if (s->shm != c)
+				return;
+
+			shm_rx_consume(c);
+		}
+	} while (shm_rx_sleep(c));
+}
+
+/* Offers go to all workers, so most are for calls we do not have. */
+static void engine_on_shm_offer(struct reactor_fd *rf, uint32_t events)
+{
+	int ret;
+	struct engine *e = rf->arg;
+	struct session *s;
+	struct shm_chan c;
+	struct shm_offer o;
+
+	while ((ret = shm_accept(e->shm_sock, &o, &c)) != 0) {
+		if (ret < 0) {
+			e->local.refused++;
+			continue;
+		}
+
+		s = session_lookup_callid(&e->sessions, o.callid);
+		if (!s || s->state != ENGINE_STATE_SPEAKING || s->shm ||
+		    s->version != TRANSSIP_VERSION || !s->cookie ||
+		    o.token != engine_shm_token(s) ||
+		    !sock_addr_is_local((struct sockaddr *) &s->addr)) {
+			shm_chan_destroy(&c);
+			continue;
+		}
+
+		engine_shm_attach(e, s, &c);
+		s->shm_tx = 1;
+		e->local.taken++;
+	}
+}
+
+/*
+ * Datagrams are received right into pool buffers. A slot whose buffer
+ * was taken by the jitter buffer gets a fresh one, an empty pool makes
+ * it fall back to the batch's own, whose frames are copied then.
+ */
+static void engine_rx_refill(struct engine *e)
+{
+	int i;
+	struct pktbuf *b;
+
+	for (i = 0; i < MMSG_BATCH; ++i) {
+		if (e->rx_bufs[i])
+			continue;
+
+		b = pktbuf_get(e->pool);
+		e->rx_bufs[i] = b;
+		e->rx->rxbuf[i] = b ? b->data : NULL;
+	}
+}
+
+/*
+ * Drain the socket in batches, so that one wakeup costs one syscall
+ * per MMSG_BATCH datagrams. We stop after RX_ROUNDS full batches to
+ * not starve the sound device under a flood.
+ */
+static unsigned int engine_recv(struct engine *e, int sock)
+{
+	int i, n, rounds = 0;
+	unsigned int total = 0;
+	size_t len;
+	char *msg;
+	socklen_t raddrlen;
+	struct sockaddr *raddr;
+	uint64_t now, wall, ts;
+
+	do {
+		engine_rx_refill(e);
+		n = mmsg_recv(sock, e->rx, &e->net);
+		if (n <= 0)
+			break;
+
+		now = engine_now();
+		wall = e->rxts ? engine_wall_offset() : 0;
+
+		for (i = 0; i < n; ++i) {
+			msg = mmsg_rx_data(e->rx, i, &len);
+			raddr = mmsg_rx_addr(e->rx, i, &raddrlen);
+
+			e->rx_at = now;
+			ts = e->rxts ? mmsg_rx_time(e->rx, i) : 0;
+			if (ts > wall && ts - wall < now) {
+				e->rx_at = ts - wall;
+				e->rxs.stamped++;
+				e->rxs.delay_ns += now - e->rx_at;
+				e->rxs.delay_max = max(e->rxs.delay_max,
+						       now - e->rx_at);
+			}
+
+			engine_capture(e, e->rx_at, 0, raddr, msg, len);
+
+			e->rx_buf = e->rx_bufs[i];
+			engine_process(e, sock, msg, len, raddr, raddrlen);
+			e->rx_buf = NULL;
+
+			if (e->rx_bufs[i] && e->rx_bufs[i]->ref > 1) {
+				pktbuf_put(e->pool, e->rx_bufs[i]);
+				e->rx_bufs[i] = NULL;
+			}
+		}
+		total += n;
+	} while (n == MMSG_BATCH && ++rounds < RX_ROUNDS);
+
+	return total;
+}
+
+static int engine_race_connect(struct engine *e, struct engine_race *race,
+			       unsigned int i)
+{
+	int sock, one = 1, mtu = IP_PMTUDISC_DONT;
+	struct sockaddr *addr = (struct sockaddr *) &race->addrs[i];
+	struct session *s = race->s;
+	struct transsip_pkt pkt;
+
+	sock = socket(addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+
+	if (connect(sock, addr, race->addrlens[i]) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	setsockopt(sock, SOL_IP, IP_MTU_DISCOVER, &mtu, sizeof(mtu));
+	if (e->lowlat) {
+		sock_enable_lowlat(sock);
+		sock_enable_rx_timestamps(sock);
+	}
+
+	engine_ctl_fill(e, s, &pkt);
+	if (engine_send_probe(s, sock, NULL, 0, &pkt) <= 0) {
+		close(sock);
+		return -1;
+	}
+
+	sock_attach_filter(sock, SOCK_FILTER_ANY);
+
+	race->socks[i] = sock;
+	reactor_add(&e->r, &race->rf[i], sock, EPOLLIN, engine_on_race_sock,
+		    race);
+	race->alive++;
+
+	return 0;
+}
+
+/* Start the next candidate; one that fails right away does not count. */
+static void engine_race_next(struct engine *e, struct engine_race *race)
+{
+	while (race->started < race->num) {
+		if (engine_race_connect(e, race, race->started++) == 0)
+			break;
+	}
+
+	if (race->started < race->num)
+		reactor_timer_arm(&race->timer, RACE_DELAY, 0);
+	else
+		reactor_timer_disarm(&race->timer);
+}
+
+static void engine_on_race_timer(struct reactor_timer *t, uint64_t expired)
+{
+	struct engine_race *race = t->arg;
+
+	engine_race_next(race->e, race);
+}
+
+static void engine_race_win(struct engine *e, struct engine_race *race,
+			    unsigned int i)
+{
+	int sock = race->socks[i];
+	struct session *s = race->s;
+
+	reactor_del(&e->r, &race->rf[i]);
+	race->socks[i] = -1;
+
+	if (i == 0)
+		e->dial.first++;
+	else
+		e->dial.fallback++;
+	e->dial.reply_ns += engine_now() - race->start;
+
+	session_set_addr(&e->sessions, s, (struct sockaddr *) &race->addrs[i],
+			 race->addrlens[i]);
+	engine_session_set_sock(e, s, sock);
+
+	engine_race_free(e, race);
+}
+
+static void engine_on_race_sock(struct reactor_fd *rf, uint32_t events)
+{
+	struct engine_race *race = rf->arg;
+	struct engine *e = race->e;
+	struct session *s = race->s;
+	unsigned int i = rf - race->rf;
+
+	if (events & EPOLLERR) {
+		reactor_del(&e->r, rf);
+		close(race->socks[i]);
+		race->socks[i] = -1;
+		race->alive--;
+
+		if (race->started < race->num) {
+			reactor_timer_disarm(&race->timer);
+			engine_race_next(e, race);
+		}
+		if (race->alive == 0) {
+			printf("Destination unreachable?\n");
+			engine_set_state(e, s, ENGINE_STATE_IDLE);
+		}
+		return;
+	}
+
+	engine_race_win(e, race, i);
+	engine_on_session_sock(&s->rf, events);
+}
+
+/*
+ * Candidates alternate between the address families, starting with
+ * the one getaddrinfo(3) ranked first (RFC 8305).
+ */
+static void engine_race_order(struct engine_race *race,
+			      const struct resolv_result *res)
+{
+	int family;
+	unsigned int i, j, k = 0, taken = 0;
+	uint8_t used[RESOLV_MAX_ADDRS];
+
+	memset(used, 0, sizeof(used));
+	family = res->addrs[0].ss_family;
+
+	while (taken < res->naddrs) {
+		for (i = 0, j = res->naddrs; i < res->naddrs; ++i) {
+			if (used[i])
+				continue;
+			if (j == res->naddrs)
+				j = i;
+			if (res->addrs[i].ss_family == family) {
+				j = i;
+				break;
+			}
+		}
+
+		used[j] = 1;
+		memcpy(&race->addrs[k], &res->addrs[j], res->addrlens[j]);
+		race->addrlens[k++] = res->addrlens[j];
+		taken++;
+
+		family = res->addrs[j].ss_family == AF_INET6 ?
+			 AF_INET : AF_INET6;
+	}
+
+	race->num = k;
+}
+
+/*
+ * Through a relay we race the relay's addresses, the callee is named
+ * in our probes by the first of its own.
+ */
+static void engine_dial(struct engine *e, const struct resolv_result *res)
+{
+	unsigned int i;
+	struct session *s;
+	struct engine_race *race = NULL;
+	const struct resolv_result *to = res;
+
+	if (res->err || res->naddrs == 0) {
+		whine("Cannot get address info: %s!\n",
+		      res->err ? gai_strerror(res->err) : "no address");
+		return;
+	}
+	if (e->relay)
+		res = e->relay;
+
+	for (i = 0; i < MAX_RACES && !race; ++i) {
+		if (!e->races[i].used)
+			race = &e->races[i];
+	}
+
+	s = race ? session_alloc(&e->sessions,
+				 (struct sockaddr *) &res->addrs[0],
+				 res->addrlens[0]) : NULL;
+	if (!s) {
+		whine("Too many calls!\n");
+		return;
+	}
+
+	s->version = TRANSSIP_VERSION;
+	session_set_callid(&e->sessions, s, engine_new_callid(e));
+	engine_session_attach(e, s, -1);
+	if (e->relay) {
+		memcpy(&s->relay_to, &to->addrs[0], to->addrlens[0]);
+		s->relay_tolen = to->addrlens[0];
+	}
+
+	memset(race, 0, sizeof(*race));
+	race->used = 1;
+	race->e = e;
+	race->s = s;
+	race->start = engine_now();
+	for (i = 0; i < RESOLV_MAX_ADDRS; ++i) {
+		race->socks[i] = -1;
+		race->rf[i].fd = -1;
+	}
+	engine_race_order(race, res);
+	reactor_timer_init(&e->r, &race->timer, engine_on_race_timer, race);
+	e->dial.races++;
+
+	s->setup_start = race->start;
+	engine_ctl_start(e, s, TRANSSIP_EST, 0);
+	engine_race_next(e, race);
+	if (race->alive == 0) {
+		whine("Cannot connect to server!\n");
+		engine_set_state(e, s, ENGINE_STATE_IDLE);
+		return;
+	}
+
+	engine_set_state(e, s, ENGINE_STATE_CALLOUT);
+}
+
+/* Dials that were hung up while resolving carry a stale generation. */
+static void engine_on_resolved(void *arg, const struct resolv_result *res)
+{
+	struct engine_dial *d = arg;
+	struct engine *e = d->e;
+
+	if (d->gen == e->dial_gen) {
+		e->dialing--;
+		engine_dial(e, res);
+	}
+
+	xfree(d);
+}
+
+static void engine_on_resolv(struct reactor_fd *rf, uint32_t events)
+{
+	struct engine *e = rf->arg;
+
+	resolv_reap(e->resolv, engine_on_resolved);
+}
+
+static void engine_callout(struct engine *e, struct cli_pkt *cpkt)
+{
+	struct engine_dial *d;
+	const struct resolv_result *res;
+
+	d = xmalloc(sizeof(*d));
+	d->e = e;
+	d->gen = e->dial_gen;
+
+	res = resolv_lookup(e->resolv, cpkt->address, cpkt->port, d);
+	if (res) {
+		xfree(d);
+		engine_dial(e, res);
+		return;
+	}
+
+	e->dialing++;
+}
+
+static struct session *engine_cli_session(struct engine *e, int sid,
+					  enum engine_state_num state)
+{
+	struct session *s;
+
+	if (sid)
+		return session_lookup_id(&e->sessions, sid);
+	if (e->curr && (state == ENGINE_STATE_IDLE || e->curr->state == state))
+		return e->curr;
+
+	for_each_session(&e->sessions, s) {
+		if (state == ENGINE_STATE_IDLE || s->state == state)
+			return s;
+	}
+
+	return NULL;
+}
+
+static void engine_do_cli(struct engine *e)
+{
+	ssize_t ret;
+	struct cli_pkt cpkt;
+	struct session *s;
+
+	memset(&cpkt, 0, sizeof(cpkt));
+	ret = read(e->usocki, &cpkt, sizeof(cpkt));
+	if (ret != sizeof(cpkt)) {
+		whine("Read error from cli!\n");
+		return;
+	}
+
+	if (cpkt.ring)
+		engine_callout(e, &cpkt);
+
+	if (cpkt.take) {
+		s = engine_cli_session(e, cpkt.sid, ENGINE_STATE_CALLIN);
+		if (!s || s->state != ENGINE_STATE_CALLIN) {
+			whine("No call to take!\n");
+			return;
+		}
+
+		engine_answer(e, s);
+
+		whine("Call established!\n");
+		engine_set_state(e, s, ENGINE_STATE_SPEAKING);
+	}
+
+	if (cpkt.fin) {
+		s = engine_cli_session(e, cpkt.sid, ENGINE_STATE_IDLE);
+		if (!s && e->dialing) {
+			whine("You aborted call!\n");
+			e->dialing = 0;
+			e->dial_gen++;
+			return;
+		}
+		if (!s) {
+			whine("No call to hang up!\n");
+			return;
+		}
+
+		whine("You aborted call!\n");
+		engine_hangup(e, s);
+	}
+
+	if (cpkt.fec) {
+		engine_set_fec(cpkt.fec_data, cpkt.fec_parity);
+		printf("FEC %s, %u repair per %u frames\n",
+		       cpkt.fec_parity ? "on" : "off", cpkt.fec_parity,
+		       cpkt.fec_data);
+	}
+
+	if (cpkt.list)
+		engine_list_sessions(e);
+	if (cpkt.stats)
+		engine_dump_stats();
+}
+
+/*
+ * The jitter buffer hands out the pointer it got, decoded in place. It
+ * may still point to frames whose slot we reused, so only those with
+ * a reference in the hold ring are trusted.
+ */
+static void engine_decode_frame(struct engine *e, struct session *s,
+				short *pcm)
+{
+	JitterBufferPacket packet;
+	struct session_red *r;
+	struct session_hold *h, *old;
+
+	packet.data = NULL;
+	packet.len = 0;
+
+	jitter_buffer_tick(s->jitter);
+	s->tick_at = engine_now();
+	jitter_buffer_get(s->jitter, &packet, FRAME_SIZE, NULL);
+	s->played = packet.timestamp + FRAME_SIZE;
+
+	h = &s->held[(packet.timestamp / FRAME_SIZE) % SESSION_HOLD_RING];
+	if (packet.len && !(h->buf && h->seq == packet.timestamp &&
+			    pktbuf_has(h->buf, packet.data, packet.len)))
+		packet.len = 0;
+	if (packet.len == 0) {
+		h = NULL;
+		r = &s->red[(packet.timestamp / FRAME_SIZE) % SESSION_RED_RING];
+		if (r->len && r->seq == packet.timestamp) {
+			packet.data = (char *) r->data;
+			packet.len = r->len;
+			r->len = 0;
+			s->stats.frames_red++;
+			e->redund.filled++;
+		} else {
+			packet.data = NULL;
+			s->stats.frames_plc++;
+			e->redund.plc++;
+		}
+	}
+
+	celt_decode(s->decoder, (const unsigned char *) packet.data,
+		    packet.len, pcm);
+
+	if (h) {
+		engine_hold_release(e, h);
+		e->hold.played++;
+		s->synced = SESSION_HOLD_RESYNC;
+	} else if (s->synced) {
+		s->synced--;
+	}
+
+	/*
+	 * Frames the jitter buffer dropped as late are still held, as are
+	 * ones taken before it synced. One slot is looked at per tick, so
+	 * each comes up once per lap of the ring.
+	 */
+	old = &s->held[(s->played / FRAME_SIZE + SESSION_HOLD_RING -
+			SESSION_HOLD_LAG) % SESSION_HOLD_RING];
+	if (old->buf && s->synced && !engine_hold_near(s, old->seq)) {
+		engine_hold_release(e, old);
+		e->hold.expired++;
+	}
+}
+
+static int engine_flush(struct engine *e)
+{
+	unsigned int i;
+	uint64_t now;
+
+	if (unlikely(e->cap)) {
+		now = engine_now();
+		for (i = 0; i < e->tx->len; ++i)
+			capture_put(e->cap, now, CAPTURE_TX,
+				    (struct sockaddr *) &e->tx->addr[i],
+				    e->tx->buff[i], e->tx->iov[i].iov_len);
+	}
+
+	if (e->un)
+		return uring_net_flush(e->un, e->tx, &e->net);
+
+	return mmsg_flush(e->tx, &e->net);
+}
+
+/*
+ * Launch times follow the call's sample clock: frame n is due at
+ * base + n * FRAME_NSEC, which puts it PACE_DELAY after the capture
+ * of the first frame to soak up capture jitter. Calls started at
+ * different times thus leave spread over the period instead of in one
+ * burst. The sound card and CLOCK_MONOTONIC drift apart, so we anchor
+ * anew once the schedule is off by more than PACE_DELAY.
+ */
+static uint64_t engine_pace_time(struct engine *e, struct session *s,
+				 uint32_t seq, uint64_t now)
+{
+	uint64_t off = (uint64_t) seq * 1000000000ULL / SAMPLING_RATE;
+	uint64_t when = s->pace_base + off;
+
+	if (!s->pace_base || when + PACE_DELAY < now ||
+	    when > now + 2 * PACE_DELAY) {
+		s->pace_base = now + PACE_DELAY - off;
+		when = now + PACE_DELAY;
+		e->paced.anchors++;
+	} else if (when < now) {
+		when = now;
+		e->paced.late++;
+	}
+
+	e->paced.frames++;
+	return when;
+}
+
+static void engine_pace_send(void *arg, struct pace_pkt *p)
+{
+	struct engine *e = arg;
 
-		for (i = 0; i < array_size(fds); ++i) {
-			if ((fds[i].revents & POLLIN) != POLLIN)
-				continue;
+	if (mmsg_full(e->tx))
+		engine_flush(e);
 
-			if (fds[i].fd == ssock) {
-				ret = recv(ssock, msg, sizeof(msg), MSG_PEEK);
-				if (ret < 0)
-					continue;
-				if (ret < sizeof(struct transsip_hdr))
-					engine_drop_from_queue(ssock);
-
-				thdr = (struct transsip_hdr *) msg;
-				if (thdr->est == 1 && thdr->psh == 0)
-					return ENGINE_STATE_CALLIN;
-				else
-					engine_drop_from_queue(ssock);
-			}
+	memcpy(mmsg_tx_slot(e->tx), p->data, p->len);
+	mmsg_tx_commit(e->tx, p->sock, (struct sockaddr *) &p->addr,
+		       p->addrlen, p->len);
+}
 
-			if (fds[i].fd == usocki) {
-				ret = read(usocki, &cpkt, sizeof(cpkt));
-				if (ret <= 0) {
-					whine("Error reading from cli!\n");
-					continue;
-				}
-				if (cpkt.ring)
-					return ENGINE_STATE_CALLOUT;
-			}
+static void engine_on_pace(struct reactor_timer *t, uint64_t expired)
+{
+	struct engine *e = t->arg;
+
+	pace_run(e->wheel, engine_now(), engine_pace_send, e);
+	if (e->tx->len > 0 && engine_flush(e))
+		whine("Send datagram failed!\n");
+
+	if (pace_empty(e->wheel)) {
+		reactor_timer_disarm(&e->pace_timer);
+		e->pace_armed = 0;
+	}
+}
+
+/* Returns 1 if the wheel took the frame in the slot, else commit it. */
+static int engine_pace_frame(struct engine *e, struct session *s,
+			     uint64_t now, uint64_t when, size_t len)
+{
+	if (pace_add(e->wheel, now, when, s->sock,
+		     (struct sockaddr *) &s->addr, s->addrlen,
+		     mmsg_tx_slot(e->tx), len) < 0)
+		return 0;
+
+	if (!e->pace_armed) {
+		reactor_timer_arm(&e->pace_timer, PACE_GRAN, PACE_GRAN);
+		e->pace_armed = 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Parity leaves with the last frame of its group and at the same launch
+ * time. Sent ahead of a paced frame it would "repair" one that is only
+ * late, and the real frame would be dropped when it comes.
+ */
+static void engine_fec_send(struct engine *e, struct session *s,
+			    uint64_t now, uint64_t when)
+{
+	unsigned int i;
+	size_t hlen, len;
+	uint8_t *msg, *data[FEC_MAX_DATA], *parity[FEC_MAX_PARITY];
+	uint8_t sym[FEC_MAX_PARITY][SESSION_FEC_SYM];
+	struct session_fec *f = s->fec;
+	struct transsip_pkt pkt;
+	struct transsip_fec fh;
+
+	for (i = 0; i < f->ndata; ++i)
+		data[i] = f->data[i];
+	for (i = 0; i < f->nparity; ++i)
+		parity[i] = sym[i];
+	fec_encode(f->ndata, f->nparity, data, parity, f->len);
+
+	if (e->tx->len + f->nparity > MMSG_BATCH)
+		engine_flush(e);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = s->version;
+	pkt.flags = TRANSSIP_EST | TRANSSIP_PSH;
+	pkt.type = TRANSSIP_PT_FEC;
+	pkt.callid = s->callid;
+	pkt.seq = f->base;
+
+	fh.base = htonl(f->base);
+	fh.ndata = f->ndata;
+	fh.nparity = f->nparity;
+	fh.res = 0;
+
+	for (i = 0; i < f->nparity; ++i) {
+		msg = (uint8_t *) mmsg_tx_slot(e->tx);
+		hlen = transsip_encode(msg, MMSG_SIZE, &pkt);
+		fh.index = i;
+		memcpy(msg + hlen, &fh, sizeof(fh));
+		memcpy(msg + hlen + sizeof(fh), sym[i], f->len);
+		len = hlen + sizeof(fh) + f->len;
+
+		if (e->pace == ENGINE_PACE_WHEEL &&
+		    engine_pace_frame(e, s, now, when, len))
+			continue;
+
+		mmsg_tx_commit(e->tx, s->sock, (struct sockaddr *) &s->addr,
+			       s->addrlen, len);
+		if (s->txtime)
+			mmsg_tx_set_time(e->tx, when);
+	}
+
+	e->fec.groups++;
+	e->fec.repair_tx += f->nparity;
+}
+
+/* A group takes the setting at its start, see engine_set_fec(). */
+static void engine_fec_add(struct engine *e, struct session *s,
+			   uint32_t seq, const uint8_t *frame, size_t len,
+			   uint64_t now, uint64_t when)
+{
+	uint8_t *sym;
+	uint16_t conf;
+	struct session_fec *f = s->fec;
+
+	if (!f || f->count == 0) {
+		conf = __atomic_load_n(&engine_fec_conf, __ATOMIC_RELAXED);
+		if (!(conf & 0xff))
+			return;
+		if (!f)
+			f = s->fec = xzmalloc(sizeof(*f));
+
+		f->ndata = conf >> 8;
+		f->nparity = conf & 0xff;
+		f->base = seq;
+		f->len = 0;
+	}
+
+	if (len + 2 > SESSION_FEC_SYM) {
+		f->count = 0;
+		return;
+	}
+
+	sym = f->data[f->count++];
+	sym[0] = len >> 8;
+	sym[1] = len;
+	memcpy(sym + 2, frame, len);
+	memset(sym + 2 + len, 0, SESSION_FEC_SYM - 2 - len);
+	f->len = max(f->len, len + 2);
+
+	if (f->count == f->ndata) {
+		engine_fec_send(e, s, now, when);
+		f->count = 0;
+	}
+}
+
+/* Frames per packet, the smaller of ours and what the peer asked for. */
+static inline unsigned int engine_ptime(struct engine *e, struct session *s)
+{
+	if (s->version != TRANSSIP_VERSION || !s->peer_ptime)
+		return 1;
+
+	return min(e->ptime, s->peer_ptime);
+}
+
+static void engine_send_media(struct engine *e, struct session *s)
+{
+	unsigned int i;
+	size_t hlen, len = s->bundled * s->bundle_size;
+	uint8_t *msg, *frame, *ring = NULL;
+	uint64_t now = engine_now(), when = now;
+	struct transsip_pkt pkt;
+
+	/* A full ring means the peer stalls, UDP does not lose the call. */
+	if (s->shm_tx) {
+		ring = (uint8_t *) shm_tx_slot(s->shm);
+		if (!ring)
+			e->local.full++;
+	}
+
+	if (!ring && mmsg_full(e->tx))
+		engine_flush(e);
+
+	/* Paced packets are stamped with the launch time of the last frame. */
+	if (!ring && (e->pace == ENGINE_PACE_WHEEL || s->txtime))
+		when = engine_pace_time(e, s, s->send_seq - FRAME_SIZE, now);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.version = s->version;
+	pkt.flags = TRANSSIP_EST | TRANSSIP_PSH;
+	pkt.type = TRANSSIP_PT_CELT;
+	pkt.callid = s->callid;
+	pkt.seq = s->send_seq - s->bundled * FRAME_SIZE;
+
+	if (s->version == TRANSSIP_VERSION) {
+		if (s->red_len && !ring)
+			pkt.type = TRANSSIP_PT_RED;
+		pkt.frames = s->bundled;
+		pkt.ptime = e->ptime;
+		pkt.flags |= TRANSSIP_TSE;
+		pkt.ts = engine_ts(when) | 1;
+		if (s->ts_recent_at) {
+			pkt.echo = s->ts_recent;
+			pkt.hold = engine_ts(when - s->ts_recent_at);
 		}
 	}
 
-	return ENGINE_STATE_IDLE;
+	msg = ring ? ring : (uint8_t *) mmsg_tx_slot(e->tx);
+	hlen = transsip_encode(msg, ring ? SHM_SLOT_SIZE : MMSG_SIZE, &pkt);
+	frame = msg + hlen;
+
+	if (pkt.type == TRANSSIP_PT_RED) {
+		frame[0] = s->red_len;
+		memcpy(frame + 1, s->red_prev, s->red_len);
+		frame += 1 + s->red_len;
+		len += 1 + s->red_len;
+
+		e->redund.packets++;
+		e->redund.bytes += 1 + s->red_len;
+	}
+
+	memcpy(frame, s->bundle, s->bundled * s->bundle_size);
+
+	/* Time the answer from when it really left, see engine_answer(). */
+	if (unlikely(s->stats.frames_tx == 0 && s->rtx_flags))
+		s->rtx_sent = now;
+
+	s->stats.frames_tx += s->bundled;
+	e->stats.frames += s->bundled;
+	e->stats.packets_tx++;
+
+	/* The ring loses nothing, so no pacing and no FEC either. */
+	if (ring) {
+		engine_capture(e, now, CAPTURE_TX | CAPTURE_SHM,
+			       (struct sockaddr *) &s->addr, msg, hlen + len);
+		if (shm_tx_commit(s->shm, hlen + len) > 0)
+			e->local.doorbells++;
+		e->local.tx++;
+		return;
+	}
+
+	if (e->pace != ENGINE_PACE_WHEEL ||
+	    !engine_pace_frame(e, s, now, when, hlen + len)) {
+		mmsg_tx_commit(e->tx, s->sock, (struct sockaddr *) &s->addr,
+			       s->addrlen, hlen + len);
+		if (s->txtime)
+			mmsg_tx_set_time(e->tx, when);
+	}
+
+	if (s->version != TRANSSIP_VERSION)
+		return;
+
+	for (i = 0; i < s->bundled; ++i)
+		engine_fec_add(e, s, pkt.seq + i * FRAME_SIZE,
+			       s->bundle + i * s->bundle_size,
+			       s->bundle_size, now, when);
 }
 
-struct engine_state state_machine[__ENGINE_STATE_MAX] __read_mostly = {
-	STATE_MAP_SET(ENGINE_STATE_IDLE, engine_do_idle),
-	STATE_MAP_SET(ENGINE_STATE_CALLOUT, engine_do_callout),
-	STATE_MAP_SET(ENGINE_STATE_CALLIN, engine_do_callin),
-	STATE_MAP_SET(ENGINE_STATE_SPEAKING, engine_do_speaking),
-};
+/*
+ * Frames are held back until there are ptime of them. All frames of a
+ * packet have the size at its start, so the peer can split them apart
+ * without a length for each.
+ */
+static void engine_encode_frame(struct engine *e, struct session *s,
+				short *pcm)
+{
+	int len;
+	uint8_t red[SESSION_RED_MAX], *copy = red;
+	uint64_t now;
+
+	if (s->bundled == 0) {
+		now = engine_now();
+
+		/* Reports stopped coming, the path may be gone or swamped. */
+		if (unlikely(s->rc.report_at &&
+			     now - s->rc.report_at > REPORT_TIMEOUT)) {
+			s->rc.size = max(s->rc.size / 2, PACKET_MIN);
+			s->rc.report_at = now;
+			e->rate.timeouts++;
+		}
 
-void *engine_main(void *arg)
+		s->bundle_size = s->rc.size;
+	}
+
+	celt_encode(s->encoder, pcm, NULL,
+		    s->bundle + s->bundled * s->bundle_size, s->bundle_size);
+	s->send_seq += FRAME_SIZE;
+
+	if (++s->bundled >= engine_ptime(e, s)) {
+		engine_send_media(e, s);
+		s->bundled = 0;
+		copy = s->red_prev;
+	}
+
+	/*
+	 * The copy of a packet's last frame rides on the next one, at most
+	 * half a frame. The encoder sees all frames to keep its state.
+	 */
+	if (s->red_encoder && s->version == TRANSSIP_VERSION) {
+		len = min(e->red, (unsigned int) s->bundle_size / 2);
+		celt_encode(s->red_encoder, pcm, NULL, copy, len);
+		if (copy == s->red_prev)
+			s->red_len = len;
+	}
+}
+
+static int engine_audio_play(struct engine *e)
 {
-	int ssock = -1, csock, ret, mtu, usocki, usocko;
-	enum engine_state_num state;
-	struct addrinfo hints, *ahead, *ai;
-	struct alsa_dev *dev = NULL;
-	struct pipepair *pp = arg;
+	int i, xrun;
+	int32_t mix[FRAME_SIZE];
+	short pcm[FRAME_SIZE];
+	struct session *s;
+
+	memset(mix, 0, sizeof(mix));
+
+	for_each_session(&e->sessions, s) {
+		switch (s->state) {
+		case ENGINE_STATE_CALLIN:
+			engine_mix_tone(mix, &e->tones[ENGINE_SOUND_RING],
+					&s->tone_pos);
+			break;
+		case ENGINE_STATE_CALLOUT:
+			engine_mix_tone(mix, &e->tones[ENGINE_SOUND_DIAL],
+					&s->tone_pos);
+			break;
+		case ENGINE_STATE_SPEAKING:
+			if (!s->recv_started)
+				break;
+			engine_decode_frame(e, s, pcm);
+			for (i = 0; i < FRAME_SIZE; ++i)
+				mix[i] += pcm[i];
+			break;
+		default:
+			break;
+		}
+	}
 
-	init_call_notifier();
+	if (e->busy_left > 0) {
+		engine_mix_tone(mix, &e->tones[ENGINE_SOUND_BUSY],
+				&e->busy_pos);
+		e->busy_left -= min(e->busy_left, (size_t) FRAME_SIZE);
+		if (e->busy_left == 0)
+			engine_audio_update(e);
+	}
+
+	for (i = 0; i < FRAME_SIZE; ++i)
+		pcm[i] = mix[i] > 32767 ? 32767 :
+			 mix[i] < -32768 ? -32768 : mix[i];
+
+	xrun = alsa_write(e->dev, pcm, FRAME_SIZE);
+	if (xrun)
+		speex_echo_state_reset(e->echo_state);
+	speex_echo_playback(e->echo_state, pcm);
+
+	return xrun;
+}
+
+static int engine_audio_capture(struct engine *e)
+{
+	int xrun;
+	short pcm[FRAME_SIZE];
+	short pcm2[FRAME_SIZE];
+	struct session *s;
+
+	xrun = alsa_read(e->dev, pcm, FRAME_SIZE);
+
+	speex_echo_capture(e->echo_state, pcm, pcm2);
+	speex_preprocess_run(e->preprocess, pcm2);
+
+	for_each_session(&e->sessions, s) {
+		if (s->state == ENGINE_STATE_SPEAKING)
+			engine_encode_frame(e, s, pcm2);
+	}
+
+	if (e->tx->len > 0 && engine_flush(e))
+		whine("Send datagram failed!\n");
+
+	return xrun;
+}
+
+static void engine_audio(struct engine *e, struct pollfd *pfds,
+			 unsigned int nfds)
+{
+	int miss = 0, busy = 0;
+	uint64_t start = engine_now();
+
+	if (alsa_play_ready(e->dev, pfds, nfds)) {
+		miss |= engine_audio_play(e);
+		busy = 1;
+	}
+
+	if (e->audio_on && alsa_cap_ready(e->dev, pfds, nfds)) {
+		miss |= engine_audio_capture(e);
+		busy = 1;
+	}
+
+	if (!busy)
+		return;
+
+	e->stats.periods++;
+	if (miss || engine_now() - start > FRAME_NSEC)
+		e->stats.deadline_miss++;
+}
+
+/* Headless engines send every call its own audio back. */
+static void engine_on_clock(struct reactor_timer *t, uint64_t expired)
+{
+	short pcm[FRAME_SIZE];
+	struct engine *e = t->arg;
+	struct session *s;
+	uint64_t start = engine_now();
+
+	for_each_session(&e->sessions, s) {
+		if (s->state != ENGINE_STATE_SPEAKING)
+			continue;
+
+		if (s->recv_started)
+			engine_decode_frame(e, s, pcm);
+		else
+			memset(pcm, 0, sizeof(pcm));
+
+		engine_encode_frame(e, s, pcm);
+	}
+
+	if (e->tx->len > 0 && engine_flush(e))
+		whine("Send datagram failed!\n");
+
+	e->stats.periods++;
+	if (expired > 1)
+		e->stats.deadline_miss += expired - 1;
+	else if (engine_now() - start > FRAME_NSEC)
+		e->stats.deadline_miss++;
+}
+
+static void engine_on_session_sock(struct reactor_fd *rf, uint32_t events)
+{
+	int filter;
+	unsigned int n;
+	struct engine *e = rf->arg;
+	struct session *s = container_of(rf, struct session, rf);
+
+	if (events & EPOLLERR) {
+		printf("Destination unreachable?\n");
+		engine_set_state(e, s, ENGINE_STATE_IDLE);
+		return;
+	}
+
+	/* The session may be gone once the batch is through. */
+	filter = s->filter;
+	n = engine_recv(e, rf->fd);
+	if (filter >= 0)
+		e->filters[filter].hits += n;
+}
+
+static void engine_on_session_timer(struct reactor_timer *t,
+				    uint64_t expired)
+{
+	struct engine *e = t->arg;
+	struct session *s = container_of(t, struct session, timer);
+
+	if (s->state == ENGINE_STATE_CALLOUT) {
+		whine("No answer from remote end!\n");
+		engine_hangup(e, s);
+	}
+}
+
+static void engine_on_ssock(struct reactor_fd *rf, uint32_t events)
+{
+	struct engine *e = rf->arg;
+	int filter = e->filter;
+	unsigned int n;
+
+	n = engine_recv(e, rf->fd);
+	if (filter >= 0)
+		e->filters[filter].hits += n;
+}
+
+static void engine_on_datagram(void *arg, char *msg, size_t len,
+			       struct sockaddr *raddr, socklen_t raddrlen)
+{
+	struct engine *e = arg;
+
+	if (e->filter >= 0)
+		e->filters[e->filter].hits++;
+
+	e->rx_at = engine_now();
+	engine_capture(e, e->rx_at, 0, raddr, msg, len);
+	engine_process(e, e->ssock, msg, len, raddr, raddrlen);
+}
+
+static void engine_on_uring(struct reactor_fd *rf, uint32_t events)
+{
+	struct engine *e = rf->arg;
+
+	uring_net_recv(e->un, engine_on_datagram, e, &e->net);
+}
+
+static void engine_on_cli(struct reactor_fd *rf, uint32_t events)
+{
+	engine_do_cli(rf->arg);
+}
+
+void engine_wakeup(void)
+{
+	mutexlock_lock(&engine_lock);
+	if (engine_reactor)
+		reactor_wakeup(engine_reactor);
+	mutexlock_unlock(&engine_lock);
+}
+
+void engine_stun_done(void)
+{
+	mutexlock_lock(&engine_lock);
+	engine_stun_ready = 1;
+	pthread_cond_signal(&engine_stun_cond);
+	mutexlock_unlock(&engine_lock);
+}
+
+static void engine_wait_stun(void)
+{
+	mutexlock_lock(&engine_lock);
+	while (!engine_stun_ready)
+		pthread_cond_wait(&engine_stun_cond, &engine_lock.lock);
+	mutexlock_unlock(&engine_lock);
+}
+
+static void engine_pin_cpu(struct engine *e)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t mask;
+
+	if (cpus <= 0)
+		return;
+
+	CPU_ZERO(&mask);
+	CPU_SET(e->id % cpus, &mask);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+		whine("Cannot pin worker %u to a CPU!\n", e->id);
+}
+
+/*
+ * Offers for our calls come in on a unix socket named after our port,
+ * in a directory private to our user, see shm_listen().
+ */
+static void engine_shm_listen(struct engine *e, int ssock)
+{
+	int ret;
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(ssock, (struct sockaddr *) &ss, &len) < 0)
+		return;
+
+	ret = shm_listen(sock_addr_port((struct sockaddr *) &ss), e->id);
+	if (ret < 0) {
+		whine("No local transport for worker %u: %s\n", e->id,
+		      strerror(-ret));
+		return;
+	}
+
+	e->shm_sock = ret;
+	reactor_add(&e->r, &e->shm_rf, e->shm_sock, EPOLLIN,
+		    engine_on_shm_offer, e);
+}
+
+/* Worker 0 writes to path, all others to path.<id>. */
+static void engine_capture_open(struct engine *e, const char *path)
+{
+	char name[PATH_MAX];
+
+	if (e->id == 0)
+		strlcpy(name, path, sizeof(name));
+	else
+		slprintf(name, sizeof(name), "%s.%u", path, e->id);
+
+	e->cap = capture_open(name, e->id);
+	if (!e->cap)
+		whine("Cannot capture worker %u to %s: %s\n", e->id, name,
+		      strerror(errno));
+}
 
-	usocki = pp->i;
-	usocko = pp->o;
+/* Looked up once, so dialing never waits for the relay's name. */
+static void engine_relay_init(struct engine *e, const char *relay)
+{
+	int ret;
+	char host[ADDRSIZ], *port;
+	struct addrinfo hints, *ahead, *ai;
+	struct resolv_result *res;
 
-	while (!stun_done)
-		sleep(0);
+	strlcpy(host, relay, sizeof(host));
+	port = strrchr(host, ':');
+	if (!port || port == host || !port[1])
+		panic("Relay must be given as <host>:<port>!\n");
+	*port++ = 0;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_protocol = IPPROTO_UDP;
-	hints.ai_flags = AI_PASSIVE;
 
-	ret = getaddrinfo(NULL, port, &hints, &ahead);
-	if (ret < 0)
-		panic("Cannot get address info!\n");
+	ret = getaddrinfo(host, port, &hints, &ahead);
+	if (ret)
+		panic("Cannot get address info of relay %s: %s!\n", relay,
+		      gai_strerror(ret));
 
-	for (ai = ahead; ai != NULL && ssock < 0; ai = ai->ai_next) {
-		ssock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (ssock < 0)
-			continue;
-		if (ai->ai_family == AF_INET6) {
-			int one = 1;
-#ifdef IPV6_V6ONLY
-			ret = setsockopt(ssock, IPPROTO_IPV6, IPV6_V6ONLY,
-					 &one, sizeof(one));
-			if (ret < 0) {
-				close(ssock);
-				ssock = -1;
-				continue;
-			}
-#else
-			close(ssock);
-			ssock = -1;
+	res = xzmalloc(sizeof(*res));
+	for (ai = ahead; ai && res->naddrs < RESOLV_MAX_ADDRS;
+	     ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(res->addrs[0]))
 			continue;
-#endif /* IPV6_V6ONLY */
+		memcpy(&res->addrs[res->naddrs], ai->ai_addr, ai->ai_addrlen);
+		res->addrlens[res->naddrs++] = ai->ai_addrlen;
+	}
+
+	freeaddrinfo(ahead);
+	if (res->naddrs == 0)
+		panic("No address for relay %s!\n", relay);
+
+	e->relay = res;
+}
+
+static void engine_init(struct engine *e, const struct engine_conf *conf,
+			unsigned int id, int ssock)
+{
+	int i, tmp, ret;
+
+	memset(e, 0, sizeof(*e));
+
+	e->id = id;
+	e->headless = id > 0 || !strcmp(conf->alsadev, "none");
+	e->echo = id > 0 && conf->echo;
+	e->usocki = -1;
+	e->usocko = -1;
+
+	session_table_init(&e->sessions);
+
+	e->rto = RTO_INIT;
+
+	e->rl = xmalloc(sizeof(*e->rl));
+	ratelimit_init(e->rl, PROBE_RATE, PROBE_BURST);
+	urandom_bytes(e->cookie_key, sizeof(e->cookie_key));
+
+	e->rx = mmsg_batch_alloc();
+	e->tx = mmsg_batch_alloc();
+	e->pool = pktbuf_pool_alloc();
+
+	reactor_init(&e->r);
+
+	e->ssock = ssock;
+	if (conf->backend == ENGINE_NET_URING) {
+		e->un = uring_net_open(ssock);
+		if (!e->un)
+			whine("No io_uring support, worker %u falls back to "
+			      "poll!\n", id);
+	}
+
+	e->filter = -1;
+	engine_filter_set(e, ssock, &e->filter, &e->filter_drops,
+			  SOCK_FILTER_PROBE);
+
+	e->red = min(conf->red, (unsigned int) SESSION_RED_MAX);
+	e->ptime = min(max(conf->ptime, 1U), (unsigned int) SESSION_PTIME_MAX);
+	e->lowlat = conf->lowlat;
+	if (e->lowlat) {
+		ret = sock_enable_lowlat(ssock);
+		if (ret < 0)
+			whine("Worker %u low latency socket setup incomplete: "
+			      "%s\n", id, strerror(-ret));
+		e->rxts = sock_enable_rx_timestamps(ssock) == 0;
+		if (!e->rxts)
+			whine("No receive timestamps for worker %u!\n", id);
+	}
+
+	e->pace = conf->pace;
+	if (e->pace == ENGINE_PACE_TXTIME) {
+		if (sock_enable_txtime(ssock) < 0) {
+			whine("No SO_TXTIME support, worker %u paces in "
+			      "user space!\n", id);
+			e->pace = ENGINE_PACE_WHEEL;
+		} else {
+			e->ssock_txtime = 1;
 		}
+	}
+	if (e->pace == ENGINE_PACE_WHEEL) {
+		e->wheel = pace_alloc();
+		reactor_timer_init(&e->r, &e->pace_timer, engine_on_pace, e);
+	}
 
-		mtu = IP_PMTUDISC_DONT;
-		setsockopt(ssock, SOL_IP, IP_MTU_DISCOVER, &mtu, sizeof(mtu));
+	if (e->un)
+		reactor_add(&e->r, &e->ssock_rf, e->un->efd, EPOLLIN,
+			    engine_on_uring, e);
+	else
+		reactor_add(&e->r, &e->ssock_rf, e->ssock, EPOLLIN,
+			    engine_on_ssock, e);
+
+	e->shm_sock = -1;
+	if (conf->shm)
+		engine_shm_listen(e, ssock);
+
+	if (conf->capture)
+		engine_capture_open(e, conf->capture);
+
+	if (id == 0) {
+		e->usocki = conf->pp.i;
+		e->usocko = conf->pp.o;
+		reactor_add(&e->r, &e->cli_rf, e->usocki, EPOLLIN,
+			    engine_on_cli, e);
+
+		e->resolv = xmalloc(sizeof(*e->resolv));
+		resolv_init(e->resolv);
+		reactor_add(&e->r, &e->resolv_rf, e->resolv->efd, EPOLLIN,
+			    engine_on_resolv, e);
+
+		if (conf->relay)
+			engine_relay_init(e, conf->relay);
+	}
 
-		ret = bind(ssock, ai->ai_addr, ai->ai_addrlen);
-		if (ret < 0) {
-			close(ssock);
-			ssock = -1;
-			continue;
+	e->mode = celt_mode_create(SAMPLING_RATE, FRAME_SIZE, NULL);
+
+	if (e->headless) {
+		reactor_timer_init(&e->r, &e->clock, engine_on_clock, e);
+		return;
+	}
+
+	e->dev = alsa_open(conf->alsadev, SAMPLING_RATE, 1, FRAME_SIZE);
+	if (!e->dev)
+		panic("Cannot open ALSA device %s!\n", conf->alsadev);
+
+	e->anfds = alsa_nfds(e->dev);
+	e->apfds = xzmalloc(sizeof(*e->apfds) * e->anfds);
+	e->audio_rf = xzmalloc(sizeof(*e->audio_rf) * e->anfds);
+	for (i = 0; i < e->anfds; ++i)
+		e->audio_rf[i].fd = -1;
+
+	e->echo_state = speex_echo_state_init(FRAME_SIZE, 10 * FRAME_SIZE);
+	tmp = SAMPLING_RATE;
+	speex_echo_ctl(e->echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &tmp);
+
+	tmp = 1;
+	e->preprocess = speex_preprocess_state_init(FRAME_SIZE, SAMPLING_RATE);
+	speex_preprocess_ctl(e->preprocess, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+	speex_preprocess_ctl(e->preprocess, SPEEX_PREPROCESS_SET_AGC, &tmp);
+	speex_preprocess_ctl(e->preprocess, SPEEX_PREPROCESS_SET_DEREVERB, &tmp);
+	speex_preprocess_ctl(e->preprocess, SPEEX_PREPROCESS_SET_ECHO_STATE,
+			     e->echo_state);
+
+	for (i = 0; i < __ENGINE_SOUND_MAX; ++i)
+		engine_load_tone(&e->tones[i], i);
+}
+
+static void engine_cleanup(struct engine *e)
+{
+	int i;
+	struct session *s;
+
+	for_each_session(&e->sessions, s)
+		engine_hangup(e, s);
+	for (i = 0; i < MAX_LINGER; ++i) {
+		if (e->lingers[i].used)
+			engine_linger_free(e, &e->lingers[i]);
+	}
+
+	celt_mode_destroy(e->mode);
+
+	for (i = 0; i < MMSG_BATCH; ++i) {
+		if (e->rx_bufs[i])
+			pktbuf_put(e->pool, e->rx_bufs[i]);
+	}
+	pktbuf_pool_free(e->pool);
+	mmsg_batch_free(e->rx);
+	mmsg_batch_free(e->tx);
+	xfree(e->rl);
+
+	if (e->headless) {
+		reactor_timer_destroy(&e->r, &e->clock);
+	} else {
+		for (i = 0; i < __ENGINE_SOUND_MAX; ++i) {
+			if (e->tones[i].pcm)
+				xfree(e->tones[i].pcm);
 		}
+
+		speex_preprocess_state_destroy(e->preprocess);
+		speex_echo_state_destroy(e->echo_state);
+
+		xfree(e->apfds);
+		xfree(e->audio_rf);
+		alsa_close(e->dev);
 	}
 
-	freeaddrinfo(ahead);
-	if (ssock < 0)
-		panic("Cannot open socket!\n");
+	if (e->wheel) {
+		reactor_timer_destroy(&e->r, &e->pace_timer);
+		pace_free(e->wheel);
+	}
+
+	reactor_del(&e->r, &e->cli_rf);
+	if (e->resolv) {
+		reactor_del(&e->r, &e->resolv_rf);
+		resolv_destroy(e->resolv);
+		xfree(e->resolv);
+	}
+	if (e->relay)
+		xfree(e->relay);
+	reactor_del(&e->r, &e->ssock_rf);
+	if (e->shm_sock >= 0) {
+		reactor_del(&e->r, &e->shm_rf);
+		shm_unlisten(e->shm_sock);
+	}
+	reactor_destroy(&e->r);
+	if (e->un)
+		uring_net_close(e->un);
+	if (e->cap)
+		capture_close(e->cap);
+	close(e->ssock);
+}
 
-	dev = alsa_open(alsadev, SAMPLING_RATE, 1, FRAME_SIZE);
-	if (!dev)
-		panic("Cannot open ALSA device %s!\n", alsadev);
+static void engine_loop(struct engine *e)
+{
+	unsigned int i;
 
-	state = ENGINE_STATE_IDLE;
 	while (likely(!quit)) {
-		int arg = state;
-		call_notifier_exec(CALL_STATE_MACHINE_CHANGED, &arg);
-		state = state_machine[state].process(ssock, &csock,
-						     usocki, usocko,
-						     dev);
+		for (i = 0; i < e->anfds; ++i)
+			e->apfds[i].revents = 0;
+		e->audio_ready = 0;
+
+		reactor_run_once(&e->r, -1);
+
+		if (e->audio_ready && e->audio_on)
+			engine_audio(e, e->apfds, e->anfds);
+	}
+}
+
+static void *engine_worker(void *arg)
+{
+	struct engine *e = arg;
+
+	engine_pin_cpu(e);
+	engine_loop(e);
+
+	return NULL;
+}
+
+/*
+ * With more than one worker, each one gets its own socket of a
+ * SO_REUSEPORT group on our port, see sock.c for how the kernel keeps
+ * a call on one worker.
+ */
+void *engine_main(void *arg)
+{
+	int ret, socks[ENGINE_MAX_WORKERS];
+	unsigned int i;
+	struct engine_conf *conf = arg;
+
+	init_call_notifier();
+
+	fec_init();
+	engine_set_fec(conf->fec_data, conf->fec_parity);
+
+	engine_wait_stun();
+
+	sock_open_listen_group(conf->port, socks, conf->workers);
+	for (i = 0; i < conf->workers; ++i) {
+		engines[i] = xmalloc(sizeof(*engines[i]));
+		engine_init(engines[i], conf, i, socks[i]);
+	}
+	engines[0]->tid = pthread_self();
+	engine_workers = conf->workers;
+
+	for (i = 1; i < engine_workers; ++i) {
+		ret = pthread_create(&engines[i]->tid, NULL, engine_worker,
+				     engines[i]);
+		if (ret)
+			panic("Cannot create worker thread!\n");
+	}
+
+	mutexlock_lock(&engine_lock);
+	engine_reactor = &engines[0]->r;
+	mutexlock_unlock(&engine_lock);
+
+	if (engine_workers > 1)
+		engine_pin_cpu(engines[0]);
+	engine_loop(engines[0]);
+
+	mutexlock_lock(&engine_lock);
+	engine_reactor = NULL;
+	mutexlock_unlock(&engine_lock);
+
+	for (i = 1; i < engine_workers; ++i) {
+		reactor_wakeup(&engines[i]->r);
+		pthread_join(engines[i]->tid, NULL);
 	}
 
-	alsa_close(dev);
-	close(ssock);
+	for (i = 0; i < engine_workers; ++i) {
+		engine_cleanup(engines[i]);
+		xfree(engines[i]);
+	}
 
 	pthread_exit(0);
 }
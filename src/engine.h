@@ -0,0 +1,55 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "xutils.h"
+
+#define ENGINE_MAX_WORKERS	64
+#define ENGINE_RED_MIN		8
+#define ENGINE_RED_MAX		32
+#define ENGINE_PTIME_MAX	8
+
+enum engine_backend {
+	ENGINE_NET_POLL = 0,
+	ENGINE_NET_URING,
+};
+
+enum engine_pace {
+	ENGINE_PACE_OFF = 0,
+	ENGINE_PACE_TXTIME,
+	ENGINE_PACE_WHEEL,
+};
+
+/*
+ * Worker 0 owns the sound device and the cli, further workers are
+ * headless. They have no way to ring, so they only exist with echo
+ * set, a load test where they answer each call with its own audio.
+ */
+struct engine_conf {
+	const char *port;
+	char *alsadev;
+	unsigned int workers;
+	int echo;
+	enum engine_backend backend;
+	enum engine_pace pace;
+	int lowlat;
+	unsigned int fec_data, fec_parity;
+	unsigned int red;
+	unsigned int ptime;
+	int shm;
+	const char *capture;
+	const char *relay;
+	struct pipepair pp;
+};
+
+extern void *engine_main(void *arg);
+extern void engine_wakeup(void);
+extern void engine_stun_done(void);
+
+#endif /* ENGINE_H */
@@ -0,0 +1,232 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ *
+ * Systematic Reed-Solomon erasure code over GF(2^8) with a Cauchy
+ * generator: parity symbol i is the sum over data symbols j times
+ * 1 / (x_i + y_j) with x_i = ndata + i and y_j = j. Every square
+ * submatrix of a Cauchy matrix is invertible, so any ndata out of
+ * ndata + nparity symbols give back the data.
+ */
+
+#include <string.h>
+#include <errno.h>
+#ifdef __SSSE3__
+# include <immintrin.h>
+#endif
+
+#include "built_in.h"
+#include "gf.h"
+#include "fec.h"
+
+static uint8_t fec_mul_t[256][256] __read_mostly;
+static uint8_t fec_inv_t[256] __read_mostly;
+/* Products of the low and high nibble, for pshufb. */
+static uint8_t fec_lo_t[256][16] __aligned_16;
+static uint8_t fec_hi_t[256][16] __aligned_16;
+
+/* Tables are ours, gf_init() may be called for other fields later. */
+void fec_init(void)
+{
+	int a, b;
+
+	gf_init(8);
+
+	for (a = 0; a < 256; ++a) {
+		for (b = 0; b < 256; ++b)
+			fec_mul_t[a][b] = gf_mul(a, b);
+		fec_inv_t[a] = a ? gf_inv(a) : 0;
+	}
+
+	for (a = 0; a < 256; ++a) {
+		for (b = 0; b < 16; ++b) {
+			fec_lo_t[a][b] = fec_mul_t[a][b];
+			fec_hi_t[a][b] = fec_mul_t[a][b << 4];
+		}
+	}
+}
+
+static inline uint8_t fec_coef(unsigned int ndata, unsigned int i,
+			       unsigned int j)
+{
+	return fec_inv_t[(ndata + i) ^ j];
+}
+
+/*
+ * dst += c * src. With SSSE3 a product is looked up by nibble in a 16
+ * byte table each, 16 or with AVX2 32 bytes per shuffle.
+ */
+static void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c,
+			size_t len)
+{
+	size_t i = 0;
+
+	if (c == 0)
+		return;
+	if (c == 1) {
+		for (i = 0; i < len; ++i)
+			dst[i] ^= src[i];
+		return;
+	}
+
+#ifdef __AVX2__
+	{
+		__m256i lo = _mm256_broadcastsi128_si256(
+			_mm_load_si128((const __m128i *) fec_lo_t[c]));
+		__m256i hi = _mm256_broadcastsi128_si256(
+			_mm_load_si128((const __m128i *) fec_hi_t[c]));
+		__m256i mask = _mm256_set1_epi8(0x0f);
+
+		for (; i + 32 <= len; i += 32) {
+			__m256i s = _mm256_loadu_si256((const __m256i *)
+						       (src + i));
+			__m256i d = _mm256_loadu_si256((const __m256i *)
+						       (dst + i));
+			__m256i l = _mm256_shuffle_epi8(lo,
+					_mm256_and_si256(s, mask));
+			__m256i h = _mm256_shuffle_epi8(hi,
+					_mm256_and_si256(
+						_mm256_srli_epi64(s, 4), mask));
+
+			d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+			_mm256_storeu_si256((__m256i *) (dst + i), d);
+		}
+	}
+#endif
+#ifdef __SSSE3__
+	{
+		__m128i lo = _mm_load_si128((const __m128i *) fec_lo_t[c]);
+		__m128i hi = _mm_load_si128((const __m128i *) fec_hi_t[c]);
+		__m128i mask = _mm_set1_epi8(0x0f);
+
+		for (; i + 16 <= len; i += 16) {
+			__m128i s = _mm_loadu_si128((const __m128i *)
+						    (src + i));
+			__m128i d = _mm_loadu_si128((const __m128i *)
+						    (dst + i));
+			__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+			__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(
+					_mm_srli_epi64(s, 4), mask));
+
+			d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+			_mm_storeu_si128((__m128i *) (dst + i), d);
+		}
+	}
+#endif
+	for (; i < len; ++i)
+		dst[i] ^= fec_mul_t[c][src[i]];
+}
+
+void fec_encode(unsigned int ndata, unsigned int nparity,
+		uint8_t *const *data, uint8_t **parity, size_t len)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < nparity; ++i) {
+		memset(parity[i], 0, len);
+		for (j = 0; j < ndata; ++j)
+			fec_mul_add(parity[i], data[j], fec_coef(ndata, i, j),
+				    len);
+	}
+}
+
+/* Gauss-Jordan, a is destroyed. */
+static int fec_invert(uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY],
+		      uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY],
+		      unsigned int n)
+{
+	unsigned int r, c, k;
+	uint8_t f, tmp;
+
+	for (r = 0; r < n; ++r) {
+		for (c = 0; c < n; ++c)
+			inv[r][c] = r == c;
+	}
+
+	for (c = 0; c < n; ++c) {
+		for (r = c; r < n && !a[r][c]; ++r)
+			;
+		if (r == n)
+			return -EINVAL;
+
+		for (k = 0; k < n && r != c; ++k) {
+			tmp = a[r][k], a[r][k] = a[c][k], a[c][k] = tmp;
+			tmp = inv[r][k], inv[r][k] = inv[c][k], inv[c][k] = tmp;
+		}
+
+		f = fec_inv_t[a[c][c]];
+		for (k = 0; k < n; ++k) {
+			a[c][k] = fec_mul_t[f][a[c][k]];
+			inv[c][k] = fec_mul_t[f][inv[c][k]];
+		}
+
+		for (r = 0; r < n; ++r) {
+			if (r == c || !a[r][c])
+				continue;
+			f = a[r][c];
+			for (k = 0; k < n; ++k) {
+				a[r][k] ^= fec_mul_t[f][a[c][k]];
+				inv[r][k] ^= fec_mul_t[f][inv[c][k]];
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Rebuilds the data symbols not in have from as many parity symbols
+ * in phave. Parity symbols used are clobbered. Returns the number of
+ * symbols recovered or -EAGAIN if there are more holes than parity.
+ */
+int fec_decode(unsigned int ndata, unsigned int nparity, uint8_t **data,
+	       const int *have, uint8_t **parity, const int *phave,
+	       size_t len)
+{
+	unsigned int i, j, m = 0, r = 0;
+	unsigned int miss[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+	uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+
+	for (j = 0; j < ndata; ++j) {
+		if (have[j])
+			continue;
+		if (m == FEC_MAX_PARITY)
+			return -EAGAIN;
+		miss[m++] = j;
+	}
+	if (m == 0)
+		return 0;
+
+	for (i = 0; i < nparity && r < m; ++i) {
+		if (phave[i])
+			rows[r++] = i;
+	}
+	if (r < m)
+		return -EAGAIN;
+
+	/* Take out what we know, the rest is the missing data's share. */
+	for (r = 0; r < m; ++r) {
+		for (j = 0; j < ndata; ++j) {
+			if (have[j])
+				fec_mul_add(parity[rows[r]], data[j],
+					    fec_coef(ndata, rows[r], j), len);
+		}
+		for (j = 0; j < m; ++j)
+			a[r][j] = fec_coef(ndata, rows[r], miss[j]);
+	}
+
+	if (fec_invert(a, inv, m) < 0)
+		return -EINVAL;
+
+	for (j = 0; j < m; ++j) {
+		memset(data[miss[j]], 0, len);
+		for (r = 0; r < m; ++r)
+			fec_mul_add(data[miss[j]], parity[rows[r]], inv[j][r],
+				    len);
+	}
+
+	return m;
+}
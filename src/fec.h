@@ -0,0 +1,24 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FEC_MAX_DATA	16
+#define FEC_MAX_PARITY	8
+
+extern void fec_init(void);
+extern void fec_encode(unsigned int ndata, unsigned int nparity,
+		       uint8_t *const *data, uint8_t **parity, size_t len);
+extern int fec_decode(unsigned int ndata, unsigned int nparity,
+		      uint8_t **data, const int *have, uint8_t **parity,
+		      const int *phave, size_t len);
+
+#endif /* FEC_H */
@@ -42,12 +42,12 @@ extern gf16_t *gf_log_t, *gf_exp_t;
  */
 #define _gf_modq_1(d)		(((d) & gf_ord()) + ((d) >> gf_extd()))
 
-#define gf_mul_fast(x, y)	gf_zdo(y, gf_exp[_gf_modq_1(gf_log[x] + gf_log[y])])
+#define gf_mul_fast(x, y)	gf_zdo(y, gf_exp(_gf_modq_1(gf_log(x) + gf_log(y))))
 #define gf_mul(x, y)		gf_zdo(x, gf_mul_fast(x, y))
-#define gf_square(x)		gf_zdo(x, gf_exp[_gf_modq_1(gf_log[x] << 1)])
-#define gf_sqrt(x)		gf_zdo(x, gf_exp[_gf_modq_1(gf_log[x] << (gf_extd() - 1))])
-#define gf_div(x, y)		gf_zdo(x, gf_exp[_gf_modq_1(gf_log[x] - gf_log[y])])
-#define gf_inv(x)		gf_exp[gf_ord() - gf_log[x]]
+#define gf_square(x)		gf_zdo(x, gf_exp(_gf_modq_1(gf_log(x) << 1)))
+#define gf_sqrt(x)		gf_zdo(x, gf_exp(_gf_modq_1(gf_log(x) << (gf_extd() - 1))))
+#define gf_div(x, y)		gf_zdo(x, gf_exp(_gf_modq_1(gf_log(x) - gf_log(y))))
+#define gf_inv(x)		gf_exp(gf_ord() - gf_log(x))
 
 extern void gf_init(int extdeg);
 extern gf16_t gf_rand(int (*rnd_u8)(void));
@@ -0,0 +1,257 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+
+#include "built_in.h"
+#include "xmalloc.h"
+#include "mmsg.h"
+
+#ifndef UDP_SEGMENT
+# define UDP_SEGMENT	103
+#endif
+
+#ifndef SCM_TIMESTAMPING
+# define SCM_TIMESTAMPING	SO_TIMESTAMPING
+#endif
+
+#ifndef SCM_TXTIME
+# define SCM_TXTIME	61
+#endif
+
+struct mmsg_batch *mmsg_batch_alloc(void)
+{
+	struct mmsg_batch *b;
+
+	b = xmalloc_aligned(sizeof(*b), 64);
+	memset(b, 0, sizeof(*b));
+
+	return b;
+}
+
+void mmsg_batch_free(struct mmsg_batch *b)
+{
+	xfree(b);
+}
+
+static void mmsg_prepare(struct mmsg_batch *b, int i, size_t len)
+{
+	b->iov[i].iov_base = b->buff[i];
+	b->iov[i].iov_len = len;
+
+	memset(&b->hdr[i], 0, sizeof(b->hdr[i]));
+	b->hdr[i].msg_hdr.msg_iov = &b->iov[i];
+	b->hdr[i].msg_hdr.msg_iovlen = 1;
+	b->hdr[i].msg_hdr.msg_name = &b->addr[i];
+	b->hdr[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+}
+
+/* Drains up to MMSG_BATCH datagrams with a single syscall. */
+int mmsg_recv(int sock, struct mmsg_batch *b, struct mmsg_stats *st)
+{
+	int i, ret;
+
+	for (i = 0; i < MMSG_BATCH; ++i) {
+		mmsg_prepare(b, i, MMSG_SIZE);
+		if (b->rxbuf[i])
+			b->iov[i].iov_base = b->rxbuf[i];
+		b->hdr[i].msg_hdr.msg_control = b->ctrl[i];
+		b->hdr[i].msg_hdr.msg_controllen = sizeof(b->ctrl[i]);
+	}
+
+	ret = recvmmsg(sock, b->hdr, MMSG_BATCH, MSG_DONTWAIT, NULL);
+	st->rx_calls++;
+	if (ret <= 0)
+		return 0;
+
+	st->rx_pkts += ret;
+	if (ret > st->rx_max_batch)
+		st->rx_max_batch = ret;
+
+	return ret;
+}
+
+void mmsg_tx_commit(struct mmsg_batch *b, int sock,
+		    const struct sockaddr *addr, socklen_t addrlen,
+		    size_t len)
+{
+	int i = b->len;
+
+	mmsg_prepare(b, i, len);
+	memcpy(&b->addr[i], addr, addrlen);
+	b->hdr[i].msg_hdr.msg_namelen = addrlen;
+	b->fd[i] = sock;
+	b->segs[i] = 1;
+
+	b->len++;
+}
+
+/*
+ * Kernel arrival time of received slot i in CLOCK_REALTIME ns, or 0
+ * if the socket has no SO_TIMESTAMPING.
+ */
+uint64_t mmsg_rx_time(struct mmsg_batch *b, int i)
+{
+	struct msghdr *mh = &b->hdr[i].msg_hdr;
+	struct scm_timestamping *tss;
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+
+		tss = (struct scm_timestamping *) CMSG_DATA(cm);
+		return tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+	}
+
+	return 0;
+}
+
+/*
+ * Launch time in CLOCK_MONOTONIC ns for the last committed slot, the
+ * socket needs SO_TXTIME. The fq qdisc holds it back until then.
+ */
+void mmsg_tx_set_time(struct mmsg_batch *b, uint64_t when)
+{
+	int i = b->len - 1;
+	struct msghdr *mh = &b->hdr[i].msg_hdr;
+	struct cmsghdr *cm;
+
+	mh->msg_control = b->ctrl[i];
+	mh->msg_controllen = CMSG_SPACE(sizeof(when));
+
+	cm = CMSG_FIRSTHDR(mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(when));
+	memcpy(CMSG_DATA(cm), &when, sizeof(when));
+
+	b->timed = 1;
+}
+
+static inline int mmsg_same_dst(struct mmsg_batch *b, unsigned int i,
+				unsigned int j)
+{
+	struct msghdr *a = &b->hdr[i].msg_hdr, *c = &b->hdr[j].msg_hdr;
+
+	return b->fd[i] == b->fd[j] && a->msg_namelen == c->msg_namelen &&
+	       !memcmp(a->msg_name, c->msg_name, a->msg_namelen);
+}
+
+/*
+ * Folds runs of slots into one message each, the slots' iovecs are
+ * adjacent already. All segments but the last must have the size of
+ * the first, the kernel cuts the payload at that size. Returns the
+ * number of messages left.
+ */
+static unsigned int mmsg_coalesce(struct mmsg_batch *b, struct mmsg_stats *st)
+{
+	unsigned int i, j, seg, out = 0;
+	size_t size;
+	struct msghdr *mh;
+	struct cmsghdr *cm;
+
+	for (i = 0; i < b->len; i += seg, out++) {
+		size = b->iov[i].iov_len;
+
+		for (seg = 1; i + seg < b->len; ++seg) {
+			j = i + seg;
+			if (!mmsg_same_dst(b, i, j) || b->iov[j].iov_len > size)
+				break;
+			if (b->iov[j].iov_len < size) {
+				seg++;
+				break;
+			}
+		}
+
+		if (out != i) {
+			b->hdr[out] = b->hdr[i];
+			b->fd[out] = b->fd[i];
+		}
+		b->segs[out] = seg;
+		if (seg == 1)
+			continue;
+
+		mh = &b->hdr[out].msg_hdr;
+		mh->msg_iovlen = seg;
+		mh->msg_control = b->ctrl[out];
+		mh->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+		cm = CMSG_FIRSTHDR(mh);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *) CMSG_DATA(cm) = size;
+
+		st->tx_gso += seg;
+	}
+
+	return out;
+}
+
+/*
+ * sendmmsg(2) works on one socket, so consecutive slots of the same
+ * socket go out together. A message the kernel refuses is skipped and
+ * accounted, the rest of the batch is still sent.
+ */
+int mmsg_flush(struct mmsg_batch *b, struct mmsg_stats *st)
+{
+	int i, ret, errs = 0;
+	unsigned int off = 0, run, len;
+
+	len = b->gso && !b->timed ? mmsg_coalesce(b, st) : b->len;
+
+	while (off < len) {
+		for (run = 1; off + run < len; ++run) {
+			if (b->fd[off + run] != b->fd[off])
+				break;
+		}
+
+		ret = sendmmsg(b->fd[off], &b->hdr[off], run, 0);
+		st->tx_calls++;
+		if (unlikely(ret <= 0)) {
+			ret = 1;
+			errs += b->segs[off];
+		} else {
+			for (i = 0; i < ret; ++i)
+				st->tx_pkts += b->segs[off + i];
+			if (ret > st->tx_max_batch)
+				st->tx_max_batch = ret;
+		}
+
+		off += ret;
+	}
+
+	st->tx_errs += errs;
+	b->len = 0;
+	b->timed = 0;
+
+	return errs;
+}
+
+void mmsg_dump_stats(const char *name, struct mmsg_stats *st)
+{
+	printf("%s rx: %llu pkts in %llu syscalls (%.2f syscalls/pkt, "
+	       "max batch %u)\n", name, (unsigned long long) st->rx_pkts,
+	       (unsigned long long) st->rx_calls, st->rx_pkts ?
+	       (double) st->rx_calls / st->rx_pkts : 0.0, st->rx_max_batch);
+	printf("%s tx: %llu pkts in %llu syscalls (%.2f syscalls/pkt, "
+	       "max batch %u, %llu gso segments, %llu errors)\n", name,
+	       (unsigned long long) st->tx_pkts,
+	       (unsigned long long) st->tx_calls, st->tx_pkts ?
+	       (double) st->tx_calls / st->tx_pkts : 0.0, st->tx_max_batch,
+	       (unsigned long long) st->tx_gso,
+	       (unsigned long long) st->tx_errs);
+}
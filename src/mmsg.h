@@ -0,0 +1,88 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef MMSG_H
+#define MMSG_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define MMSG_BATCH	32
+#define MMSG_SIZE	1500
+/* Room for SCM_TIMESTAMPING on receive and SCM_TXTIME on send. */
+#define MMSG_CTRL	CMSG_SPACE(3 * sizeof(struct timespec))
+
+struct mmsg_stats {
+	uint64_t rx_calls;
+	uint64_t rx_pkts;
+	uint64_t tx_calls;
+	uint64_t tx_pkts;
+	uint64_t tx_errs;
+	uint64_t tx_gso;
+	uint32_t rx_max_batch;
+	uint32_t tx_max_batch;
+};
+
+/*
+ * With gso set, mmsg_flush() hands runs of equally sized datagrams to
+ * the same peer to the kernel as one UDP_SEGMENT send. Only enable it
+ * on sockets where sock_has_udp_gso() said yes. A batch that carries
+ * launch times is sent without gso. Received datagrams land in rxbuf[i]
+ * instead of buff[i] where the caller set it, e.g. to pool buffers.
+ */
+struct mmsg_batch {
+	unsigned int len;
+	int gso, timed;
+	int fd[MMSG_BATCH];
+	uint16_t segs[MMSG_BATCH];
+	struct mmsghdr hdr[MMSG_BATCH];
+	struct iovec iov[MMSG_BATCH];
+	struct sockaddr_storage addr[MMSG_BATCH];
+	char ctrl[MMSG_BATCH][MMSG_CTRL];
+	char *rxbuf[MMSG_BATCH];
+	char buff[MMSG_BATCH][MMSG_SIZE];
+};
+
+extern struct mmsg_batch *mmsg_batch_alloc(void);
+extern void mmsg_batch_free(struct mmsg_batch *b);
+extern int mmsg_recv(int sock, struct mmsg_batch *b, struct mmsg_stats *st);
+extern int mmsg_flush(struct mmsg_batch *b, struct mmsg_stats *st);
+extern void mmsg_dump_stats(const char *name, struct mmsg_stats *st);
+
+static inline int mmsg_full(struct mmsg_batch *b)
+{
+	return b->len == MMSG_BATCH;
+}
+
+/* Next free tx slot, the caller fills it in place and commits. */
+static inline char *mmsg_tx_slot(struct mmsg_batch *b)
+{
+	return b->buff[b->len];
+}
+
+extern void mmsg_tx_commit(struct mmsg_batch *b, int sock,
+			   const struct sockaddr *addr, socklen_t addrlen,
+			   size_t len);
+extern void mmsg_tx_set_time(struct mmsg_batch *b, uint64_t when);
+extern uint64_t mmsg_rx_time(struct mmsg_batch *b, int i);
+
+static inline char *mmsg_rx_data(struct mmsg_batch *b, int i, size_t *len)
+{
+	*len = b->hdr[i].msg_len;
+	return b->iov[i].iov_base;
+}
+
+static inline struct sockaddr *mmsg_rx_addr(struct mmsg_batch *b, int i,
+					    socklen_t *addrlen)
+{
+	*addrlen = b->hdr[i].msg_hdr.msg_namelen;
+	return (struct sockaddr *) &b->addr[i];
+}
+
+#endif /* MMSG_H */
@@ -0,0 +1,99 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+
+#include "built_in.h"
+#include "xmalloc.h"
+#include "pace.h"
+
+struct pace_wheel *pace_alloc(void)
+{
+	int i;
+	struct pace_wheel *w;
+
+	w = xmalloc(sizeof(*w));
+	memset(w, 0, sizeof(*w));
+
+	for (i = 0; i < PACE_POOL; ++i) {
+		w->pool[i].next = w->free;
+		w->free = &w->pool[i];
+	}
+
+	return w;
+}
+
+void pace_free(struct pace_wheel *w)
+{
+	xfree(w);
+}
+
+/* Returns -ENOBUFS if the wheel is full, the caller sends right away. */
+int pace_add(struct pace_wheel *w, uint64_t now, uint64_t when, int sock,
+	     const struct sockaddr *addr, socklen_t addrlen,
+	     const void *data, size_t len)
+{
+	uint64_t tick;
+	struct pace_pkt *p = w->free;
+
+	if (unlikely(!p || addrlen > sizeof(p->addr) || len > MMSG_SIZE)) {
+		w->stats.overflow++;
+		return -ENOBUFS;
+	}
+
+	/* An idle wheel has not turned, catch up first. */
+	if (w->queued == 0)
+		w->base = now;
+
+	tick = when > w->base ? (when - w->base) / PACE_GRAN : 0;
+	if (tick >= PACE_SLOTS) {
+		tick = PACE_SLOTS - 1;
+		w->stats.clamped++;
+	}
+
+	w->free = p->next;
+
+	p->sock = sock;
+	p->addrlen = addrlen;
+	p->len = len;
+	memcpy(&p->addr, addr, addrlen);
+	memcpy(p->data, data, len);
+
+	tick = (w->cur + tick) % PACE_SLOTS;
+	p->next = w->slot[tick];
+	w->slot[tick] = p;
+
+	w->queued++;
+	w->stats.queued++;
+
+	return 0;
+}
+
+/* Hands everything that is due to cb, slot by slot. */
+void pace_run(struct pace_wheel *w, uint64_t now, pace_cb_t cb, void *arg)
+{
+	struct pace_pkt *p, *next;
+
+	while (w->queued > 0 && w->base <= now) {
+		p = w->slot[w->cur];
+		w->slot[w->cur] = NULL;
+
+		for (; p; p = next) {
+			next = p->next;
+			cb(arg, p);
+
+			p->next = w->free;
+			w->free = p;
+			w->queued--;
+		}
+
+		w->cur = (w->cur + 1) % PACE_SLOTS;
+		w->base += PACE_GRAN;
+	}
+}
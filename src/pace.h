@@ -0,0 +1,65 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "mmsg.h"
+
+#define PACE_SLOTS	64
+#define PACE_POOL	128
+#define PACE_GRAN	(250 * 1000ULL)
+
+struct pace_pkt {
+	struct pace_pkt *next;
+	int sock;
+	socklen_t addrlen;
+	size_t len;
+	struct sockaddr_storage addr;
+	char data[MMSG_SIZE];
+};
+
+struct pace_stats {
+	uint64_t queued;
+	uint64_t overflow;
+	uint64_t clamped;
+};
+
+/*
+ * User space stand-in for the fq qdisc: a hashed timer wheel of
+ * PACE_SLOTS slots, PACE_GRAN ns each, i.e. a horizon of 16ms. Slot
+ * cur holds what is due from base on; datagrams further out than the
+ * horizon are clamped to its end.
+ */
+struct pace_wheel {
+	uint64_t base;
+	unsigned int cur, queued;
+	struct pace_pkt *slot[PACE_SLOTS];
+	struct pace_pkt *free;
+	struct pace_pkt pool[PACE_POOL];
+	struct pace_stats stats;
+};
+
+typedef void (*pace_cb_t)(void *arg, struct pace_pkt *p);
+
+extern struct pace_wheel *pace_alloc(void);
+extern void pace_free(struct pace_wheel *w);
+extern int pace_add(struct pace_wheel *w, uint64_t now, uint64_t when,
+		    int sock, const struct sockaddr *addr, socklen_t addrlen,
+		    const void *data, size_t len);
+extern void pace_run(struct pace_wheel *w, uint64_t now, pace_cb_t cb,
+		     void *arg);
+
+static inline int pace_empty(struct pace_wheel *w)
+{
+	return w->queued == 0;
+}
+
+#endif /* PACE_H */
@@ -0,0 +1,54 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "built_in.h"
+#include "xmalloc.h"
+#include "pktbuf.h"
+
+struct pktbuf_pool *pktbuf_pool_alloc(void)
+{
+	int i;
+	struct pktbuf_pool *p;
+
+	p = xmalloc_aligned(sizeof(*p), 64);
+	memset(p, 0, sizeof(*p));
+
+	for (i = PKTBUF_NUM - 1; i >= 0; --i) {
+		p->bufs[i].next = p->free;
+		p->free = &p->bufs[i];
+	}
+
+	return p;
+}
+
+void pktbuf_pool_free(struct pktbuf_pool *p)
+{
+	xfree(p);
+}
+
+/* For data that did not arrive in a pool buffer, e.g. repaired by FEC. */
+struct pktbuf *pktbuf_copy(struct pktbuf_pool *p, const void *data,
+			   size_t len)
+{
+	struct pktbuf *b;
+
+	if (unlikely(len > sizeof(b->data)))
+		return NULL;
+
+	b = pktbuf_get(p);
+	if (!b)
+		return NULL;
+
+	memcpy(b->data, data, len);
+	p->stats.copies++;
+	p->stats.copied += len;
+
+	return b;
+}
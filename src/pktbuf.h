@@ -0,0 +1,95 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PKTBUF_H
+#define PKTBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "built_in.h"
+#include "mmsg.h"
+
+#define PKTBUF_NUM	1024
+
+/*
+ * A datagram as received, shared by all frames in it. Each frame held
+ * by a jitter buffer owns a reference, the buffer returns to the pool
+ * with the last one.
+ */
+struct pktbuf {
+	struct pktbuf *next;
+	uint32_t ref;
+	char data[MMSG_SIZE];
+} __cacheline_aligned;
+
+struct pktbuf_stats {
+	uint64_t gets, empty;
+	uint64_t copies, copied;
+	unsigned int peak;
+};
+
+/*
+ * One per worker, so no locking. The free list is LIFO, the buffer we
+ * get is the one put last and most likely still in the cache.
+ */
+struct pktbuf_pool {
+	struct pktbuf *free;
+	unsigned int used;
+	struct pktbuf_stats stats;
+	struct pktbuf bufs[PKTBUF_NUM];
+};
+
+extern struct pktbuf_pool *pktbuf_pool_alloc(void);
+extern void pktbuf_pool_free(struct pktbuf_pool *p);
+extern struct pktbuf *pktbuf_copy(struct pktbuf_pool *p, const void *data,
+				  size_t len);
+
+static inline struct pktbuf *pktbuf_get(struct pktbuf_pool *p)
+{
+	struct pktbuf *b = p->free;
+
+	if (unlikely(!b)) {
+		p->stats.empty++;
+		return NULL;
+	}
+
+	p->free = b->next;
+	b->ref = 1;
+
+	p->stats.gets++;
+	if (++p->used > p->stats.peak)
+		p->stats.peak = p->used;
+
+	return b;
+}
+
+static inline void pktbuf_ref(struct pktbuf *b)
+{
+	b->ref++;
+}
+
+static inline void pktbuf_put(struct pktbuf_pool *p, struct pktbuf *b)
+{
+	if (--b->ref > 0)
+		return;
+
+	b->next = p->free;
+	p->free = b;
+	p->used--;
+}
+
+/* True if data lies within b, i.e. a reference to b covers it. */
+static inline int pktbuf_has(const struct pktbuf *b, const void *data,
+			     size_t len)
+{
+	const char *d = data;
+
+	return b && d >= b->data && d + len <= b->data + sizeof(b->data);
+}
+
+#endif /* PKTBUF_H */
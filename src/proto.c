@@ -0,0 +1,247 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "built_in.h"
+#include "proto.h"
+#include "die.h"
+
+/*
+ * Legacy packets carry no version at all. Their first byte is the top
+ * of a sample counter that starts at zero, so it only collides with
+ * our version nibble after roughly three hours of a legacy call.
+ */
+static int transsip_decode_legacy(const uint8_t *buff, size_t len,
+				  struct transsip_pkt *pkt)
+{
+	struct transsip_hdr_legacy hdr;
+
+	if (len < sizeof(hdr))
+		return -EINVAL;
+
+	memcpy(&hdr, buff, sizeof(hdr));
+
+	pkt->version = TRANSSIP_VERSION_LEGACY;
+	pkt->flags = hdr.flags & (TRANSSIP_EST | TRANSSIP_PSH |
+				  TRANSSIP_BSY | TRANSSIP_FIN);
+	pkt->callid = 0;
+	pkt->seq = ntohl(hdr.seq);
+	pkt->payload = buff + sizeof(hdr);
+	pkt->len = len - sizeof(hdr);
+	pkt->type = pkt->len > 0 ? TRANSSIP_PT_CELT : TRANSSIP_PT_CTL;
+	pkt->frames = 1;
+	pkt->ptime = 0;
+
+	return 0;
+}
+
+int transsip_decode(const uint8_t *buff, size_t len, struct transsip_pkt *pkt)
+{
+	struct transsip_hdr hdr;
+
+	if (len < sizeof(hdr) || (buff[0] >> 4) != TRANSSIP_VERSION)
+		return transsip_decode_legacy(buff, len, pkt);
+
+	memcpy(&hdr, buff, sizeof(hdr));
+	if (unlikely(hdr.type >= __TRANSSIP_PT_MAX))
+		return -EINVAL;
+
+	pkt->version = TRANSSIP_VERSION;
+	pkt->flags = hdr.flags;
+	pkt->type = hdr.type;
+	pkt->callid = ntohl(hdr.callid);
+	pkt->seq = ntohl(hdr.seq);
+	pkt->frames = max(hdr.frames & 0xf, 1);
+	pkt->ptime = hdr.frames >> 4;
+	pkt->payload = buff + sizeof(hdr);
+	pkt->len = len - sizeof(hdr);
+
+	if (pkt->flags & TRANSSIP_TSE) {
+		struct transsip_tse tse;
+
+		if (pkt->len < sizeof(tse))
+			return -EINVAL;
+
+		memcpy(&tse, pkt->payload, sizeof(tse));
+		pkt->ts = ntohl(tse.ts);
+		pkt->echo = ntohl(tse.echo);
+		pkt->hold = ntohl(tse.hold);
+		pkt->payload += sizeof(tse);
+		pkt->len -= sizeof(tse);
+	}
+
+	return 0;
+}
+
+/* Writes the header only, returns its length or 0 if it does not fit. */
+size_t transsip_encode(uint8_t *buff, size_t len,
+		       const struct transsip_pkt *pkt)
+{
+	struct transsip_hdr hdr;
+	struct transsip_hdr_legacy lhdr;
+
+	if (pkt->version == TRANSSIP_VERSION_LEGACY) {
+		if (len < sizeof(lhdr))
+			return 0;
+
+		lhdr.seq = htonl(pkt->seq);
+		lhdr.flags = pkt->flags;
+		memcpy(buff, &lhdr, sizeof(lhdr));
+
+		return sizeof(lhdr);
+	}
+
+	if (len < sizeof(hdr) + (pkt->flags & TRANSSIP_TSE ?
+				 sizeof(struct transsip_tse) : 0))
+		return 0;
+
+	hdr.ver = TRANSSIP_VERSION << 4;
+	hdr.flags = pkt->flags;
+	hdr.type = pkt->type;
+	hdr.frames = (pkt->ptime & 0xf) << 4 | (pkt->frames & 0xf);
+	hdr.callid = htonl(pkt->callid);
+	hdr.seq = htonl(pkt->seq);
+	memcpy(buff, &hdr, sizeof(hdr));
+
+	if (pkt->flags & TRANSSIP_TSE) {
+		struct transsip_tse tse;
+
+		tse.ts = htonl(pkt->ts);
+		tse.echo = htonl(pkt->echo);
+		tse.hold = htonl(pkt->hold);
+		memcpy(buff + sizeof(hdr), &tse, sizeof(tse));
+
+		return sizeof(hdr) + sizeof(tse);
+	}
+
+	return sizeof(hdr);
+}
+
+/* Fills TRANSSIP_REPORT_LEN bytes, rr is in host byte order. */
+void transsip_report_encode(uint8_t *buff, const struct transsip_report *rr)
+{
+	struct transsip_report *wire = (struct transsip_report *) buff;
+
+	memset(wire, 0, sizeof(*wire));
+	wire->fraction = rr->fraction;
+	wire->lost = htonl(rr->lost);
+	wire->highest = htonl(rr->highest);
+	wire->jitter = htonl(rr->jitter);
+	wire->late = htonl(rr->late);
+}
+
+int transsip_report_decode(const struct transsip_pkt *pkt,
+			   struct transsip_report *rr)
+{
+	if (pkt->type != TRANSSIP_PT_REPORT ||
+	    pkt->len < sizeof(*rr))
+		return -EINVAL;
+
+	memcpy(rr, pkt->payload, sizeof(*rr));
+	rr->lost = ntohl(rr->lost);
+	rr->highest = ntohl(rr->highest);
+	rr->jitter = ntohl(rr->jitter);
+	rr->late = ntohl(rr->late);
+
+	return 0;
+}
+
+/* Fills TRANSSIP_RELAY_LEN bytes, type is the one of the wrapped packet. */
+int transsip_relay_encode(uint8_t *buff, const struct sockaddr *addr,
+			  uint8_t type)
+{
+	struct transsip_relay *wire = (struct transsip_relay *) buff;
+
+	memset(wire, 0, sizeof(*wire));
+	wire->type = type;
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *in = (const void *) addr;
+		wire->family = 4;
+		wire->port = in->sin_port;
+		memcpy(wire->addr, &in->sin_addr, sizeof(in->sin_addr));
+		return 0;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 *in6 = (const void *) addr;
+		wire->family = 6;
+		wire->port = in6->sin6_port;
+		memcpy(wire->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+		return 0;
+	}
+	default:
+		return -EAFNOSUPPORT;
+	}
+}
+
+/* Relay requests do not nest, the inner type must be a plain one. */
+int transsip_relay_decode(const struct transsip_pkt *pkt,
+			  struct sockaddr_storage *addr, socklen_t *addrlen,
+			  uint8_t *type)
+{
+	struct transsip_relay wire;
+	struct sockaddr_in *in = (struct sockaddr_in *) addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+
+	if (pkt->type != TRANSSIP_PT_RELAY ||
+	    pkt->len < sizeof(wire))
+		return -EINVAL;
+
+	memcpy(&wire, pkt->payload, sizeof(wire));
+	if (wire.type >= __TRANSSIP_PT_MAX ||
+	    wire.type == TRANSSIP_PT_RELAY || wire.port == 0)
+		return -EINVAL;
+
+	memset(addr, 0, sizeof(*addr));
+	*type = wire.type;
+
+	switch (wire.family) {
+	case 4:
+		in->sin_family = AF_INET;
+		in->sin_port = wire.port;
+		memcpy(&in->sin_addr, wire.addr, sizeof(in->sin_addr));
+		*addrlen = sizeof(*in);
+		return 0;
+	case 6:
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = wire.port;
+		memcpy(&in6->sin6_addr, wire.addr, sizeof(in6->sin6_addr));
+		*addrlen = sizeof(*in6);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+void transsip_dump(const uint8_t *buff, size_t len)
+{
+	struct transsip_pkt pkt;
+
+	if (transsip_decode(buff, len, &pkt) < 0) {
+		whine("[dbg] pkt too small or malformed!\n");
+		return;
+	}
+
+	whine("[dbg] packet:\n");
+	whine("[dbg]   ver: %u\n", pkt.version);
+	whine("[dbg]   callid: 0x%08x\n", pkt.callid);
+	whine("[dbg]   seq: %u\n", pkt.seq);
+	whine("[dbg]   type: %u\n", pkt.type);
+	whine("[dbg]   est: %d\n", !!(pkt.flags & TRANSSIP_EST));
+	whine("[dbg]   psh: %d\n", !!(pkt.flags & TRANSSIP_PSH));
+	whine("[dbg]   bsy: %d\n", !!(pkt.flags & TRANSSIP_BSY));
+	whine("[dbg]   fin: %d\n", !!(pkt.flags & TRANSSIP_FIN));
+	if (pkt.flags & TRANSSIP_TSE)
+		whine("[dbg]   ts: %u, echo: %u, hold: %u\n", pkt.ts,
+		      pkt.echo, pkt.hold);
+	whine("[dbg]   frames: %u, ptime: %u\n", pkt.frames, pkt.ptime);
+	whine("[dbg]   payload: %zu bytes\n", pkt.len);
+}
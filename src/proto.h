@@ -0,0 +1,223 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define TRANSSIP_VERSION	2
+#define TRANSSIP_VERSION_LEGACY	1
+
+#define TRANSSIP_EST		(1 << 0)
+#define TRANSSIP_PSH		(1 << 1)
+#define TRANSSIP_BSY		(1 << 2)
+#define TRANSSIP_FIN		(1 << 3)
+#define TRANSSIP_TSE		(1 << 4)
+
+enum transsip_payload {
+	TRANSSIP_PT_CTL = 0,
+	TRANSSIP_PT_CELT,
+	TRANSSIP_PT_COOKIE,
+	TRANSSIP_PT_RESUME,
+	TRANSSIP_PT_REPORT,
+	TRANSSIP_PT_FEC,
+	TRANSSIP_PT_RED,
+	TRANSSIP_PT_RELAY,
+	__TRANSSIP_PT_MAX,
+};
+
+#define TRANSSIP_COOKIE_LEN	8
+#define TRANSSIP_RESUME_LEN	16
+#define TRANSSIP_REPORT_LEN	20
+#define TRANSSIP_RELAY_LEN	20
+#define TRANSSIP_FRAMES_MAX	15
+
+/*
+ * Wire header, all fields in network byte order, no bitfields:
+ *
+ *  0       4       8      16      24  28  32
+ *  +-------+-------+-------+-------+---+---+
+ *  |  ver  |  res  | flags | type  |max|cnt|
+ *  +-------+-------+-------+-------+---+---+
+ *  |                call id                |
+ *  +---------------------------------------+
+ *  |     sequence of first frame (smpl)    |
+ *  +---------------------------------------+
+ *
+ * A media packet carries cnt frames of equal length back to back, 0
+ * counts as one. In max the sender tells how many frames per packet
+ * it wants at most, 0 if it does not say, which gets it one.
+ */
+struct transsip_hdr {
+	uint8_t ver;
+	uint8_t flags;
+	uint8_t type;
+	uint8_t frames;
+	uint32_t callid;
+	uint32_t seq;
+} __attribute__((packed));
+
+/*
+ * Timestamp echo, follows the header if TRANSSIP_TSE is set. Times
+ * are in us of the sender's clock and wrap. The echo is the last send
+ * time seen from the peer, hold the time it was held before this
+ * packet went out, so the peer gets its round trip time without the
+ * clocks having to agree:
+ *
+ *  +---------------------------------------+
+ *  |               send time               |
+ *  +---------------------------------------+
+ *  |            echoed send time           |
+ *  +---------------------------------------+
+ *  |               hold time               |
+ *  +---------------------------------------+
+ */
+struct transsip_tse {
+	uint32_t ts;
+	uint32_t echo;
+	uint32_t hold;
+} __attribute__((packed));
+
+/*
+ * Receiver report, payload of TRANSSIP_PT_REPORT, after RFC 3550. The
+ * fraction lost is in 1/256 since the last report, jitter in samples:
+ *
+ *  0       8      16      24      32
+ *  +-------+-------+-------+-------+
+ *  | lost  |          res          |
+ *  +-------+-------+-------+-------+
+ *  |     cumulative frames lost    |
+ *  +-------------------------------+
+ *  | highest sequence seen (smpl)  |
+ *  +-------------------------------+
+ *  |      interarrival jitter      |
+ *  +-------------------------------+
+ *  | cumulative frames played late |
+ *  +-------------------------------+
+ */
+struct transsip_report {
+	uint8_t fraction;
+	uint8_t res[3];
+	uint32_t lost;
+	uint32_t highest;
+	uint32_t jitter;
+	uint32_t late;
+} __attribute__((packed));
+
+/*
+ * Repair symbol, payload of TRANSSIP_PT_FEC, see fec.c. It protects
+ * ndata media frames from sequence base on, each taken as a 16 bit
+ * length and the frame, zero padded to the length of the symbol:
+ *
+ *  0       8      16      24      32
+ *  +-------------------------------+
+ *  |  sequence of first data frame |
+ *  +-------+-------+-------+-------+
+ *  | ndata |nparity| index |  res  |
+ *  +-------+-------+-------+-------+
+ *  |        repair symbol ...      |
+ */
+struct transsip_fec {
+	uint32_t base;
+	uint8_t ndata;
+	uint8_t nparity;
+	uint8_t index;
+	uint8_t res;
+} __attribute__((packed));
+
+/*
+ * A TRANSSIP_PT_RED payload is a length byte, a low rate copy of the
+ * frame before (seq - one frame) of that length and the frames
+ * themselves, after RFC 2198.
+ */
+
+/*
+ * Relay request, payload of TRANSSIP_PT_RELAY. Callers that dial
+ * through a relay wrap their probes in it to name the callee. The
+ * relay sends the probe on with the inner type and the rest of the
+ * payload, see transsip-relay.c. Family is 4 or 6, an IPv4 address
+ * takes the first four bytes:
+ *
+ *  0       8      16      24      32
+ *  +-------+-------+-------+-------+
+ *  |  fam  | type  |     port      |
+ *  +-------+-------+-------+-------+
+ *  |   callee's address, 16 bytes  |
+ *  +-------------------------------+
+ *  |        inner payload ...      |
+ */
+struct transsip_relay {
+	uint8_t family;
+	uint8_t type;
+	uint16_t port;
+	uint8_t addr[16];
+} __attribute__((packed));
+
+/* Header of transsip <= 0.5, GCC lays out est in the lowest bit. */
+struct transsip_hdr_legacy {
+	uint32_t seq;
+	uint8_t flags;
+} __attribute__((packed));
+
+/* Decoded packet in host byte order, payload points into the buffer. */
+struct transsip_pkt {
+	uint8_t version;
+	uint8_t flags;
+	uint8_t type;
+	uint32_t callid;
+	uint32_t seq;
+	uint32_t ts, echo, hold;
+	uint8_t frames, ptime;
+	const uint8_t *payload;
+	size_t len;
+};
+
+extern int transsip_decode(const uint8_t *buff, size_t len,
+			   struct transsip_pkt *pkt);
+extern size_t transsip_encode(uint8_t *buff, size_t len,
+			      const struct transsip_pkt *pkt);
+extern void transsip_dump(const uint8_t *buff, size_t len);
+extern void transsip_report_encode(uint8_t *buff,
+				   const struct transsip_report *rr);
+extern int transsip_report_decode(const struct transsip_pkt *pkt,
+				  struct transsip_report *rr);
+extern int transsip_relay_encode(uint8_t *buff, const struct sockaddr *addr,
+				 uint8_t type);
+extern int transsip_relay_decode(const struct transsip_pkt *pkt,
+				 struct sockaddr_storage *addr,
+				 socklen_t *addrlen, uint8_t *type);
+
+static inline size_t transsip_hdr_len(int version)
+{
+	return version == TRANSSIP_VERSION_LEGACY ?
+	       sizeof(struct transsip_hdr_legacy) :
+	       sizeof(struct transsip_hdr);
+}
+
+static inline int transsip_is_media(const struct transsip_pkt *pkt)
+{
+	return (pkt->type == TRANSSIP_PT_CELT ||
+		pkt->type == TRANSSIP_PT_RED) && pkt->len > 0;
+}
+
+static inline int transsip_is_probe(const struct transsip_pkt *pkt)
+{
+	return (pkt->flags & (TRANSSIP_EST | TRANSSIP_PSH)) == TRANSSIP_EST;
+}
+
+/* A fin is acked by echoing it with psh, which a fin never carries. */
+static inline int transsip_is_fin_ack(const struct transsip_pkt *pkt)
+{
+	return pkt->version == TRANSSIP_VERSION &&
+	       (pkt->flags & (TRANSSIP_FIN | TRANSSIP_PSH)) ==
+	       (TRANSSIP_FIN | TRANSSIP_PSH);
+}
+
+#endif /* PROTO_H */
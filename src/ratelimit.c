@@ -0,0 +1,67 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "built_in.h"
+#include "xutils.h"
+#include "ratelimit.h"
+
+void ratelimit_init(struct ratelimit *rl, unsigned int rate,
+		    unsigned int burst)
+{
+	memset(rl, 0, sizeof(*rl));
+
+	rl->interval = 1000000000ULL / rate;
+	rl->burst = rl->interval * burst;
+
+	urandom_bytes(rl->key, sizeof(rl->key));
+}
+
+int ratelimit_allow(struct ratelimit *rl, const struct sockaddr *addr,
+		    uint64_t now)
+{
+	int i, victim = 0;
+	uint64_t hash;
+	uint32_t tag;
+	const struct in6_addr *in6;
+	struct ratelimit_entry *set;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		hash = siphash24(rl->key,
+				 &((struct sockaddr_in *) addr)->sin_addr, 4);
+		break;
+	case AF_INET6:
+		in6 = &((struct sockaddr_in6 *) addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(in6))
+			hash = siphash24(rl->key, &in6->s6_addr[12], 4);
+		else
+			hash = siphash24(rl->key, in6, 8);
+		break;
+	default:
+		return 0;
+	}
+
+	set = rl->sets[hash & (RATELIMIT_SETS - 1)];
+	tag = (hash >> 32) | 1;
+
+	for (i = 0; i < RATELIMIT_WAYS; ++i) {
+		if (set[i].tag == tag)
+			return gcra_allow(&set[i].tat, now, rl->interval,
+					  rl->burst);
+		if (set[i].tat < set[victim].tat)
+			victim = i;
+	}
+
+	set[victim].tag = tag;
+	set[victim].tat = now;
+
+	return gcra_allow(&set[victim].tat, now, rl->interval, rl->burst);
+}
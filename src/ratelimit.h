@@ -0,0 +1,58 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "siphash.h"
+
+#define RATELIMIT_SETS	1024
+#define RATELIMIT_WAYS	4
+
+/*
+ * Token bucket in its GCRA form: a bucket is only the time at which it
+ * will be full again, interval is the cost of one token and burst the
+ * bucket size in nanoseconds.
+ */
+static inline int gcra_allow(uint64_t *tat, uint64_t now, uint64_t interval,
+			     uint64_t burst)
+{
+	uint64_t t = *tat > now ? *tat : now;
+
+	if (t + interval - now > burst)
+		return 0;
+
+	*tat = t + interval;
+	return 1;
+}
+
+struct ratelimit_entry {
+	uint32_t tag;
+	uint64_t tat;
+};
+
+/*
+ * Buckets per source address in a set associative table, 16 bytes a
+ * source. Sources are hashed with a random key, so nobody can aim at
+ * one set; a full set evicts its most idle bucket. IPv6 sources are
+ * limited per /64, v4-mapped ones per IPv4 address.
+ */
+struct ratelimit {
+	uint64_t interval, burst;
+	uint8_t key[SIPHASH_KEY_LEN];
+	struct ratelimit_entry sets[RATELIMIT_SETS][RATELIMIT_WAYS];
+};
+
+extern void ratelimit_init(struct ratelimit *rl, unsigned int rate,
+			   unsigned int burst);
+extern int ratelimit_allow(struct ratelimit *rl, const struct sockaddr *addr,
+			   uint64_t now);
+
+#endif /* RATELIMIT_H */
@@ -0,0 +1,212 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "reactor.h"
+
+static void reactor_wake_cb(struct reactor_fd *rf, uint32_t events)
+{
+	uint64_t val;
+	ssize_t ret;
+
+	ret = read(rf->fd, &val, sizeof(val));
+	if (ret != sizeof(val))
+		return;
+}
+
+void reactor_init(struct reactor *r)
+{
+	int fd, ret;
+
+	memset(r, 0, sizeof(*r));
+	r->wake.fd = -1;
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+		panic("Cannot create epoll instance: %s\n", strerror(errno));
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		panic("Cannot create wakeup event fd: %s\n", strerror(errno));
+
+	ret = reactor_add(r, &r->wake, fd, EPOLLIN, reactor_wake_cb, r);
+	if (ret < 0)
+		panic("Cannot register wakeup event fd!\n");
+}
+
+void reactor_destroy(struct reactor *r)
+{
+	int fd = r->wake.fd;
+
+	reactor_del(r, &r->wake);
+	close(fd);
+	close(r->epfd);
+}
+
+int reactor_add(struct reactor *r, struct reactor_fd *rf, int fd,
+		uint32_t events, reactor_cb_t cb, void *arg)
+{
+	int ret;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = rf;
+
+	ret = epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret < 0)
+		return -errno;
+
+	rf->fd = fd;
+	rf->events = events;
+	rf->cb = cb;
+	rf->arg = arg;
+
+	return 0;
+}
+
+int reactor_mod(struct reactor *r, struct reactor_fd *rf, uint32_t events)
+{
+	int ret;
+	struct epoll_event ev;
+
+	if (rf->events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = rf;
+
+	ret = epoll_ctl(r->epfd, EPOLL_CTL_MOD, rf->fd, &ev);
+	if (ret < 0)
+		return -errno;
+
+	rf->events = events;
+	return 0;
+}
+
+/* Events of the current batch that still refer to rf are skipped. */
+void reactor_del(struct reactor *r, struct reactor_fd *rf)
+{
+	if (!reactor_fd_active(rf))
+		return;
+
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, rf->fd, NULL);
+	rf->fd = -1;
+	rf->events = 0;
+}
+
+int reactor_run_once(struct reactor *r, int timeout)
+{
+	int i, n;
+	struct reactor_fd *rf;
+	struct epoll_event evs[REACTOR_MAX_EVENTS];
+
+	n = epoll_wait(r->epfd, evs, array_size(evs), timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	r->wakeups++;
+
+	for (i = 0; i < n; ++i) {
+		rf = evs[i].data.ptr;
+		if (unlikely(!reactor_fd_active(rf)))
+			continue;
+
+		rf->cb(rf, evs[i].events);
+		r->dispatched++;
+	}
+
+	return n;
+}
+
+/* Safe to call from any thread. */
+void reactor_wakeup(struct reactor *r)
+{
+	uint64_t val = 1;
+	ssize_t ret;
+
+	ret = write(r->wake.fd, &val, sizeof(val));
+	if (ret != sizeof(val))
+		return;
+}
+
+static void reactor_timer_cb(struct reactor_fd *rf, uint32_t events)
+{
+	uint64_t expired = 0;
+	ssize_t ret;
+	struct reactor_timer *t = rf->arg;
+
+	ret = read(rf->fd, &expired, sizeof(expired));
+	if (ret != sizeof(expired) || expired == 0)
+		return;
+
+	t->cb(t, expired);
+}
+
+void reactor_timer_init(struct reactor *r, struct reactor_timer *t,
+			void (*cb)(struct reactor_timer *t, uint64_t expired),
+			void *arg)
+{
+	int fd, ret;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		panic("Cannot create timer fd: %s\n", strerror(errno));
+
+	t->cb = cb;
+	t->arg = arg;
+
+	ret = reactor_add(r, &t->rf, fd, EPOLLIN, reactor_timer_cb, t);
+	if (ret < 0)
+		panic("Cannot register timer fd!\n");
+}
+
+void reactor_timer_destroy(struct reactor *r, struct reactor_timer *t)
+{
+	int fd = t->rf.fd;
+
+	if (!reactor_fd_active(&t->rf))
+		return;
+
+	reactor_del(r, &t->rf);
+	close(fd);
+}
+
+void reactor_timer_arm(struct reactor_timer *t, uint64_t nsec,
+		       uint64_t interval)
+{
+	struct itimerspec its;
+
+	its.it_value.tv_sec = nsec / 1000000000ULL;
+	its.it_value.tv_nsec = nsec % 1000000000ULL;
+	its.it_interval.tv_sec = interval / 1000000000ULL;
+	its.it_interval.tv_nsec = interval % 1000000000ULL;
+
+	/* A zero it_value disarms, make sure we fire at least once. */
+	if (nsec == 0)
+		its.it_value.tv_nsec = 1;
+
+	timerfd_settime(t->rf.fd, 0, &its, NULL);
+}
+
+void reactor_timer_disarm(struct reactor_timer *t)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(t->rf.fd, 0, &its, NULL);
+}
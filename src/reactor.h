@@ -0,0 +1,63 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS	64
+
+struct reactor;
+struct reactor_fd;
+
+typedef void (*reactor_cb_t)(struct reactor_fd *rf, uint32_t events);
+
+struct reactor_fd {
+	int fd;
+	uint32_t events;
+	reactor_cb_t cb;
+	void *arg;
+};
+
+struct reactor_timer {
+	struct reactor_fd rf;
+	void (*cb)(struct reactor_timer *t, uint64_t expired);
+	void *arg;
+};
+
+struct reactor {
+	int epfd;
+	struct reactor_fd wake;
+	uint64_t wakeups, dispatched;
+};
+
+extern void reactor_init(struct reactor *r);
+extern void reactor_destroy(struct reactor *r);
+extern int reactor_add(struct reactor *r, struct reactor_fd *rf, int fd,
+		       uint32_t events, reactor_cb_t cb, void *arg);
+extern int reactor_mod(struct reactor *r, struct reactor_fd *rf,
+		       uint32_t events);
+extern void reactor_del(struct reactor *r, struct reactor_fd *rf);
+extern int reactor_run_once(struct reactor *r, int timeout);
+extern void reactor_wakeup(struct reactor *r);
+
+extern void reactor_timer_init(struct reactor *r, struct reactor_timer *t,
+			       void (*cb)(struct reactor_timer *t,
+					  uint64_t expired), void *arg);
+extern void reactor_timer_destroy(struct reactor *r, struct reactor_timer *t);
+extern void reactor_timer_arm(struct reactor_timer *t, uint64_t nsec,
+			      uint64_t interval);
+extern void reactor_timer_disarm(struct reactor_timer *t);
+
+static inline int reactor_fd_active(struct reactor_fd *rf)
+{
+	return rf->fd >= 0;
+}
+
+#endif /* REACTOR_H */
@@ -0,0 +1,262 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "xmalloc.h"
+#include "resolv.h"
+
+static inline uint64_t resolv_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void resolv_do(struct resolv_req *req)
+{
+	uint64_t start = resolv_now();
+	struct addrinfo hints, *ahead, *ai;
+	struct resolv_result *res = &req->res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	res->naddrs = 0;
+	res->err = getaddrinfo(req->host, req->port, &hints, &ahead);
+	if (res->err == 0) {
+		for (ai = ahead; ai && res->naddrs < RESOLV_MAX_ADDRS;
+		     ai = ai->ai_next) {
+			if (ai->ai_addrlen > sizeof(res->addrs[0]))
+				continue;
+
+			memcpy(&res->addrs[res->naddrs], ai->ai_addr,
+			       ai->ai_addrlen);
+			res->addrlens[res->naddrs++] = ai->ai_addrlen;
+		}
+
+		freeaddrinfo(ahead);
+	}
+
+	res->took = resolv_now() - start;
+}
+
+static void *resolv_thread(void *arg)
+{
+	uint64_t one = 1;
+	struct resolv *r = arg;
+	struct resolv_req *req;
+
+	mutexlock_lock(&r->lock);
+	while (!r->stop) {
+		req = r->pending;
+		if (!req) {
+			pthread_cond_wait(&r->cond, &r->lock.lock);
+			continue;
+		}
+
+		r->pending = req->next;
+		mutexlock_unlock(&r->lock);
+
+		resolv_do(req);
+
+		mutexlock_lock(&r->lock);
+		req->next = r->done;
+		r->done = req;
+
+		if (write(r->efd, &one, sizeof(one)) != sizeof(one))
+			whine("Cannot signal resolver answer!\n");
+	}
+	mutexlock_unlock(&r->lock);
+
+	return NULL;
+}
+
+void resolv_init(struct resolv *r)
+{
+	int ret;
+	sigset_t mask, old;
+
+	memset(r, 0, sizeof(*r));
+
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->efd < 0)
+		panic("Cannot create resolver eventfd!\n");
+
+	mutexlock_init(&r->lock);
+	pthread_cond_init(&r->cond, NULL);
+
+	/* Signals are for the cli, not for the resolver. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	ret = pthread_create(&r->thread, NULL, resolv_thread, r);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		panic("Cannot create resolver thread!\n");
+}
+
+static void resolv_free_list(struct resolv_req *req)
+{
+	struct resolv_req *next;
+
+	for (; req; req = next) {
+		next = req->next;
+		xfree(req);
+	}
+}
+
+/* A lookup stuck in getaddrinfo(3) delays shutdown until it returns. */
+void resolv_destroy(struct resolv *r)
+{
+	mutexlock_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->cond);
+	mutexlock_unlock(&r->lock);
+
+	pthread_join(r->thread, NULL);
+
+	resolv_free_list(r->pending);
+	resolv_free_list(r->done);
+
+	pthread_cond_destroy(&r->cond);
+	mutexlock_destroy(&r->lock);
+	close(r->efd);
+}
+
+static struct resolv_entry *resolv_cache_find(struct resolv *r,
+					      const char *host,
+					      const char *port)
+{
+	int i;
+
+	for (i = 0; i < RESOLV_CACHE; ++i) {
+		if (r->cache[i].expires &&
+		    !strcmp(r->cache[i].host, host) &&
+		    !strcmp(r->cache[i].port, port))
+			return &r->cache[i];
+	}
+
+	return NULL;
+}
+
+static void resolv_cache_put(struct resolv *r, const struct resolv_req *req,
+			     uint64_t now)
+{
+	int i;
+	struct resolv_entry *ent;
+
+	ent = resolv_cache_find(r, req->host, req->port);
+	if (!ent) {
+		/* Free or expired slots first, else the oldest one goes. */
+		ent = &r->cache[0];
+		for (i = 1; i < RESOLV_CACHE && ent->expires > now; ++i) {
+			if (r->cache[i].expires < ent->expires)
+				ent = &r->cache[i];
+		}
+	}
+
+	strlcpy(ent->host, req->host, sizeof(ent->host));
+	strlcpy(ent->port, req->port, sizeof(ent->port));
+	ent->res = req->res;
+	ent->expires = now + (req->res.err || req->res.naddrs == 0 ?
+			      RESOLV_TTL_NEG : RESOLV_TTL_POS);
+}
+
+/*
+ * Returns the cached answer, which is only good until the next call
+ * into the resolver, or NULL when the lookup was queued; its answer
+ * is then handed to the callback of resolv_reap() together with arg.
+ */
+const struct resolv_result *resolv_lookup(struct resolv *r, const char *host,
+					  const char *port, void *arg)
+{
+	uint64_t now = resolv_now();
+	struct resolv_entry *ent;
+	struct resolv_req *req, **pp;
+
+	ent = resolv_cache_find(r, host, port);
+	if (ent && ent->expires > now) {
+		if (ent->res.err || ent->res.naddrs == 0)
+			r->stats.neg_hits++;
+		else
+			r->stats.hits++;
+		r->stats.saved_ns += ent->res.took;
+
+		return &ent->res;
+	}
+
+	r->stats.misses++;
+
+	req = xzmalloc(sizeof(*req));
+	strlcpy(req->host, host, sizeof(req->host));
+	strlcpy(req->port, port, sizeof(req->port));
+	req->arg = arg;
+
+	mutexlock_lock(&r->lock);
+	for (pp = &r->pending; *pp; pp = &(*pp)->next)
+		;
+	*pp = req;
+	pthread_cond_signal(&r->cond);
+	mutexlock_unlock(&r->lock);
+
+	return NULL;
+}
+
+void resolv_reap(struct resolv *r, resolv_cb_t cb)
+{
+	uint64_t val, now = resolv_now();
+	struct resolv_req *req, *next;
+
+	if (read(r->efd, &val, sizeof(val)) != sizeof(val))
+		return;
+
+	mutexlock_lock(&r->lock);
+	req = r->done;
+	r->done = NULL;
+	mutexlock_unlock(&r->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+
+		r->stats.resolve_ns += req->res.took;
+		resolv_cache_put(r, req, now);
+		cb(req->arg, &req->res);
+
+		xfree(req);
+	}
+}
+
+void resolv_dump_stats(const char *name, struct resolv *r)
+{
+	uint64_t lookups = r->stats.hits + r->stats.neg_hits +
+			   r->stats.misses;
+
+	printf("%s: %llu lookups, %llu hits, %llu negative hits "
+	       "(%.1f%% hit rate), %.2fms avg miss\n", name,
+	       (unsigned long long) lookups,
+	       (unsigned long long) r->stats.hits,
+	       (unsigned long long) r->stats.neg_hits, lookups ?
+	       100.0 * (r->stats.hits + r->stats.neg_hits) / lookups : 0.0,
+	       r->stats.misses ? r->stats.resolve_ns / 1e6 /
+	       r->stats.misses : 0.0);
+	printf("%s: %.2fms of call setup saved by the cache\n", name,
+	       r->stats.saved_ns / 1e6);
+}
@@ -0,0 +1,78 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef RESOLV_H
+#define RESOLV_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "xutils.h"
+#include "locking.h"
+
+#define RESOLV_CACHE		32
+#define RESOLV_MAX_ADDRS	8
+#define RESOLV_TTL_POS		(300 * 1000000000ULL)
+#define RESOLV_TTL_NEG		(10 * 1000000000ULL)
+
+struct resolv_result {
+	int err;
+	unsigned int naddrs;
+	struct sockaddr_storage addrs[RESOLV_MAX_ADDRS];
+	socklen_t addrlens[RESOLV_MAX_ADDRS];
+	uint64_t took;
+};
+
+struct resolv_req {
+	char host[ADDRSIZ];
+	char port[PORTSIZ];
+	void *arg;
+	struct resolv_result res;
+	struct resolv_req *next;
+};
+
+struct resolv_entry {
+	char host[ADDRSIZ];
+	char port[PORTSIZ];
+	uint64_t expires;
+	struct resolv_result res;
+};
+
+struct resolv_stats {
+	uint64_t hits, neg_hits, misses;
+	uint64_t resolve_ns, saved_ns;
+};
+
+/*
+ * getaddrinfo(3) may block for seconds, so it runs on a helper thread.
+ * Requests go in under the lock, answers come back through an eventfd
+ * the engine polls. The cache is only touched by the engine thread.
+ * getaddrinfo(3) tells us no TTLs, we keep answers for a fixed time
+ * and failures for a shorter one.
+ */
+struct resolv {
+	pthread_t thread;
+	int efd, stop;
+	struct mutexlock lock;
+	pthread_cond_t cond;
+	struct resolv_req *pending, *done;
+	struct resolv_entry cache[RESOLV_CACHE];
+	struct resolv_stats stats;
+};
+
+typedef void (*resolv_cb_t)(void *arg, const struct resolv_result *res);
+
+extern void resolv_init(struct resolv *r);
+extern void resolv_destroy(struct resolv *r);
+extern const struct resolv_result *resolv_lookup(struct resolv *r,
+						 const char *host,
+						 const char *port, void *arg);
+extern void resolv_reap(struct resolv *r, resolv_cb_t cb);
+extern void resolv_dump_stats(const char *name, struct resolv *r);
+
+#endif /* RESOLV_H */
@@ -0,0 +1,222 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "built_in.h"
+#include "session.h"
+#include "sock.h"
+
+static uint32_t session_hash_bytes(uint32_t hash, const void *buff, size_t len)
+{
+	const uint8_t *p = buff;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Only family, address and port identify a peer, the rest of the
+ * sockaddr (v6 flowinfo, padding) is not stable across packets. */
+static uint32_t session_addr_hash(const struct sockaddr *addr)
+{
+	uint32_t hash = 2166136261U;
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *in = (const void *) addr;
+		hash = session_hash_bytes(hash, &in->sin_addr,
+					  sizeof(in->sin_addr));
+		hash = session_hash_bytes(hash, &in->sin_port,
+					  sizeof(in->sin_port));
+		break; }
+	case AF_INET6: {
+		const struct sockaddr_in6 *in6 = (const void *) addr;
+		hash = session_hash_bytes(hash, &in6->sin6_addr,
+					  sizeof(in6->sin6_addr));
+		hash = session_hash_bytes(hash, &in6->sin6_port,
+					  sizeof(in6->sin6_port));
+		break; }
+	default:
+		break;
+	}
+
+	return hash & (SESSION_HASH_SIZE - 1);
+}
+
+/* Call ids are random, a multiplicative hash spreads them well enough. */
+static inline uint32_t session_id_hash(uint32_t callid)
+{
+	return (callid * 2654435761U) >> (32 - SESSION_HASH_BITS);
+}
+
+void session_table_init(struct session_table *t)
+{
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < MAX_SESSIONS; ++i)
+		t->slots[i].id = i + 1;
+}
+
+struct session *session_alloc(struct session_table *t,
+			      const struct sockaddr *addr, socklen_t addrlen)
+{
+	int i, id;
+	uint32_t hash;
+	struct session *s = NULL;
+
+	if (addrlen > sizeof(s->addr))
+		return NULL;
+
+	for (i = 0; i < MAX_SESSIONS; ++i) {
+		if (!t->slots[i].used) {
+			s = &t->slots[i];
+			break;
+		}
+	}
+	if (!s)
+		return NULL;
+
+	id = s->id;
+	memset(s, 0, sizeof(*s));
+	s->id = id;
+	s->used = 1;
+	s->sock = -1;
+	s->rf.fd = -1;
+	s->timer.rf.fd = -1;
+	s->rtx_timer.rf.fd = -1;
+
+	memcpy(&s->addr, addr, addrlen);
+	s->addrlen = addrlen;
+
+	hash = session_addr_hash(addr);
+	s->next_addr = t->addr_hash[hash];
+	t->addr_hash[hash] = s;
+
+	t->count++;
+	return s;
+}
+
+static void session_unhash_addr(struct session_table *t, struct session *s)
+{
+	struct session **pp;
+
+	pp = &t->addr_hash[session_addr_hash((struct sockaddr *) &s->addr)];
+	while (*pp) {
+		if (*pp == s) {
+			*pp = s->next_addr;
+			break;
+		}
+		pp = &(*pp)->next_addr;
+	}
+
+	s->next_addr = NULL;
+}
+
+void session_free(struct session_table *t, struct session *s)
+{
+	if (!s->used)
+		return;
+
+	session_unhash_addr(t, s);
+
+	if (s->callid)
+		session_set_callid(t, s, 0);
+
+	s->used = 0;
+	t->count--;
+}
+
+/* Call-out picks its peer address only once a candidate answered. */
+void session_set_addr(struct session_table *t, struct session *s,
+		      const struct sockaddr *addr, socklen_t addrlen)
+{
+	uint32_t hash;
+
+	if (addrlen > sizeof(s->addr))
+		return;
+
+	session_unhash_addr(t, s);
+
+	memcpy(&s->addr, addr, addrlen);
+	s->addrlen = addrlen;
+
+	hash = session_addr_hash(addr);
+	s->next_addr = t->addr_hash[hash];
+	t->addr_hash[hash] = s;
+}
+
+struct session *session_lookup_addr(struct session_table *t,
+				    const struct sockaddr *addr,
+				    socklen_t addrlen)
+{
+	struct session *s;
+
+	s = t->addr_hash[session_addr_hash(addr)];
+	for (; s; s = s->next_addr) {
+		if (likely(sock_addr_equal((struct sockaddr *) &s->addr,
+					      addr)))
+			return s;
+	}
+
+	return NULL;
+}
+
+struct session *session_lookup_id(struct session_table *t, int id)
+{
+	if (id <= 0 || id > MAX_SESSIONS)
+		return NULL;
+	if (!t->slots[id - 1].used)
+		return NULL;
+
+	return &t->slots[id - 1];
+}
+
+/* A call id of 0 means none, legacy peers are found by address only. */
+void session_set_callid(struct session_table *t, struct session *s,
+			uint32_t callid)
+{
+	struct session **pp;
+
+	if (s->callid) {
+		pp = &t->id_hash[session_id_hash(s->callid)];
+		while (*pp) {
+			if (*pp == s) {
+				*pp = s->next_id;
+				break;
+			}
+			pp = &(*pp)->next_id;
+		}
+	}
+
+	s->callid = callid;
+	s->next_id = NULL;
+
+	if (callid) {
+		pp = &t->id_hash[session_id_hash(callid)];
+		s->next_id = *pp;
+		*pp = s;
+	}
+}
+
+struct session *session_lookup_callid(struct session_table *t,
+				      uint32_t callid)
+{
+	struct session *s;
+
+	for (s = t->id_hash[session_id_hash(callid)]; s; s = s->next_id) {
+		if (s->callid == callid)
+			return s;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,182 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <celt/celt.h>
+#include <speex/speex_jitter.h>
+
+#include "reactor.h"
+#include "fec.h"
+
+#define MAX_SESSIONS		64
+#define SESSION_HASH_BITS	7
+#define SESSION_HASH_SIZE	(1 << SESSION_HASH_BITS)
+
+#define SESSION_FEC_SYM		256
+#define SESSION_FEC_RING	(2 * FEC_MAX_DATA)
+
+#define SESSION_RED_RING	8
+#define SESSION_RED_MAX		32
+
+#define SESSION_FRAME_MAX	86
+#define SESSION_PTIME_MAX	8
+
+#define SESSION_HOLD_RING	128
+#define SESSION_HOLD_LAG	8
+#define SESSION_HOLD_RESYNC	20
+
+struct session_stats {
+	uint64_t frames_tx;
+	uint64_t frames_rx;
+	uint64_t frames_plc;
+	uint64_t frames_red;
+};
+
+/* Low rate copy of a frame, played if the frame itself does not come. */
+struct session_red {
+	uint32_t seq;
+	uint8_t len;
+	uint8_t data[SESSION_RED_MAX];
+};
+
+/*
+ * A frame lent to the jitter buffer, which only keeps the pointer. The
+ * reference lives here until the frame is played or falls behind.
+ */
+struct session_hold {
+	struct pktbuf *buf;
+	uint32_t seq;
+};
+
+/* What we tell the peer about its media, see struct transsip_report. */
+struct session_rr {
+	uint32_t base, highest;
+	uint32_t received, late;
+	uint32_t expected_prior, received_prior;
+	uint32_t jitter, transit;
+	uint64_t sent_at;
+};
+
+/*
+ * Only calls with FEC get one. Sent frames are kept until their group
+ * is full, received ones in a ring until a group's repair symbols come
+ * in, see engine_on_fec().
+ */
+struct session_fec {
+	unsigned int ndata, nparity, count;
+	uint32_t base;
+	size_t len;
+	uint8_t data[FEC_MAX_DATA][SESSION_FEC_SYM];
+
+	int rvalid, rdone;
+	unsigned int rndata, rnparity;
+	uint32_t rbase;
+	size_t rlen;
+	int phave[FEC_MAX_PARITY];
+	uint8_t parity[FEC_MAX_PARITY][SESSION_FEC_SYM];
+	uint8_t state[SESSION_FEC_RING];
+	uint32_t seq[SESSION_FEC_RING];
+	uint8_t ring[SESSION_FEC_RING][SESSION_FEC_SYM];
+};
+
+/* What the peer tells us, it steers our frame size. */
+struct session_rate {
+	int size;
+	uint8_t fraction;
+	uint32_t jitter;
+	uint32_t late_prior, highest_prior;
+	uint64_t report_at;
+};
+
+struct session {
+	int id;
+	int used;
+	int state;
+	int sock;
+	int version;
+	int filter;
+	uint32_t drops;
+	uint32_t callid;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	CELTEncoder *encoder;
+	CELTDecoder *decoder;
+	JitterBuffer *jitter;
+	uint32_t send_seq;
+	int recv_started;
+	size_t tone_pos;
+	struct session_stats stats;
+	uint8_t rtx_flags;
+	unsigned int rtx_count;
+	uint64_t rtx_sent, rto, setup_start;
+	uint64_t answer_at;
+	uint64_t pace_base;
+	uint64_t tick_at;
+	uint32_t ts_recent;
+	uint64_t ts_recent_at;
+	uint64_t srtt, rttvar;
+	int margin;
+	uint32_t played;
+	unsigned int synced;
+	struct session_rr rr;
+	struct session_rate rc;
+	struct session_fec *fec;
+	CELTEncoder *red_encoder;
+	uint8_t red_len;
+	uint8_t red_prev[SESSION_RED_MAX];
+	struct session_red red[SESSION_RED_RING];
+	struct session_hold held[SESSION_HOLD_RING];
+	unsigned int peer_ptime;
+	unsigned int bundled;
+	int bundle_size;
+	uint8_t bundle[SESSION_PTIME_MAX * SESSION_FRAME_MAX];
+	struct shm_chan *shm;
+	int shm_tx;
+	struct reactor_fd shm_rf;
+	int txtime;
+	uint64_t cookie;
+	struct sockaddr_storage relay_to;
+	socklen_t relay_tolen;
+	struct reactor_fd rf;
+	struct reactor_timer timer, rtx_timer;
+	struct session *next_addr;
+	struct session *next_id;
+};
+
+struct session_table {
+	struct session slots[MAX_SESSIONS];
+	struct session *addr_hash[SESSION_HASH_SIZE];
+	struct session *id_hash[SESSION_HASH_SIZE];
+	unsigned int count;
+};
+
+#define for_each_session(t, s)					\
+	for ((s) = &(t)->slots[0];				\
+	     (s) < &(t)->slots[MAX_SESSIONS]; (s)++)		\
+		if (!(s)->used) {} else
+
+extern void session_table_init(struct session_table *t);
+extern struct session *session_alloc(struct session_table *t,
+				      const struct sockaddr *addr,
+				      socklen_t addrlen);
+extern void session_free(struct session_table *t, struct session *s);
+extern struct session *session_lookup_addr(struct session_table *t,
+					   const struct sockaddr *addr,
+					   socklen_t addrlen);
+extern struct session *session_lookup_id(struct session_table *t, int id);
+extern struct session *session_lookup_callid(struct session_table *t,
+					     uint32_t callid);
+extern void session_set_callid(struct session_table *t, struct session *s,
+			       uint32_t callid);
+extern void session_set_addr(struct session_table *t, struct session *s,
+			     const struct sockaddr *addr, socklen_t addrlen);
+
+#endif /* SESSION_H */
@@ -0,0 +1,353 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "built_in.h"
+#include "shm.h"
+
+#define SHM_NFDS	3
+
+static void shm_chan_setup(struct shm_chan *c, int side)
+{
+	c->tx = &c->seg->ring[side];
+	c->rx = &c->seg->ring[!side];
+	c->tx_efd = c->efd[side];
+	c->rx_efd = c->efd[!side];
+}
+
+int shm_chan_create(struct shm_chan *c)
+{
+	int ret;
+	void *seg;
+
+	memset(c, 0, sizeof(*c));
+	c->efd[0] = c->efd[1] = -1;
+
+	c->memfd = memfd_create("transsip", MFD_CLOEXEC);
+	if (c->memfd < 0)
+		return -errno;
+	if (ftruncate(c->memfd, sizeof(*c->seg)) < 0)
+		goto err;
+
+	seg = mmap(NULL, sizeof(*c->seg), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, c->memfd, 0);
+	if (seg == MAP_FAILED)
+		goto err;
+	c->seg = seg;
+
+	c->efd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->efd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->efd[0] < 0 || c->efd[1] < 0)
+		goto err;
+
+	/* Nobody drains yet, the first datagram rings either way. */
+	c->seg->magic = SHM_MAGIC;
+	c->seg->ring[0].wait = 1;
+	c->seg->ring[1].wait = 1;
+
+	shm_chan_setup(c, 0);
+	return 0;
+err:
+	ret = -errno;
+	shm_chan_destroy(c);
+	return ret;
+}
+
+void shm_chan_destroy(struct shm_chan *c)
+{
+	if (c->seg)
+		munmap(c->seg, sizeof(*c->seg));
+	if (c->memfd >= 0)
+		close(c->memfd);
+	if (c->efd[0] >= 0)
+		close(c->efd[0]);
+	if (c->efd[1] >= 0)
+		close(c->efd[1]);
+
+	memset(c, 0, sizeof(*c));
+	c->memfd = c->efd[0] = c->efd[1] = -1;
+}
+
+/*
+ * Publishes the slot from shm_tx_slot(). The fence orders the store of
+ * head before the load of wait, as the consumer's in shm_rx_sleep()
+ * does the other way round, so one of us sees the other.
+ */
+int shm_tx_commit(struct shm_chan *c, size_t len)
+{
+	uint64_t one = 1;
+	struct shm_ring *r = c->tx;
+
+	r->slots[r->head % SHM_SLOTS].len = len;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&r->wait, __ATOMIC_RELAXED) ||
+	    !__atomic_exchange_n(&r->wait, 0, __ATOMIC_ACQ_REL))
+		return 0;
+
+	if (write(c->tx_efd, &one, sizeof(one)) != sizeof(one))
+		return -errno;
+
+	return 1;
+}
+
+/*
+ * Called once the rx ring ran empty, before going back to epoll.
+ * Returns 1 if a datagram slipped in meanwhile, the caller drains
+ * again then instead of waiting for a doorbell that may not come.
+ */
+int shm_rx_sleep(struct shm_chan *c)
+{
+	uint64_t val;
+	struct shm_ring *r = c->rx;
+
+	while (read(c->rx_efd, &val, sizeof(val)) == sizeof(val))
+		;
+
+	__atomic_store_n(&r->wait, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Sockets live in a directory only our user can enter, so nobody else
+ * can bind a worker's name before it does and catch our offers. One
+ * that exists but is not ours alone is refused, by both ends.
+ */
+static int shm_dir(char *dir, size_t size, int create)
+{
+	int len;
+	const char *base;
+	struct stat st;
+
+	base = secure_getenv("XDG_RUNTIME_DIR");
+	if (!base || base[0] != '/')
+		base = "/tmp";
+
+	len = snprintf(dir, size, "%s/transsip-%u", base,
+		       (unsigned int) geteuid());
+	if (len < 0 || (size_t) len >= size)
+		return -ENAMETOOLONG;
+
+	if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -errno;
+	if (lstat(dir, &st) < 0)
+		return -errno;
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & 077))
+		return -EPERM;
+
+	return 0;
+}
+
+static int shm_addr(struct sockaddr_un *sun, socklen_t *len,
+		    uint16_t port, unsigned int id, int create)
+{
+	int ret;
+	char dir[sizeof(sun->sun_path)];
+
+	ret = shm_dir(dir, sizeof(dir), create);
+	if (ret < 0)
+		return ret;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	ret = snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/%u.%u",
+		       dir, port, id);
+	if (ret < 0 || (size_t) ret >= sizeof(sun->sun_path))
+		return -ENAMETOOLONG;
+
+	*len = offsetof(struct sockaddr_un, sun_path) + ret + 1;
+	return 0;
+}
+
+/* One per worker, offers come in as datagrams with our peer's creds. */
+int shm_listen(uint16_t port, unsigned int id)
+{
+	int sock, ret, one = 1;
+	socklen_t len;
+	struct sockaddr_un sun;
+
+	ret = shm_addr(&sun, &len, port, id, 1);
+	if (ret < 0)
+		return ret;
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	/* Left behind by a worker that did not exit cleanly. */
+	unlink(sun.sun_path);
+
+	if (bind(sock, (struct sockaddr *) &sun, len) < 0 ||
+	    setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &one,
+		       sizeof(one)) < 0) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+
+	return sock;
+}
+
+void shm_unlisten(int sock)
+{
+	struct sockaddr_un sun;
+	socklen_t len = sizeof(sun);
+
+	if (getsockname(sock, (struct sockaddr *) &sun, &len) == 0 &&
+	    len > offsetof(struct sockaddr_un, sun_path) &&
+	    sun.sun_path[0] == '/')
+		unlink(sun.sun_path);
+
+	close(sock);
+}
+
+/* Returns -ENOENT if the peer has no worker id, or is not our user. */
+int shm_offer(uint16_t port, unsigned int id, const struct shm_offer *o,
+	      const struct shm_chan *c)
+{
+	int sock, ret, fds[SHM_NFDS];
+	char ctrl[CMSG_SPACE(sizeof(fds))];
+	socklen_t len;
+	struct sockaddr_un sun;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	ret = shm_addr(&sun, &len, port, id, 0);
+	if (ret < 0)
+		return ret;
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	fds[0] = c->memfd;
+	fds[1] = c->efd[0];
+	fds[2] = c->efd[1];
+
+	iov.iov_base = (void *) o;
+	iov.iov_len = sizeof(*o);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sun;
+	msg.msg_namelen = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, MSG_DONTWAIT) < 0)
+		ret = -errno;
+
+	close(sock);
+	return ret;
+}
+
+static void shm_close_fds(int *fds, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; ++i)
+		close(fds[i]);
+}
+
+/*
+ * Takes the next offer off the socket, maps its ring and fills c as
+ * the answering end. Returns 1 on success, 0 if there is none left and
+ * -EPERM for offers that are not from our user or malformed.
+ */
+int shm_accept(int sock, struct shm_offer *o, struct shm_chan *c)
+{
+	int fds[SHM_NFDS];
+	unsigned int nfds = 0;
+	void *seg;
+	ssize_t ret;
+	char ctrl[CMSG_SPACE(sizeof(fds)) +
+		  CMSG_SPACE(sizeof(struct ucred))];
+	struct ucred cred;
+	struct stat st;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	iov.iov_base = o;
+	iov.iov_len = sizeof(*o);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return 0;
+
+	cred.uid = (uid_t) -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type == SCM_CREDENTIALS)
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+		if (cmsg->cmsg_type == SCM_RIGHTS && nfds == 0) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			nfds = min(nfds, (unsigned int) SHM_NFDS);
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+
+	if (ret != sizeof(*o) || o->magic != SHM_MAGIC ||
+	    nfds != SHM_NFDS || cred.uid != geteuid() ||
+	    (msg.msg_flags & MSG_CTRUNC))
+		goto err;
+
+	/* A short segment would fault on first touch. */
+	if (fstat(fds[0], &st) < 0 || st.st_size < (off_t) sizeof(*c->seg))
+		goto err;
+
+	seg = mmap(NULL, sizeof(*c->seg), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fds[0], 0);
+	if (seg == MAP_FAILED)
+		goto err;
+
+	c->seg = seg;
+	c->memfd = fds[0];
+	c->efd[0] = fds[1];
+	c->efd[1] = fds[2];
+	if (c->seg->magic != SHM_MAGIC) {
+		shm_chan_destroy(c);
+		return -EPERM;
+	}
+
+	shm_chan_setup(c, 1);
+	return 1;
+err:
+	shm_close_fds(fds, nfds);
+	return -EPERM;
+}
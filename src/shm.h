@@ -0,0 +1,99 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "built_in.h"
+
+#define SHM_SLOTS	64
+#define SHM_SLOT_SIZE	1024
+#define SHM_MAGIC	0x7453686dU
+
+struct shm_slot {
+	uint32_t len;
+	char data[SHM_SLOT_SIZE];
+};
+
+/*
+ * Single producer, single consumer, head is only written by the one,
+ * tail by the other, each on a cache line of its own. A consumer that
+ * is about to sleep sets wait, a producer that finds it set rings the
+ * doorbell, an eventfd. Busy rings thus cost no syscalls at all.
+ */
+struct shm_ring {
+	uint32_t head __cacheline_aligned;
+	uint32_t wait __cacheline_aligned;
+	uint32_t tail __cacheline_aligned;
+	struct shm_slot slots[SHM_SLOTS];
+};
+
+/* A memfd shared by both ends, ring 0 goes from the offering end. */
+struct shm_seg {
+	uint32_t magic;
+	struct shm_ring ring[2];
+};
+
+struct shm_chan {
+	struct shm_seg *seg;
+	struct shm_ring *tx, *rx;
+	int memfd, efd[2];
+	int tx_efd, rx_efd;
+};
+
+/* Sent along with the memfd and both doorbells. */
+struct shm_offer {
+	uint32_t magic;
+	uint32_t callid;
+	uint64_t token;
+};
+
+extern int shm_chan_create(struct shm_chan *c);
+extern void shm_chan_destroy(struct shm_chan *c);
+extern int shm_tx_commit(struct shm_chan *c, size_t len);
+extern int shm_rx_sleep(struct shm_chan *c);
+extern int shm_listen(uint16_t port, unsigned int id);
+extern void shm_unlisten(int sock);
+extern int shm_offer(uint16_t port, unsigned int id,
+		     const struct shm_offer *o, const struct shm_chan *c);
+extern int shm_accept(int sock, struct shm_offer *o, struct shm_chan *c);
+
+/* Next free tx slot or NULL if the peer lags behind, see mmsg_tx_slot(). */
+static inline char *shm_tx_slot(struct shm_chan *c)
+{
+	struct shm_ring *r = c->tx;
+
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= SHM_SLOTS)
+		return NULL;
+
+	return r->slots[r->head % SHM_SLOTS].data;
+}
+
+/* Oldest datagram, read in place until shm_rx_consume() frees it. */
+static inline char *shm_rx_data(struct shm_chan *c, size_t *len)
+{
+	struct shm_ring *r = c->rx;
+	struct shm_slot *slot;
+
+	if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	slot = &r->slots[r->tail % SHM_SLOTS];
+	*len = min(slot->len, (uint32_t) SHM_SLOT_SIZE);
+
+	return slot->data;
+}
+
+static inline void shm_rx_consume(struct shm_chan *c)
+{
+	__atomic_store_n(&c->rx->tail, c->rx->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SHM_H */
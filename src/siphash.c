@@ -0,0 +1,76 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * SipHash-2-4 by Jean-Philippe Aumasson and Daniel J. Bernstein, a
+ * keyed hash that is cheap on short inputs and safe to use on data an
+ * attacker controls, e.g. for cookies and hash table seeds.
+ */
+
+#include <string.h>
+
+#include "siphash.h"
+
+#define ROTL(x, b)	(uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND					\
+	do {						\
+		v0 += v1; v1 = ROTL(v1, 13);		\
+		v1 ^= v0; v0 = ROTL(v0, 32);		\
+		v2 += v3; v3 = ROTL(v3, 16);		\
+		v3 ^= v2;				\
+		v0 += v3; v3 = ROTL(v3, 21);		\
+		v3 ^= v0;				\
+		v2 += v1; v1 = ROTL(v1, 17);		\
+		v1 ^= v2; v2 = ROTL(v2, 32);		\
+	} while (0)
+
+static inline uint64_t load_le64(const uint8_t *p)
+{
+	return (uint64_t) p[0]       | (uint64_t) p[1] << 8  |
+	       (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+	       (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+	       (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LEN], const void *data,
+		   size_t len)
+{
+	const uint8_t *in = data, *end = in + (len & ~7UL);
+	uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t m, b = (uint64_t) len << 56;
+	uint8_t tail[8];
+
+	for (; in != end; in += 8) {
+		m = load_le64(in);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, in, len & 7);
+	b |= load_le64(tail);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,19 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIPHASH_KEY_LEN	16
+
+extern uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LEN],
+			  const void *data, size_t len);
+
+#endif /* SIPHASH_H */
@@ -0,0 +1,501 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <linux/net_tstamp.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "proto.h"
+#include "sock.h"
+
+#ifndef SO_REUSEPORT
+# define SO_REUSEPORT			15
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+# define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+#ifndef UDP_SEGMENT
+# define UDP_SEGMENT			103
+#endif
+
+#ifndef SO_MEMINFO
+# define SO_MEMINFO			55
+#endif
+
+#ifndef SO_TXTIME
+# define SO_TXTIME			61
+#endif
+
+#ifndef SO_BUSY_POLL
+# define SO_BUSY_POLL			46
+#endif
+
+/* Expedited forwarding, RFC 3246, and TC_PRIO_INTERACTIVE. */
+#define LOWLAT_TOS			0xb8
+#define LOWLAT_PRIO			6
+#define LOWLAT_BUSY_POLL		50
+
+/* Socket filters see the UDP header first. */
+#define HDR_OFF(f)	(sizeof(struct udphdr) + \
+			 offsetof(struct transsip_hdr, f))
+#define LEGACY_OFF(f)	(sizeof(struct udphdr) + \
+			 offsetof(struct transsip_hdr_legacy, f))
+#define LEGACY_MAX	(sizeof(struct udphdr) + \
+			 sizeof(struct transsip_hdr_legacy) + 128)
+
+/* Jump targets, resolved once the program is complete. */
+#define JMP_ACCEPT	0xff
+#define JMP_DROP	0xfe
+#define JMP_CHECK	0xfd
+
+/* Only family, address and port count, like a kernel socket lookup. */
+int sock_addr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+
+	switch (a->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *ia = (const void *) a;
+		const struct sockaddr_in *ib = (const void *) b;
+		return ia->sin_port == ib->sin_port &&
+		       ia->sin_addr.s_addr == ib->sin_addr.s_addr;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 *ia = (const void *) a;
+		const struct sockaddr_in6 *ib = (const void *) b;
+		return ia->sin6_port == ib->sin6_port &&
+		       !memcmp(&ia->sin6_addr, &ib->sin6_addr,
+			       sizeof(ia->sin6_addr));
+	}
+	default:
+		return 0;
+	}
+}
+
+/* In host byte order, 0 for anything but IP. */
+uint16_t sock_addr_port(const struct sockaddr *addr)
+{
+	switch (addr->sa_family) {
+	case AF_INET:
+		return ntohs(((const struct sockaddr_in *) addr)->sin_port);
+	case AF_INET6:
+		return ntohs(((const struct sockaddr_in6 *) addr)->sin6_port);
+	default:
+		return 0;
+	}
+}
+
+/* a may be v4-mapped, as the dual-stack listener sees IPv4 peers. */
+static int sock_addr_same_host(const struct sockaddr *a,
+			       const struct sockaddr *b)
+{
+	const struct sockaddr_in6 *in6 = (const void *) a;
+
+	if (a->sa_family == AF_INET6 && b->sa_family == AF_INET &&
+	    IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+		return !memcmp(&in6->sin6_addr.s6_addr[12],
+			       &((const struct sockaddr_in *) b)->sin_addr,
+			       sizeof(struct in_addr));
+	if (a->sa_family != b->sa_family)
+		return 0;
+
+	if (a->sa_family == AF_INET)
+		return ((const struct sockaddr_in *) a)->sin_addr.s_addr ==
+		       ((const struct sockaddr_in *) b)->sin_addr.s_addr;
+
+	return !memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr,
+		       &((const struct sockaddr_in6 *) b)->sin6_addr,
+		       sizeof(struct in6_addr));
+}
+
+/* Loopback or one of our interfaces' addresses. */
+int sock_addr_is_local(const struct sockaddr *addr)
+{
+	int local = 0;
+	struct ifaddrs *ifa, *i;
+	const struct sockaddr_in *in = (const void *) addr;
+	const struct sockaddr_in6 *in6 = (const void *) addr;
+
+	if (addr->sa_family == AF_INET &&
+	    (ntohl(in->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET)
+		return 1;
+	if (addr->sa_family == AF_INET6 &&
+	    (IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) ||
+	     (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) &&
+	      in6->sin6_addr.s6_addr[12] == IN_LOOPBACKNET)))
+		return 1;
+	if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+		return 0;
+
+	if (getifaddrs(&ifa) < 0)
+		return 0;
+
+	for (i = ifa; i && !local; i = i->ifa_next) {
+		if (i->ifa_addr)
+			local = sock_addr_same_host(addr, i->ifa_addr);
+	}
+
+	freeifaddrs(ifa);
+	return local;
+}
+
+static int sock_open_listen_ai(const struct addrinfo *ai, int reuseport)
+{
+	int sock, ret, mtu, one = 1, zero = 0;
+
+	sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sock < 0)
+		return -1;
+
+	/* Take IPv4 on the same socket as v4-mapped addresses. */
+	if (ai->ai_family == AF_INET6) {
+		ret = setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero,
+				 sizeof(zero));
+		if (ret < 0)
+			goto err;
+	}
+
+	if (reuseport) {
+		ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one,
+				 sizeof(one));
+		if (ret < 0)
+			goto err;
+	}
+
+	mtu = IP_PMTUDISC_DONT;
+	setsockopt(sock, SOL_IP, IP_MTU_DISCOVER, &mtu, sizeof(mtu));
+
+	ret = bind(sock, ai->ai_addr, ai->ai_addrlen);
+	if (ret < 0)
+		goto err;
+
+	return sock;
+err:
+	close(sock);
+	return -1;
+}
+
+/*
+ * We want one socket that is reachable over both families, so a dual
+ * stack IPv6 socket is preferred. Hosts without IPv6 get IPv4 only.
+ */
+int sock_open_listen(const char *port, int reuseport)
+{
+	int sock = -1, ret, i;
+	static const int families[] = { AF_INET6, AF_INET };
+	struct addrinfo hints, *ahead, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(NULL, port, &hints, &ahead);
+	if (ret < 0)
+		panic("Cannot get address info!\n");
+
+	for (i = 0; i < array_size(families) && sock < 0; ++i) {
+		for (ai = ahead; ai != NULL && sock < 0; ai = ai->ai_next) {
+			if (ai->ai_family == families[i])
+				sock = sock_open_listen_ai(ai, reuseport);
+		}
+	}
+
+	freeaddrinfo(ahead);
+	if (sock < 0)
+		panic("Cannot open socket!\n");
+
+	return sock;
+}
+
+/* All sockets of the group share one port through SO_REUSEPORT. */
+void sock_open_listen_group(const char *port, int *socks, unsigned int num)
+{
+	unsigned int i;
+
+	if (num == 1) {
+		socks[0] = sock_open_listen(port, 0);
+		return;
+	}
+
+	for (i = 0; i < num; ++i)
+		socks[i] = sock_open_listen(port, 1);
+
+	if (sock_attach_callid_steering(socks[0], num) < 0)
+		whine("Cannot attach steering program, calls are spread by "
+		      "address hash only!\n");
+}
+
+/*
+ * Classic BPF run by the kernel for every datagram of the reuseport
+ * group, starting at the UDP payload. Versioned packets go to socket
+ * (call id % num), so one call always lands on the same worker. For
+ * anything else we return an out of range index, which makes the
+ * kernel fall back to its flow hash.
+ */
+int sock_attach_callid_steering(int sock, unsigned int num)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+			 offsetof(struct transsip_hdr, ver)),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TRANSSIP_VERSION, 0, 3),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			 offsetof(struct transsip_hdr, callid)),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog fprog = {
+		.len = array_size(filter),
+		.filter = filter,
+	};
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		       &fprog, sizeof(fprog)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* AF_UNSPEC if the kernel does not tell. */
+int sock_family(int sock)
+{
+	int val = AF_UNSPEC;
+	socklen_t len = sizeof(val);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &val, &len) < 0)
+		return AF_UNSPEC;
+
+	return val;
+}
+
+/* UDP_SEGMENT is known since Linux 4.18. */
+int sock_has_udp_gso(int sock)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	return getsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+}
+
+/*
+ * SO_TXTIME is known since Linux 4.19. Launch times are taken against
+ * CLOCK_MONOTONIC, which is what fq wants; etf would need CLOCK_TAI.
+ */
+int sock_enable_txtime(int sock)
+{
+	struct sock_txtime txt;
+
+	memset(&txt, 0, sizeof(txt));
+	txt.clockid = CLOCK_MONOTONIC;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txt, sizeof(txt)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Latency over throughput: spin on the device queue for a few us on
+ * receive, mark datagrams EF for the network and put them into the
+ * interactive band of the local qdisc. Raising busy polling needs
+ * CAP_NET_ADMIN, so all options are tried and the first error is
+ * returned. A dual stack socket takes both markings, IP_TOS covers
+ * its v4-mapped peers.
+ */
+int sock_enable_lowlat(int sock)
+{
+	int ret = 0, val;
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	val = LOWLAT_BUSY_POLL;
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0)
+		ret = -errno;
+
+	val = LOWLAT_PRIO;
+	if (setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val)) < 0 &&
+	    !ret)
+		ret = -errno;
+
+	if (getsockname(sock, (struct sockaddr *) &ss, &len) < 0)
+		return ret ? ret : -errno;
+
+	val = LOWLAT_TOS;
+	if (ss.ss_family == AF_INET6 &&
+	    setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &val, sizeof(val)) < 0 &&
+	    !ret)
+		ret = -errno;
+	if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val)) < 0 &&
+	    ss.ss_family == AF_INET && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * Software receive timestamps, taken by the kernel when the datagram
+ * enters the stack, see mmsg_rx_time(). Hardware stamps run on the
+ * NIC's clock and could not be compared with ours.
+ */
+int sock_enable_rx_timestamps(int sock)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Header checks shared by all filters, mirroring transsip_decode():
+ * a versioned header needs a known type, a call id and no unknown
+ * flags, a legacy header some flag, zeroed reserved bits (legacy
+ * senders memset their header) and a sane length. Both leave the
+ * flags in A for the per state check that follows.
+ */
+static const struct sock_filter sock_filter_hdr[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, HDR_OFF(seq) + 4, 0, 9),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, HDR_OFF(ver)),
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TRANSSIP_VERSION, 0, 6),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, HDR_OFF(type)),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __TRANSSIP_PT_MAX, JMP_DROP, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, HDR_OFF(callid)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, JMP_DROP, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, HDR_OFF(flags)),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0xe0, JMP_DROP, JMP_CHECK),
+	/* legacy */
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, LEGACY_MAX, JMP_DROP, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, LEGACY_OFF(flags) + 1, 0,
+		 JMP_DROP),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, LEGACY_OFF(flags)),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0xf0, JMP_DROP, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, JMP_DROP, JMP_CHECK),
+};
+
+static const struct sock_filter sock_filter_probe[] = {
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TRANSSIP_EST | TRANSSIP_PSH),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TRANSSIP_EST, JMP_ACCEPT,
+		 JMP_DROP),
+};
+
+static const struct sock_filter sock_filter_any[] = {
+	BPF_JUMP(BPF_JMP | BPF_JA, 0, 0, 0),
+};
+
+static const struct sock_filter sock_filter_media[] = {
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, TRANSSIP_PSH | TRANSSIP_FIN,
+		 JMP_ACCEPT, JMP_DROP),
+};
+
+static const struct {
+	const struct sock_filter *check;
+	unsigned int len;
+} sock_filters[__SOCK_FILTER_MAX] = {
+	[SOCK_FILTER_PROBE] = { sock_filter_probe,
+				array_size(sock_filter_probe) },
+	[SOCK_FILTER_ANY]   = { sock_filter_any,
+				array_size(sock_filter_any) },
+	[SOCK_FILTER_MEDIA] = { sock_filter_media,
+				array_size(sock_filter_media) },
+};
+
+static inline uint8_t sock_filter_jmp(uint8_t jmp, unsigned int pc,
+				      unsigned int check, unsigned int len)
+{
+	switch (jmp) {
+	case JMP_ACCEPT:
+		return len - 2 - pc - 1;
+	case JMP_DROP:
+		return len - 1 - pc - 1;
+	case JMP_CHECK:
+		return check - pc - 1;
+	default:
+		return jmp;
+	}
+}
+
+/*
+ * Replaces the socket's filter, so junk for the given state is dropped
+ * in the kernel and never wakes us up.
+ */
+int sock_attach_filter(int sock, enum sock_filter_type type)
+{
+	unsigned int i, check, len = 0;
+	struct sock_filter filter[64];
+	struct sock_fprog fprog;
+
+	memcpy(filter, sock_filter_hdr, sizeof(sock_filter_hdr));
+	len += array_size(sock_filter_hdr);
+	check = len;
+
+	memcpy(&filter[len], sock_filters[type].check,
+	       sock_filters[type].len * sizeof(filter[0]));
+	len += sock_filters[type].len;
+
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, 0);
+
+	for (i = 0; i < len; ++i) {
+		if (BPF_CLASS(filter[i].code) != BPF_JMP)
+			continue;
+		if (BPF_OP(filter[i].code) == BPF_JA) {
+			filter[i].k = len - 2 - i - 1;
+			continue;
+		}
+
+		filter[i].jt = sock_filter_jmp(filter[i].jt, i, check, len);
+		filter[i].jf = sock_filter_jmp(filter[i].jf, i, check, len);
+	}
+
+	fprog.len = len;
+	fprog.filter = filter;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+		       sizeof(fprog)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The kernel counts filter drops together with receive queue overruns. */
+uint32_t sock_drops(int sock)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0 ||
+	    len <= SK_MEMINFO_DROPS * sizeof(mem[0]))
+		return 0;
+
+	return mem[SK_MEMINFO_DROPS];
+}
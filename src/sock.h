@@ -0,0 +1,37 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SOCK_H
+#define SOCK_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum sock_filter_type {
+	SOCK_FILTER_PROBE = 0,
+	SOCK_FILTER_ANY,
+	SOCK_FILTER_MEDIA,
+	__SOCK_FILTER_MAX,
+};
+
+extern int sock_addr_equal(const struct sockaddr *a,
+			   const struct sockaddr *b);
+extern uint16_t sock_addr_port(const struct sockaddr *addr);
+extern int sock_addr_is_local(const struct sockaddr *addr);
+extern int sock_open_listen(const char *port, int reuseport);
+extern void sock_open_listen_group(const char *port, int *socks,
+				   unsigned int num);
+extern int sock_attach_callid_steering(int sock, unsigned int num);
+extern int sock_family(int sock);
+extern int sock_has_udp_gso(int sock);
+extern int sock_enable_txtime(int sock);
+extern int sock_enable_lowlat(int sock);
+extern int sock_enable_rx_timestamps(int sock);
+extern int sock_attach_filter(int sock, enum sock_filter_type type);
+extern uint32_t sock_drops(int sock);
+
+#endif /* SOCK_H */
@@ -0,0 +1,946 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * Network emulator for tuning the jitter buffer and loss handling
+ * without a real bad network. Calls go to the emulator, which forwards
+ * them to the target, each caller address from a socket of its own,
+ * and impairs both directions: delay with jitter of a given shape,
+ * reordering, duplication, Gilbert-Elliott loss and a rate limit. All
+ * randomness comes from a seeded generator, one stream per direction,
+ * so a run over loopback can be repeated. Settings may change over
+ * time by a script, see netem_script_load().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "mmsg.h"
+#include "reactor.h"
+#include "sock.h"
+
+#define NETEM_MAX_FLOWS		64
+#define NETEM_POOL		4096
+#define NETEM_MAX_STEPS		256
+#define NETEM_TIMEOUT		(30 * 1000000000ULL)
+#define NETEM_PARETO_ALPHA	3.0
+#define RX_ROUNDS		8
+
+enum netem_dist {
+	NETEM_DIST_UNIFORM = 0,
+	NETEM_DIST_NORMAL,
+	NETEM_DIST_PARETO,
+	__NETEM_DIST_MAX,
+};
+
+enum netem_dir_type {
+	NETEM_UP = 0,		/* caller to target */
+	NETEM_DOWN,		/* target to caller */
+	__NETEM_DIR_MAX,
+};
+
+/*
+ * Probabilities are in [0, 1]. Loss follows the Gilbert-Elliott model
+ * as in netem(8): p takes the path from good to bad, r back again, and
+ * each state loses with its own probability.
+ */
+struct netem_profile {
+	uint64_t delay, jitter;
+	enum netem_dist dist;
+	double reorder, duplicate;
+	double ge_p, ge_r, ge_bad, ge_good;
+	uint64_t rate;
+	unsigned int limit;
+};
+
+struct netem_dir_stats {
+	uint64_t in, out;
+	uint64_t lost, duplicated, reordered, overlimit;
+	uint64_t delay_ns;
+};
+
+struct netem_dir {
+	uint64_t rng;
+	int bad;
+	unsigned int queued;
+	uint64_t link_free, last_due;
+	struct netem_dir_stats stats;
+};
+
+struct netem_flow {
+	int used, sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint64_t last;
+	struct reactor_fd rf;
+};
+
+struct netem_pkt {
+	uint64_t due, seq, at;
+	int dir;
+	struct netem_flow *f;
+	size_t len;
+	char data[MMSG_SIZE];
+};
+
+struct netem_step {
+	uint64_t at;
+	char key[16];
+	char val[32];
+};
+
+struct netem {
+	int sock;
+	struct sockaddr_storage target;
+	socklen_t targetlen;
+	struct netem_profile prof;
+	struct netem_dir dir[__NETEM_DIR_MAX];
+	struct netem_flow flows[NETEM_MAX_FLOWS];
+	struct reactor r;
+	struct reactor_fd rf;
+	struct reactor_timer timer, sweep, report, script;
+	struct mmsg_batch *rx, *tx;
+	struct mmsg_stats net;
+	uint64_t seq, start;
+	unsigned int queued, interval;
+	struct netem_pkt *heap[NETEM_POOL];
+	struct netem_pkt *free[NETEM_POOL];
+	unsigned int nfree;
+	struct netem_step steps[NETEM_MAX_STEPS];
+	unsigned int nsteps, step;
+	uint64_t last_in, last_out, last_lost;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static const char *dist_names[__NETEM_DIST_MAX] = {
+	[NETEM_DIST_UNIFORM]	= "uniform",
+	[NETEM_DIST_NORMAL]	= "normal",
+	[NETEM_DIST_PARETO]	= "pareto",
+};
+
+static const char *dir_names[__NETEM_DIR_MAX] = {
+	[NETEM_UP]		= "up",
+	[NETEM_DOWN]		= "down",
+};
+
+static const char *short_options = "p:t:d:j:D:o:u:l:r:q:s:S:i:vh";
+
+static struct option long_options[] = {
+	{"port", required_argument, 0, 'p'},
+	{"target", required_argument, 0, 't'},
+	{"delay", required_argument, 0, 'd'},
+	{"jitter", required_argument, 0, 'j'},
+	{"dist", required_argument, 0, 'D'},
+	{"reorder", required_argument, 0, 'o'},
+	{"duplicate", required_argument, 0, 'u'},
+	{"loss", required_argument, 0, 'l'},
+	{"rate", required_argument, 0, 'r'},
+	{"limit", required_argument, 0, 'q'},
+	{"seed", required_argument, 0, 's'},
+	{"script", required_argument, 0, 'S'},
+	{"interval", required_argument, 0, 'i'},
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void signal_handler(int number)
+{
+	switch (number) {
+	case SIGINT:
+	case SIGTERM:
+		quit = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+static inline uint64_t netem_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* splitmix64, good enough and the same everywhere for a given seed. */
+static inline uint64_t netem_rand(struct netem_dir *d)
+{
+	uint64_t z = (d->rng += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1). */
+static inline double netem_uniform(struct netem_dir *d)
+{
+	return (netem_rand(d) >> 11) * 0x1.0p-53;
+}
+
+static inline int netem_chance(struct netem_dir *d, double p)
+{
+	return p > 0.0 && netem_uniform(d) < p;
+}
+
+/*
+ * Signed offset to the base delay. Uniform spreads over +/- jitter,
+ * normal has jitter as its deviation, pareto only ever adds, with a
+ * heavy tail and jitter as its mean.
+ */
+static int64_t netem_jitter(struct netem_dir *d,
+			    const struct netem_profile *p)
+{
+	double u, v;
+
+	if (p->jitter == 0)
+		return 0;
+
+	switch (p->dist) {
+	case NETEM_DIST_NORMAL:
+		u = 1.0 - netem_uniform(d);
+		v = netem_uniform(d);
+		return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v) * p->jitter;
+	case NETEM_DIST_PARETO:
+		u = 1.0 - netem_uniform(d);
+		return (pow(u, -1.0 / NETEM_PARETO_ALPHA) - 1.0) *
+		       (NETEM_PARETO_ALPHA - 1.0) * p->jitter;
+	case NETEM_DIST_UNIFORM:
+	default:
+		return (2.0 * netem_uniform(d) - 1.0) * p->jitter;
+	}
+}
+
+static inline int netem_before(const struct netem_pkt *a,
+			       const struct netem_pkt *b)
+{
+	return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void netem_heap_push(struct netem *n, struct netem_pkt *p)
+{
+	unsigned int i = n->queued++, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!netem_before(p, n->heap[parent]))
+			break;
+		n->heap[i] = n->heap[parent];
+		i = parent;
+	}
+
+	n->heap[i] = p;
+}
+
+static struct netem_pkt *netem_heap_pop(struct netem *n)
+{
+	unsigned int i = 0, child;
+	struct netem_pkt *top = n->heap[0], *last = n->heap[--n->queued];
+
+	while ((child = 2 * i + 1) < n->queued) {
+		if (child + 1 < n->queued &&
+		    netem_before(n->heap[child + 1], n->heap[child]))
+			child++;
+		if (!netem_before(n->heap[child], last))
+			break;
+		n->heap[i] = n->heap[child];
+		i = child;
+	}
+
+	n->heap[i] = last;
+	return top;
+}
+
+static void netem_arm(struct netem *n, uint64_t now)
+{
+	uint64_t due;
+
+	if (n->queued == 0) {
+		reactor_timer_disarm(&n->timer);
+		return;
+	}
+
+	due = n->heap[0]->due;
+	reactor_timer_arm(&n->timer, due > now ? due - now : 0, 0);
+}
+
+/* Queues up to two copies of a datagram, or none if it is lost. */
+static void netem_enqueue(struct netem *n, int type, struct netem_flow *f,
+			  const char *msg, size_t len, uint64_t now)
+{
+	int copies, reorder;
+	int64_t delay;
+	uint64_t due;
+	struct netem_pkt *p;
+	struct netem_dir *d = &n->dir[type];
+	const struct netem_profile *prof = &n->prof;
+
+	d->stats.in++;
+
+	if (d->bad ? netem_chance(d, prof->ge_r) : netem_chance(d, prof->ge_p))
+		d->bad = !d->bad;
+	if (netem_chance(d, d->bad ? prof->ge_bad : prof->ge_good)) {
+		d->stats.lost++;
+		return;
+	}
+
+	copies = 1 + netem_chance(d, prof->duplicate);
+	d->stats.duplicated += copies - 1;
+
+	while (copies--) {
+		if (n->nfree == 0 || (prof->limit && d->queued >= prof->limit)) {
+			d->stats.overlimit++;
+			continue;
+		}
+
+		/* Reordered ones skip the delay and overtake the queue. */
+		reorder = netem_chance(d, prof->reorder);
+		delay = reorder ? 0 : (int64_t) prof->delay +
+				      netem_jitter(d, prof);
+		due = now + max(delay, (int64_t) 0);
+
+		if (prof->rate) {
+			due = max(due, d->link_free);
+			d->link_free = due + len * 8 * 1000000000ULL /
+				       prof->rate;
+		}
+
+		if (due < d->last_due)
+			d->stats.reordered++;
+		d->last_due = max(d->last_due, due);
+
+		p = n->free[--n->nfree];
+		p->due = due;
+		p->seq = n->seq++;
+		p->at = now;
+		p->dir = type;
+		p->f = f;
+		p->len = len;
+		memcpy(p->data, msg, len);
+
+		d->queued++;
+		netem_heap_push(n, p);
+		if (n->heap[0] == p)
+			netem_arm(n, now);
+	}
+}
+
+static void netem_flush(struct netem *n)
+{
+	if (n->tx->len > 0 && mmsg_flush(n->tx, &n->net) > 0)
+		whine("Send datagram failed!\n");
+}
+
+static void netem_on_timer(struct reactor_timer *t, uint64_t expired)
+{
+	struct netem *n = t->arg;
+	struct netem_pkt *p;
+	struct netem_dir *d;
+	uint64_t now = netem_now();
+
+	while (n->queued && n->heap[0]->due <= now) {
+		p = netem_heap_pop(n);
+		d = &n->dir[p->dir];
+		d->queued--;
+
+		/* A flow that timed out took its socket with it. */
+		if (p->f->used) {
+			if (mmsg_full(n->tx))
+				netem_flush(n);
+
+			memcpy(mmsg_tx_slot(n->tx), p->data, p->len);
+			if (p->dir == NETEM_UP)
+				mmsg_tx_commit(n->tx, p->f->sock,
+					       (struct sockaddr *) &n->target,
+					       n->targetlen, p->len);
+			else
+				mmsg_tx_commit(n->tx, n->sock,
+					       (struct sockaddr *) &p->f->addr,
+					       p->f->addrlen, p->len);
+
+			d->stats.out++;
+			d->stats.delay_ns += now - p->at;
+		}
+
+		n->free[n->nfree++] = p;
+	}
+
+	netem_flush(n);
+	netem_arm(n, now);
+}
+
+static void netem_on_upstream(struct reactor_fd *rf, uint32_t events);
+
+/* Each caller gets a socket of its own towards the target. */
+static struct netem_flow *netem_flow(struct netem *n,
+				     const struct sockaddr *addr,
+				     socklen_t addrlen, uint64_t now)
+{
+	int i, sock;
+	struct netem_flow *f, *slot = NULL;
+
+	for (i = 0; i < NETEM_MAX_FLOWS; ++i) {
+		f = &n->flows[i];
+		if (!f->used) {
+			if (!slot)
+				slot = f;
+			continue;
+		}
+		if (sock_addr_equal((struct sockaddr *) &f->addr, addr))
+			return f;
+	}
+
+	if (!slot || addrlen > sizeof(slot->addr))
+		return NULL;
+
+	sock = socket(n->target.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return NULL;
+	if (connect(sock, (struct sockaddr *) &n->target, n->targetlen) < 0) {
+		close(sock);
+		return NULL;
+	}
+
+	slot->used = 1;
+	slot->sock = sock;
+	slot->last = now;
+	memcpy(&slot->addr, addr, addrlen);
+	slot->addrlen = addrlen;
+	reactor_add(&n->r, &slot->rf, sock, EPOLLIN, netem_on_upstream, n);
+
+	return slot;
+}
+
+static void netem_recv(struct netem *n, int sock, int type,
+		       struct netem_flow *f)
+{
+	int i, num, rounds = 0;
+	size_t len;
+	char *msg;
+	socklen_t addrlen;
+	struct sockaddr *addr;
+	uint64_t now;
+
+	do {
+		num = mmsg_recv(sock, n->rx, &n->net);
+		if (num <= 0)
+			break;
+
+		now = netem_now();
+		for (i = 0; i < num; ++i) {
+			msg = mmsg_rx_data(n->rx, i, &len);
+			if (type == NETEM_UP) {
+				addr = mmsg_rx_addr(n->rx, i, &addrlen);
+				f = netem_flow(n, addr, addrlen, now);
+				if (!f)
+					continue;
+			}
+
+			f->last = now;
+			netem_enqueue(n, type, f, msg, len, now);
+		}
+	} while (num == MMSG_BATCH && ++rounds < RX_ROUNDS);
+}
+
+static void netem_on_sock(struct reactor_fd *rf, uint32_t events)
+{
+	netem_recv(rf->arg, rf->fd, NETEM_UP, NULL);
+}
+
+static void netem_on_upstream(struct reactor_fd *rf, uint32_t events)
+{
+	netem_recv(rf->arg, rf->fd, NETEM_DOWN,
+		   container_of(rf, struct netem_flow, rf));
+}
+
+static void netem_on_sweep(struct reactor_timer *t, uint64_t expired)
+{
+	int i;
+	struct netem *n = t->arg;
+	struct netem_flow *f;
+	uint64_t now = netem_now();
+
+	for (i = 0; i < NETEM_MAX_FLOWS; ++i) {
+		f = &n->flows[i];
+		if (!f->used || now - f->last < NETEM_TIMEOUT)
+			continue;
+
+		reactor_del(&n->r, &f->rf);
+		close(f->sock);
+		f->used = 0;
+	}
+}
+
+static double netem_percent(const char *val)
+{
+	char *end;
+	double pct = strtod(val, &end);
+
+	if (end == val || *end || pct < 0.0 || pct > 100.0)
+		return -1.0;
+
+	return pct / 100.0;
+}
+
+static int netem_msec(const char *val, uint64_t *ns)
+{
+	char *end;
+	double ms = strtod(val, &end);
+
+	if (end == val || *end || ms < 0.0)
+		return -EINVAL;
+
+	*ns = ms * 1000000.0;
+	return 0;
+}
+
+/* loss=<p>[:<r>[:<bad>[:<good>]]] in percent, see netem(8) gemodel. */
+static int netem_set_loss(struct netem_profile *p, const char *val)
+{
+	int num;
+	double v[4] = { 0.0, 100.0, 100.0, 0.0 };
+
+	num = sscanf(val, "%lf:%lf:%lf:%lf", &v[0], &v[1], &v[2], &v[3]);
+	if (num < 1)
+		return -EINVAL;
+
+	/* A bare rate means independent loss, the bad state is all. */
+	if (num == 1) {
+		v[1] = 100.0 - v[0];
+		v[2] = 100.0;
+		v[3] = 0.0;
+	}
+
+	for (num = 0; num < 4; ++num) {
+		if (v[num] < 0.0 || v[num] > 100.0)
+			return -EINVAL;
+	}
+
+	p->ge_p = v[0] / 100.0;
+	p->ge_r = v[1] / 100.0;
+	p->ge_bad = v[2] / 100.0;
+	p->ge_good = v[3] / 100.0;
+
+	return 0;
+}
+
+/* Shared by the command line and scripts, keys are the long options. */
+static int netem_set(struct netem_profile *p, const char *key,
+		     const char *val)
+{
+	int i;
+	double pct;
+
+	if (!strcmp(key, "delay"))
+		return netem_msec(val, &p->delay);
+	if (!strcmp(key, "jitter"))
+		return netem_msec(val, &p->jitter);
+	if (!strcmp(key, "dist")) {
+		for (i = 0; i < __NETEM_DIST_MAX; ++i) {
+			if (!strcmp(val, dist_names[i])) {
+				p->dist = i;
+				return 0;
+			}
+		}
+		return -EINVAL;
+	}
+	if (!strcmp(key, "reorder")) {
+		pct = netem_percent(val);
+		if (pct < 0.0)
+			return -EINVAL;
+		p->reorder = pct;
+		return 0;
+	}
+	if (!strcmp(key, "duplicate")) {
+		pct = netem_percent(val);
+		if (pct < 0.0)
+			return -EINVAL;
+		p->duplicate = pct;
+		return 0;
+	}
+	if (!strcmp(key, "loss"))
+		return netem_set_loss(p, val);
+	if (!strcmp(key, "rate")) {
+		p->rate = strtoull(val, NULL, 10) * 1000;
+		return 0;
+	}
+	if (!strcmp(key, "limit")) {
+		p->limit = strtoul(val, NULL, 10);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * A script has a line per point in time, seconds from the start in
+ * ascending order followed by settings, '#' starts a comment:
+ *
+ *   0     delay=40 jitter=10 dist=normal
+ *   10    loss=5:40
+ *   20.5  rate=64 limit=20
+ */
+static void netem_script_load(struct netem *n, const char *file)
+{
+	int line = 0;
+	double sec;
+	char buff[512], *tok, *val, *save;
+	uint64_t at, prev = 0;
+	FILE *fp;
+	struct netem_profile check;
+	struct netem_step *s;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		panic("Cannot open script %s!\n", file);
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		line++;
+		if ((tok = strchr(buff, '#')))
+			*tok = 0;
+
+		tok = strtok_r(buff, " \t\r\n", &save);
+		if (!tok)
+			continue;
+
+		if (sscanf(tok, "%lf", &sec) != 1 || sec < 0.0)
+			panic("%s:%d: bad time %s!\n", file, line, tok);
+		at = sec * 1000000000.0;
+		if (at < prev)
+			panic("%s:%d: time goes backwards!\n", file, line);
+		prev = at;
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			val = strchr(tok, '=');
+			if (!val)
+				panic("%s:%d: %s is no key=value!\n", file,
+				      line, tok);
+			*val++ = 0;
+
+			check = n->prof;
+			if (netem_set(&check, tok, val) < 0)
+				panic("%s:%d: bad setting %s=%s!\n", file,
+				      line, tok, val);
+			if (n->nsteps == NETEM_MAX_STEPS)
+				panic("%s: more than %d settings!\n", file,
+				      NETEM_MAX_STEPS);
+
+			s = &n->steps[n->nsteps++];
+			s->at = at;
+			strlcpy(s->key, tok, sizeof(s->key));
+			strlcpy(s->val, val, sizeof(s->val));
+		}
+	}
+
+	fclose(fp);
+}
+
+static void netem_on_script(struct reactor_timer *t, uint64_t expired)
+{
+	struct netem *n = t->arg;
+	struct netem_step *s;
+	uint64_t elapsed = netem_now() - n->start;
+
+	for (; n->step < n->nsteps; n->step++) {
+		s = &n->steps[n->step];
+		if (s->at > elapsed) {
+			reactor_timer_arm(&n->script, s->at - elapsed, 0);
+			break;
+		}
+
+		netem_set(&n->prof, s->key, s->val);
+		printf("%.3fs: %s=%s\n", s->at / 1e9, s->key, s->val);
+	}
+
+	fflush(stdout);
+}
+
+static void netem_on_report(struct reactor_timer *t, uint64_t expired)
+{
+	int i;
+	struct netem *n = t->arg;
+	uint64_t in = 0, out = 0, lost = 0;
+
+	for (i = 0; i < __NETEM_DIR_MAX; ++i) {
+		in += n->dir[i].stats.in;
+		out += n->dir[i].stats.out;
+		lost += n->dir[i].stats.lost;
+	}
+
+	printf("%llu pkts/s in, %llu pkts/s out, %llu pkts/s lost, %u "
+	       "queued\n", (unsigned long long) (in - n->last_in) / n->interval,
+	       (unsigned long long) (out - n->last_out) / n->interval,
+	       (unsigned long long) (lost - n->last_lost) / n->interval,
+	       n->queued);
+	fflush(stdout);
+
+	n->last_in = in;
+	n->last_out = out;
+	n->last_lost = lost;
+}
+
+static void netem_resolve(struct netem *n, const char *target)
+{
+	int ret;
+	char host[256], *port;
+	struct addrinfo hints, *ai;
+
+	strlcpy(host, target, sizeof(host));
+	port = strrchr(host, ':');
+	if (!port)
+		panic("Target must be <host>:<port>!\n");
+	*port++ = 0;
+
+	/* [::1]:30111 */
+	if (host[0] == '[' && port - host > 2 && port[-2] == ']') {
+		port[-2] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	ret = getaddrinfo(host, port, &hints, &ai);
+	if (ret)
+		panic("Cannot resolve %s: %s!\n", target, gai_strerror(ret));
+
+	memcpy(&n->target, ai->ai_addr, ai->ai_addrlen);
+	n->targetlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+}
+
+static void netem_init(struct netem *n, const char *port, uint64_t seed)
+{
+	int i;
+
+	n->sock = sock_open_listen(port, 0);
+	n->rx = mmsg_batch_alloc();
+	n->tx = mmsg_batch_alloc();
+
+	for (i = 0; i < NETEM_POOL; ++i)
+		n->free[i] = xmalloc(sizeof(struct netem_pkt));
+	n->nfree = NETEM_POOL;
+
+	for (i = 0; i < __NETEM_DIR_MAX; ++i)
+		n->dir[i].rng = seed * 2 + i;
+
+	reactor_init(&n->r);
+	reactor_add(&n->r, &n->rf, n->sock, EPOLLIN, netem_on_sock, n);
+	reactor_timer_init(&n->r, &n->timer, netem_on_timer, n);
+	reactor_timer_init(&n->r, &n->sweep, netem_on_sweep, n);
+	reactor_timer_arm(&n->sweep, NETEM_TIMEOUT, NETEM_TIMEOUT);
+	reactor_timer_init(&n->r, &n->report, netem_on_report, n);
+	reactor_timer_arm(&n->report, n->interval * 1000000000ULL,
+			  n->interval * 1000000000ULL);
+	reactor_timer_init(&n->r, &n->script, netem_on_script, n);
+
+	n->start = netem_now();
+	if (n->nsteps)
+		reactor_timer_arm(&n->script, n->steps[0].at, 0);
+}
+
+static void netem_cleanup(struct netem *n)
+{
+	int i;
+
+	for (i = 0; i < NETEM_MAX_FLOWS; ++i) {
+		if (!n->flows[i].used)
+			continue;
+		reactor_del(&n->r, &n->flows[i].rf);
+		close(n->flows[i].sock);
+	}
+
+	while (n->queued)
+		n->free[n->nfree++] = netem_heap_pop(n);
+	for (i = 0; i < NETEM_POOL; ++i)
+		xfree(n->free[i]);
+
+	reactor_timer_destroy(&n->r, &n->script);
+	reactor_timer_destroy(&n->r, &n->report);
+	reactor_timer_destroy(&n->r, &n->sweep);
+	reactor_timer_destroy(&n->r, &n->timer);
+	reactor_del(&n->r, &n->rf);
+	reactor_destroy(&n->r);
+	close(n->sock);
+
+	mmsg_batch_free(n->rx);
+	mmsg_batch_free(n->tx);
+}
+
+static void netem_dump_stats(struct netem *n)
+{
+	int i;
+	struct netem_dir_stats *st;
+
+	for (i = 0; i < __NETEM_DIR_MAX; ++i) {
+		st = &n->dir[i].stats;
+
+		printf("%s: %llu in, %llu out, %llu lost (%.2f%%), %llu "
+		       "duplicated, %llu reordered, %llu over limit, "
+		       "%.2fms avg delay\n", dir_names[i],
+		       (unsigned long long) st->in,
+		       (unsigned long long) st->out,
+		       (unsigned long long) st->lost,
+		       st->in ? 100.0 * st->lost / st->in : 0.0,
+		       (unsigned long long) st->duplicated,
+		       (unsigned long long) st->reordered,
+		       (unsigned long long) st->overlimit,
+		       st->out ? st->delay_ns / 1e6 / st->out : 0.0);
+	}
+
+	mmsg_dump_stats("net", &n->net);
+	fflush(stdout);
+}
+
+static void help(void)
+{
+	printf("\n%s %s, the telephony toolkit's network emulator\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Usage: transsip-netem [options]\n");
+	printf("Options:\n");
+	printf("  -p|--port <port>       UDP port to take calls on (default 30112)\n");
+	printf("  -t|--target <host:port> Where calls go (default 127.0.0.1:30111)\n");
+	printf("  -d|--delay <ms>        Delay each way\n");
+	printf("  -j|--jitter <ms>       Jitter on top of the delay\n");
+	printf("  -D|--dist <type>       Jitter as uniform, normal or pareto\n");
+	printf("  -o|--reorder <pct>     Send packets right away, past the queue\n");
+	printf("  -u|--duplicate <pct>   Send packets twice\n");
+	printf("  -l|--loss <p[:r[:bad[:good]]]>\n");
+	printf("                         Gilbert-Elliott loss in percent, a bare\n");
+	printf("                         p is independent loss\n");
+	printf("  -r|--rate <kbit/s>     Rate limit each way\n");
+	printf("  -q|--limit <pkts>      Queue limit each way\n");
+	printf("  -s|--seed <num>        Seed of the random generator (default 1)\n");
+	printf("  -S|--script <file>     Change settings over time, lines of\n");
+	printf("                         <sec> <key>=<value> ..., keys as above\n");
+	printf("  -i|--interval <sec>    Statistics interval (default 1)\n");
+	printf("  -v|--version           Print version\n");
+	printf("  -h|--help              Print this help\n");
+	printf("\n");
+	printf("Call the emulator's port instead of the target's, both ways of\n");
+	printf("the call are impaired alike.\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+static void version(void)
+{
+	printf("\n%s %s, the telephony toolkit's network emulator\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+int main(int argc, char **argv)
+{
+	int c, opt_index;
+	char *port = "30112", *target = "127.0.0.1:30111", *script = NULL;
+	uint64_t seed = 1;
+	struct netem *n;
+
+	n = xzmalloc(sizeof(*n));
+	n->interval = 1;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options,
+				&opt_index)) != EOF) {
+		switch (c) {
+		case 'p':
+			port = optarg;
+			break;
+		case 't':
+			target = optarg;
+			break;
+		case 'd':
+		case 'j':
+		case 'D':
+		case 'o':
+		case 'u':
+		case 'l':
+		case 'r':
+		case 'q':
+			for (opt_index = 0; long_options[opt_index].val != c;
+			     opt_index++)
+				;
+			if (netem_set(&n->prof, long_options[opt_index].name,
+				      optarg) < 0)
+				panic("Bad %s %s!\n",
+				      long_options[opt_index].name, optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			script = optarg;
+			break;
+		case 'i':
+			n->interval = strtoul(optarg, NULL, 10);
+			if (n->interval == 0)
+				panic("Interval must be at least 1s!\n");
+			break;
+		case 'v':
+			version();
+			break;
+		case 'h':
+		default:
+			help();
+			break;
+		}
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	netem_resolve(n, target);
+	if (script)
+		netem_script_load(n, script);
+	netem_init(n, port, seed);
+
+	printf("Emulating on port %s towards %s, seed %llu\n", port, target,
+	       (unsigned long long) seed);
+	fflush(stdout);
+
+	while (likely(!quit))
+		reactor_run_once(&n->r, -1);
+
+	netem_dump_stats(n);
+	netem_cleanup(n);
+	xfree(n);
+
+	return 0;
+}
@@ -0,0 +1,672 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * Media relay for peers that cannot reach each other directly, e.g.
+ * behind symmetric NATs. The caller sends all of a call to the relay
+ * and wraps its probes in a TRANSSIP_PT_RELAY request that names the
+ * callee, see struct transsip_relay. The first request opens the call
+ * with the caller as first leg and the callee as second one, the probe
+ * goes on unwrapped. The callee needs to know nothing about the relay,
+ * to it the relay is the caller. From then on all one leg sends is
+ * forwarded to the other one as is, the callee's cookie challenge as
+ * much as its answer; anything from other senders is dropped. Each
+ * request yields one smaller datagram and new calls are rate limited
+ * per source, so the relay is no amplifier. Audio is never decoded,
+ * only the header is looked at.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "proto.h"
+#include "mmsg.h"
+#include "reactor.h"
+#include "sock.h"
+#include "ratelimit.h"
+
+#define RELAY_MAX_WORKERS	64
+#define RELAY_MAX_CALLS		4096
+#define RELAY_HASH_BITS		12
+#define RELAY_HASH_SIZE		(1 << RELAY_HASH_BITS)
+#define RELAY_TIMEOUT		(30 * 1000000000ULL)
+#define RELAY_PENDING		(5 * 1000000000ULL)
+#define RELAY_OPEN_RATE		10
+#define RELAY_OPEN_BURST	20
+#define RELAY_SWEEP		(1000000000ULL)
+#define RELAY_LAT_BUCKETS	252
+#define RX_ROUNDS		8
+
+struct relay_call {
+	uint32_t callid;
+	int used, legs;
+	struct sockaddr_storage addr[2];
+	socklen_t addrlen[2];
+	uint64_t last;
+	struct relay_call *next;
+};
+
+struct relay_stats {
+	uint64_t fwd;
+	uint64_t drop;
+	uint64_t calls;
+	uint64_t limited;
+	uint64_t lat[RELAY_LAT_BUCKETS];
+};
+
+struct relay_worker {
+	unsigned int id;
+	int sock, family;
+	pthread_t tid;
+	struct reactor r;
+	struct reactor_fd rf;
+	struct reactor_timer sweep;
+	struct mmsg_batch *rx, *tx;
+	struct mmsg_stats net;
+	struct relay_stats stats;
+	struct ratelimit *rl;
+	unsigned int count;
+	struct relay_call calls[RELAY_MAX_CALLS];
+	struct relay_call *hash[RELAY_HASH_SIZE];
+	struct relay_call *free;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static struct relay_worker *workers[RELAY_MAX_WORKERS];
+
+static const char *short_options = "p:w:i:vh";
+
+static struct option long_options[] = {
+	{"port", required_argument, 0, 'p'},
+	{"workers", required_argument, 0, 'w'},
+	{"interval", required_argument, 0, 'i'},
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void signal_handler(int number)
+{
+	switch (number) {
+	case SIGINT:
+	case SIGTERM:
+		quit = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+static inline uint64_t relay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Log-linear buckets, four per power of two. */
+static inline unsigned int relay_lat_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < 4)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+static inline uint64_t relay_lat_value(unsigned int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+
+	return (uint64_t) (4 | (bucket & 3)) << (bucket / 4 - 1);
+}
+
+static inline uint32_t relay_hash(uint32_t callid)
+{
+	return (callid * 2654435761U) >> (32 - RELAY_HASH_BITS);
+}
+
+static struct relay_call *relay_lookup(struct relay_worker *w,
+				       uint32_t callid)
+{
+	struct relay_call *c;
+
+	for (c = w->hash[relay_hash(callid)]; c; c = c->next) {
+		if (c->callid == callid)
+			return c;
+	}
+
+	return NULL;
+}
+
+static struct relay_call *relay_alloc(struct relay_worker *w,
+				      uint32_t callid)
+{
+	struct relay_call *c = w->free;
+	uint32_t hash = relay_hash(callid);
+
+	if (!c)
+		return NULL;
+
+	w->free = c->next;
+
+	memset(c, 0, sizeof(*c));
+	c->used = 1;
+	c->callid = callid;
+	c->next = w->hash[hash];
+	w->hash[hash] = c;
+
+	w->count++;
+	w->stats.calls++;
+
+	return c;
+}
+
+static void relay_release(struct relay_worker *w, struct relay_call *c)
+{
+	struct relay_call **pp = &w->hash[relay_hash(c->callid)];
+
+	while (*pp) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+		pp = &(*pp)->next;
+	}
+
+	c->used = 0;
+	c->next = w->free;
+	w->free = c;
+	w->count--;
+}
+
+/* The callee counts as a leg once it has sent anything. */
+static int relay_leg(struct relay_call *c, const struct sockaddr *addr)
+{
+	if (sock_addr_equal((struct sockaddr *) &c->addr[0], addr))
+		return 0;
+	if (!sock_addr_equal((struct sockaddr *) &c->addr[1], addr))
+		return -1;
+
+	c->legs = 2;
+	return 1;
+}
+
+/* Our socket is dual stack or IPv4 only, callees must fit it. */
+static int relay_callee(struct relay_worker *w, const struct transsip_pkt *pkt,
+			struct sockaddr_storage *addr, socklen_t *addrlen,
+			uint8_t *type)
+{
+	struct sockaddr_in in;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+
+	if (transsip_relay_decode(pkt, addr, addrlen, type) < 0)
+		return -1;
+	if (addr->ss_family == w->family)
+		return 0;
+	if (addr->ss_family != AF_INET)
+		return -1;
+
+	memcpy(&in, addr, sizeof(in));
+	memset(in6, 0, sizeof(*in6));
+	in6->sin6_family = AF_INET6;
+	in6->sin6_port = in.sin_port;
+	in6->sin6_addr.s6_addr[10] = 0xff;
+	in6->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&in6->sin6_addr.s6_addr[12], &in.sin_addr, sizeof(in.sin_addr));
+	*addrlen = sizeof(*in6);
+
+	return 0;
+}
+
+/*
+ * Requests open a call or are resent probes of the caller. Either way
+ * the probe goes to the callee unwrapped, which shortens it.
+ */
+static int relay_request(struct relay_worker *w, struct relay_call **cp,
+			 struct transsip_pkt *pkt, char *out, size_t *len,
+			 const struct sockaddr *addr, socklen_t addrlen,
+			 uint64_t now)
+{
+	size_t hlen;
+	uint8_t type;
+	socklen_t tolen;
+	struct sockaddr_storage to;
+	struct relay_call *c = *cp;
+
+	if (!transsip_is_probe(pkt) ||
+	    relay_callee(w, pkt, &to, &tolen, &type) < 0)
+		return -1;
+
+	if (c) {
+		if (!sock_addr_equal((struct sockaddr *) &c->addr[0], addr) ||
+		    !sock_addr_equal((struct sockaddr *) &c->addr[1],
+				     (struct sockaddr *) &to))
+			return -1;
+	} else {
+		if (addrlen > sizeof(struct sockaddr_storage))
+			return -1;
+		if (!ratelimit_allow(w->rl, addr, now)) {
+			w->stats.limited++;
+			return -1;
+		}
+
+		c = relay_alloc(w, pkt->callid);
+		if (!c)
+			return -1;
+
+		memcpy(&c->addr[0], addr, addrlen);
+		c->addrlen[0] = addrlen;
+		memcpy(&c->addr[1], &to, tolen);
+		c->addrlen[1] = tolen;
+		c->legs = 1;
+		*cp = c;
+	}
+
+	pkt->type = type;
+	pkt->payload += TRANSSIP_RELAY_LEN;
+	pkt->len -= TRANSSIP_RELAY_LEN;
+
+	hlen = transsip_encode((uint8_t *) out, MMSG_SIZE, pkt);
+	if (unlikely(hlen == 0))
+		return -1;
+
+	memcpy(out + hlen, pkt->payload, pkt->len);
+	*len = hlen + pkt->len;
+
+	return 0;
+}
+
+static int relay_forward(struct relay_worker *w, char *msg, size_t len,
+			 const struct sockaddr *addr, socklen_t addrlen,
+			 uint64_t now)
+{
+	int leg;
+	char *out;
+	struct relay_call *c;
+	struct transsip_pkt pkt;
+
+	if (unlikely(transsip_decode((uint8_t *) msg, len, &pkt) < 0))
+		return -1;
+	if (pkt.version != TRANSSIP_VERSION || pkt.callid == 0)
+		return -1;
+
+	c = relay_lookup(w, pkt.callid);
+	if (!c && pkt.type != TRANSSIP_PT_RELAY)
+		return -1;
+
+	if (mmsg_full(w->tx))
+		mmsg_flush(w->tx, &w->net);
+	out = mmsg_tx_slot(w->tx);
+
+	if (pkt.type == TRANSSIP_PT_RELAY) {
+		if (relay_request(w, &c, &pkt, out, &len, addr, addrlen,
+				  now) < 0)
+			return -1;
+		leg = 0;
+	} else {
+		leg = relay_leg(c, addr);
+		if (leg < 0)
+			return -1;
+		memcpy(out, msg, len);
+	}
+
+	c->last = now;
+	mmsg_tx_commit(w->tx, w->sock, (struct sockaddr *) &c->addr[!leg],
+		       c->addrlen[!leg], len);
+
+	/* Fins are retransmitted until acked, so hold on till then. */
+	if (transsip_is_fin_ack(&pkt))
+		relay_release(w, c);
+
+	return 0;
+}
+
+/*
+ * Latency is taken from the return of recvmmsg(2) to the return of
+ * sendmmsg(2), i.e. the time a datagram spends inside the relay.
+ */
+static void relay_recv(struct relay_worker *w)
+{
+	int i, n, fwd, rounds = 0;
+	size_t len;
+	char *msg;
+	uint64_t start;
+	socklen_t addrlen;
+	struct sockaddr *addr;
+
+	do {
+		n = mmsg_recv(w->sock, w->rx, &w->net);
+		start = relay_now();
+
+		for (i = 0, fwd = 0; i < n; ++i) {
+			msg = mmsg_rx_data(w->rx, i, &len);
+			addr = mmsg_rx_addr(w->rx, i, &addrlen);
+			if (relay_forward(w, msg, len, addr, addrlen, start))
+				w->stats.drop++;
+			else
+				fwd++;
+		}
+
+		if (w->tx->len > 0)
+			mmsg_flush(w->tx, &w->net);
+		if (fwd > 0) {
+			w->stats.fwd += fwd;
+			w->stats.lat[relay_lat_bucket(relay_now() - start)] += fwd;
+		}
+	} while (n == MMSG_BATCH && ++rounds < RX_ROUNDS);
+}
+
+static void relay_on_sock(struct reactor_fd *rf, uint32_t events)
+{
+	relay_recv(rf->arg);
+}
+
+static void relay_on_sweep(struct reactor_timer *t, uint64_t expired)
+{
+	int i;
+	struct relay_worker *w = t->arg;
+	struct relay_call *c;
+	uint64_t now = relay_now();
+
+	/* Calls nobody answered go first, they cost us table room. */
+	for (i = 0; i < RELAY_MAX_CALLS; ++i) {
+		c = &w->calls[i];
+		if (c->used && now - c->last >
+		    (c->legs < 2 ? RELAY_PENDING : RELAY_TIMEOUT))
+			relay_release(w, c);
+	}
+}
+
+static void relay_pin_cpu(struct relay_worker *w)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t mask;
+
+	if (cpus <= 0)
+		return;
+
+	CPU_ZERO(&mask);
+	CPU_SET(w->id % cpus, &mask);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+		whine("Cannot pin worker %u to a CPU!\n", w->id);
+}
+
+static void *relay_worker_main(void *arg)
+{
+	struct relay_worker *w = arg;
+
+	relay_pin_cpu(w);
+
+	while (likely(!quit))
+		reactor_run_once(&w->r, -1);
+
+	return NULL;
+}
+
+static struct relay_worker *relay_worker_init(unsigned int id, int sock)
+{
+	int i;
+	struct relay_worker *w;
+
+	w = xmalloc_aligned(sizeof(*w), 64);
+	memset(w, 0, sizeof(*w));
+
+	w->id = id;
+	w->sock = sock;
+	w->family = sock_family(sock);
+	w->rx = mmsg_batch_alloc();
+	w->tx = mmsg_batch_alloc();
+	w->tx->gso = sock_has_udp_gso(sock);
+
+	w->rl = xmalloc(sizeof(*w->rl));
+	ratelimit_init(w->rl, RELAY_OPEN_RATE, RELAY_OPEN_BURST);
+
+	for (i = RELAY_MAX_CALLS - 1; i >= 0; --i) {
+		w->calls[i].next = w->free;
+		w->free = &w->calls[i];
+	}
+
+	reactor_init(&w->r);
+	reactor_add(&w->r, &w->rf, sock, EPOLLIN, relay_on_sock, w);
+	reactor_timer_init(&w->r, &w->sweep, relay_on_sweep, w);
+	reactor_timer_arm(&w->sweep, RELAY_SWEEP, RELAY_SWEEP);
+
+	return w;
+}
+
+static void relay_worker_cleanup(struct relay_worker *w)
+{
+	reactor_timer_destroy(&w->r, &w->sweep);
+	reactor_del(&w->r, &w->rf);
+	reactor_destroy(&w->r);
+	close(w->sock);
+
+	mmsg_batch_free(w->rx);
+	mmsg_batch_free(w->tx);
+	xfree(w->rl);
+	xfree(w);
+}
+
+static void relay_dump_latency(unsigned int num)
+{
+	int i, j;
+	uint64_t total = 0, seen = 0;
+	uint64_t lat[RELAY_LAT_BUCKETS];
+	static const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	memset(lat, 0, sizeof(lat));
+	for (i = 0; i < num; ++i) {
+		for (j = 0; j < RELAY_LAT_BUCKETS; ++j) {
+			lat[j] += workers[i]->stats.lat[j];
+			total += workers[i]->stats.lat[j];
+		}
+	}
+
+	if (total == 0)
+		return;
+
+	printf("forwarding latency:");
+	for (i = 0, j = 0; i < array_size(pct); ++i) {
+		for (; j < RELAY_LAT_BUCKETS; ++j) {
+			if (seen + lat[j] >= total * pct[i] / 100.0)
+				break;
+			seen += lat[j];
+		}
+
+		printf(" p%g <= %.1fus", pct[i],
+		       relay_lat_value(min(j + 1, RELAY_LAT_BUCKETS - 1)) /
+		       1000.0);
+	}
+	printf("\n");
+}
+
+static void relay_dump_stats(unsigned int num)
+{
+	int i;
+	char name[32];
+	struct relay_worker *w;
+
+	for (i = 0; i < num; ++i) {
+		w = workers[i];
+
+		printf("worker %u: %llu forwarded, %llu dropped, %llu calls "
+		       "(%u active), %llu rate limited\n", w->id,
+		       (unsigned long long) w->stats.fwd,
+		       (unsigned long long) w->stats.drop,
+		       (unsigned long long) w->stats.calls, w->count,
+		       (unsigned long long) w->stats.limited);
+
+		slprintf(name, sizeof(name), "worker %u net", w->id);
+		mmsg_dump_stats(name, &w->net);
+	}
+
+	relay_dump_latency(num);
+	fflush(stdout);
+}
+
+/* Counters of the workers are read racily, good enough for stats. */
+static void relay_report(unsigned int num, unsigned int interval)
+{
+	int i;
+	uint64_t fwd, drop, last_fwd = 0, last_drop = 0;
+	unsigned int active;
+
+	while (likely(!quit)) {
+		sleep(interval);
+
+		fwd = drop = 0;
+		active = 0;
+		for (i = 0; i < num; ++i) {
+			fwd += workers[i]->stats.fwd;
+			drop += workers[i]->stats.drop;
+			active += workers[i]->count;
+		}
+
+		printf("%llu pkts/s forwarded, %llu pkts/s dropped, %u calls\n",
+		       (unsigned long long) (fwd - last_fwd) / interval,
+		       (unsigned long long) (drop - last_drop) / interval,
+		       active);
+		fflush(stdout);
+
+		last_fwd = fwd;
+		last_drop = drop;
+	}
+}
+
+static void help(void)
+{
+	printf("\n%s %s, the telephony toolkit's media relay\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Usage: transsip-relay [options]\n");
+	printf("Options:\n");
+	printf("  -p|--port <port>       UDP port to relay on (default 30111)\n");
+	printf("  -w|--workers <num>     Number of worker threads (default 1)\n");
+	printf("  -i|--interval <sec>    Statistics interval (default 1)\n");
+	printf("  -v|--version           Print version\n");
+	printf("  -h|--help              Print this help\n");
+	printf("\n");
+	printf("Callers dial through the relay with transsip --relay, the relay\n");
+	printf("forwards between them and their callees.\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+static void version(void)
+{
+	printf("\n%s %s, the telephony toolkit's media relay\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+int main(int argc, char **argv)
+{
+	int c, opt_index, ret, socks[RELAY_MAX_WORKERS];
+	unsigned int i, num = 1, interval = 1;
+	char *port = "30111";
+	sigset_t mask;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options,
+				&opt_index)) != EOF) {
+		switch (c) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'w':
+			num = strtoul(optarg, NULL, 10);
+			if (num == 0 || num > RELAY_MAX_WORKERS)
+				panic("Workers must be between 1 and %d!\n",
+				      RELAY_MAX_WORKERS);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			if (interval == 0)
+				panic("Interval must be at least 1s!\n");
+			break;
+		case 'v':
+			version();
+			break;
+		case 'h':
+		default:
+			help();
+			break;
+		}
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	/* Workers inherit the mask, so signals cut the reporter's sleep. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	sock_open_listen_group(port, socks, num);
+	for (i = 0; i < num; ++i)
+		workers[i] = relay_worker_init(i, socks[i]);
+
+	printf("Relaying on port %s with %u worker(s), UDP GSO %s\n", port,
+	       num, workers[0]->tx->gso ? "on" : "off");
+	fflush(stdout);
+
+	for (i = 0; i < num; ++i) {
+		ret = pthread_create(&workers[i]->tid, NULL, relay_worker_main,
+				     workers[i]);
+		if (ret)
+			panic("Cannot create worker thread!\n");
+	}
+
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	relay_report(num, interval);
+
+	for (i = 0; i < num; ++i) {
+		reactor_wakeup(&workers[i]->r);
+		pthread_join(workers[i]->tid, NULL);
+	}
+
+	relay_dump_stats(num);
+
+	for (i = 0; i < num; ++i)
+		relay_worker_cleanup(workers[i]);
+
+	return 0;
+}
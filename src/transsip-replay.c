@@ -0,0 +1,488 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * Feeds a capture of transsip -c back into a running engine, at the
+ * original timing, scaled, or as fast as possible. Each peer of the
+ * capture gets a socket of its own, so the engine sees as many peers
+ * as there were. By default the datagrams the captured engine received
+ * are sent, which puts us in the place of its peers. The engine answers
+ * as it would to them, but handshakes that hinge on its secrets, such
+ * as cookies and resumption, cannot be replayed into another engine.
+ * With -d the capture is dissected instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "mmsg.h"
+#include "reactor.h"
+#include "sock.h"
+#include "proto.h"
+#include "capture.h"
+
+#define REPLAY_MAX_FLOWS	64
+#define REPLAY_LINGER		(500 * 1000000ULL)
+
+struct replay_stats {
+	uint64_t sent, replies;
+	uint64_t skipped, unmapped;
+	uint64_t late, late_ns, late_max;
+};
+
+struct replay_flow {
+	int used, sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct reactor_fd rf;
+};
+
+struct replay {
+	struct capture_map map;
+	size_t off;
+	const struct capture_rec *next;
+	uint8_t dir;
+	int fast;
+	double speed;
+	uint64_t start, first, end;
+	struct sockaddr_storage target;
+	socklen_t targetlen;
+	struct replay_flow flows[REPLAY_MAX_FLOWS];
+	struct reactor r;
+	struct reactor_timer timer;
+	struct mmsg_batch *rx, *tx;
+	struct mmsg_stats net;
+	struct replay_stats stats;
+	int done;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static const char *short_options = "t:fx:Tdvh";
+
+static struct option long_options[] = {
+	{"target", required_argument, 0, 't'},
+	{"fast", no_argument, 0, 'f'},
+	{"speed", required_argument, 0, 'x'},
+	{"tx", no_argument, 0, 'T'},
+	{"dump", no_argument, 0, 'd'},
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void signal_handler(int number)
+{
+	switch (number) {
+	case SIGINT:
+	case SIGTERM:
+		quit = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+static inline uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Next record of the direction we replay, NULL at the end. */
+static const struct capture_rec *replay_next(struct replay *p)
+{
+	const struct capture_rec *rec;
+
+	while ((rec = capture_next(&p->map, &p->off))) {
+		if ((rec->dir & CAPTURE_TX) == p->dir)
+			return rec;
+		p->stats.skipped++;
+	}
+
+	return NULL;
+}
+
+/* Send and receive stamps of a worker may interleave by a hair. */
+static inline uint64_t replay_due(struct replay *p,
+				  const struct capture_rec *rec)
+{
+	if (rec->ts < p->first)
+		return p->start;
+
+	return p->start + (uint64_t) ((rec->ts - p->first) / p->speed);
+}
+
+/* Answers of the engine are counted and dropped. */
+static void replay_on_flow(struct reactor_fd *rf, uint32_t events)
+{
+	int num;
+	struct replay *p = rf->arg;
+
+	while ((num = mmsg_recv(rf->fd, p->rx, &p->net)) > 0)
+		p->stats.replies += num;
+}
+
+static struct replay_flow *replay_flow(struct replay *p,
+				       const struct capture_rec *rec)
+{
+	int i, sock;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+	struct replay_flow *f, *slot = NULL;
+
+	addrlen = capture_rec_addr(rec, &addr);
+
+	for (i = 0; i < REPLAY_MAX_FLOWS; ++i) {
+		f = &p->flows[i];
+		if (!f->used) {
+			if (!slot)
+				slot = f;
+			continue;
+		}
+		if (f->addrlen == addrlen &&
+		    (addrlen == 0 ||
+		     sock_addr_equal((struct sockaddr *) &f->addr,
+				     (struct sockaddr *) &addr)))
+			return f;
+	}
+
+	if (!slot)
+		return NULL;
+
+	sock = socket(p->target.ss_family, SOCK_DGRAM | SOCK_NONBLOCK,
+		      IPPROTO_UDP);
+	if (sock < 0)
+		return NULL;
+
+	slot->used = 1;
+	slot->sock = sock;
+	memcpy(&slot->addr, &addr, sizeof(addr));
+	slot->addrlen = addrlen;
+	reactor_add(&p->r, &slot->rf, sock, EPOLLIN, replay_on_flow, p);
+
+	return slot;
+}
+
+static void replay_send(struct replay *p, const struct capture_rec *rec)
+{
+	struct replay_flow *f;
+
+	f = replay_flow(p, rec);
+	if (!f) {
+		p->stats.unmapped++;
+		return;
+	}
+
+	if (mmsg_full(p->tx))
+		mmsg_flush(p->tx, &p->net);
+
+	memcpy(mmsg_tx_slot(p->tx), rec->data, rec->len);
+	mmsg_tx_commit(p->tx, f->sock, (struct sockaddr *) &p->target,
+		       p->targetlen, rec->len);
+	p->stats.sent++;
+}
+
+/*
+ * Sends all that is due, then sleeps until the next record. Fast runs
+ * send a batch at a time and come back right away, so that answers
+ * are still read in between.
+ */
+static void replay_on_timer(struct reactor_timer *t, uint64_t expired)
+{
+	unsigned int sent = 0;
+	struct replay *p = t->arg;
+	uint64_t now = replay_now(), due;
+
+	while (p->next) {
+		if (p->fast) {
+			if (sent++ == MMSG_BATCH)
+				break;
+		} else {
+			due = replay_due(p, p->next);
+			if (due > now)
+				break;
+			if (now - due > 1000000ULL) {
+				p->stats.late++;
+				p->stats.late_ns += now - due;
+				p->stats.late_max = max(p->stats.late_max,
+							now - due);
+			}
+		}
+
+		replay_send(p, p->next);
+		p->next = replay_next(p);
+	}
+
+	if (p->tx->len > 0 && mmsg_flush(p->tx, &p->net))
+		whine("Send datagram failed!\n");
+
+	if (!p->next) {
+		reactor_timer_disarm(&p->timer);
+		p->end = replay_now();
+		p->done = 1;
+		return;
+	}
+
+	if (p->fast)
+		reactor_timer_arm(&p->timer, 1, 0);
+	else
+		reactor_timer_arm(&p->timer, replay_due(p, p->next) - now, 0);
+}
+
+static void replay_resolve(struct replay *p, const char *target)
+{
+	int ret;
+	char host[256], *port;
+	struct addrinfo hints, *ai;
+
+	strlcpy(host, target, sizeof(host));
+	port = strrchr(host, ':');
+	if (!port)
+		panic("Target must be <host>:<port>!\n");
+	*port++ = 0;
+
+	/* [::1]:30111 */
+	if (host[0] == '[' && port - host > 2 && port[-2] == ']') {
+		port[-2] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	ret = getaddrinfo(host, port, &hints, &ai);
+	if (ret)
+		panic("Cannot resolve %s: %s!\n", target, gai_strerror(ret));
+
+	memcpy(&p->target, ai->ai_addr, ai->ai_addrlen);
+	p->targetlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+}
+
+/* The time line of a capture, each datagram dissected by proto.c. */
+static void replay_dump(struct replay *p)
+{
+	size_t off = 0;
+	char host[INET6_ADDRSTRLEN];
+	const struct capture_rec *rec;
+	const struct capture_hdr *hdr = p->map.hdr;
+
+	printf("worker %u, started at %llu.%09llu\n", hdr->worker,
+	       (unsigned long long) (hdr->wall / 1000000000ULL),
+	       (unsigned long long) (hdr->wall % 1000000000ULL));
+
+	while ((rec = capture_next(&p->map, &off)) && likely(!quit)) {
+		if (!inet_ntop(rec->family, rec->addr, host, sizeof(host)))
+			strlcpy(host, "?", sizeof(host));
+
+		printf("%12.6f %s %s %s port %u, %u bytes\n",
+		       ((int64_t) (rec->ts - hdr->mono)) / 1e9,
+		       rec->dir & CAPTURE_TX ? "to" : "from",
+		       rec->dir & CAPTURE_SHM ? "ring" : "udp", host,
+		       ntohs(rec->port), rec->len);
+		fflush(stdout);
+
+		transsip_dump(rec->data, rec->len);
+	}
+}
+
+static void replay_init(struct replay *p)
+{
+	p->rx = mmsg_batch_alloc();
+	p->tx = mmsg_batch_alloc();
+
+	reactor_init(&p->r);
+	reactor_timer_init(&p->r, &p->timer, replay_on_timer, p);
+
+	p->start = replay_now();
+	p->next = replay_next(p);
+	if (!p->next) {
+		p->done = 1;
+		return;
+	}
+
+	p->first = p->next->ts;
+	reactor_timer_arm(&p->timer, 1, 0);
+}
+
+static void replay_cleanup(struct replay *p)
+{
+	int i;
+
+	for (i = 0; i < REPLAY_MAX_FLOWS; ++i) {
+		if (!p->flows[i].used)
+			continue;
+		reactor_del(&p->r, &p->flows[i].rf);
+		close(p->flows[i].sock);
+	}
+
+	reactor_timer_destroy(&p->r, &p->timer);
+	reactor_destroy(&p->r);
+
+	mmsg_batch_free(p->rx);
+	mmsg_batch_free(p->tx);
+}
+
+static void replay_dump_stats(struct replay *p)
+{
+	struct replay_stats *st = &p->stats;
+	uint64_t took = (p->end ? p->end : replay_now()) - p->start;
+
+	printf("replay: %llu sent in %.3fs, %llu answers, %llu of the "
+	       "other direction, %llu beyond %u peers\n",
+	       (unsigned long long) st->sent, took / 1e9,
+	       (unsigned long long) st->replies,
+	       (unsigned long long) st->skipped,
+	       (unsigned long long) st->unmapped, REPLAY_MAX_FLOWS);
+	if (!p->fast)
+		printf("replay: %llu late by more than 1ms, %.2fms avg, "
+		       "%.2fms max\n", (unsigned long long) st->late,
+		       st->late ? st->late_ns / 1e6 / st->late : 0.0,
+		       st->late_max / 1e6);
+
+	mmsg_dump_stats("net", &p->net);
+	fflush(stdout);
+}
+
+static void help(void)
+{
+	printf("\n%s %s, the telephony toolkit's capture replay\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Usage: transsip-replay [options] <capture>\n");
+	printf("Options:\n");
+	printf("  -t|--target <host:port> Engine to feed (default 127.0.0.1:30111)\n");
+	printf("  -f|--fast              Send as fast as possible\n");
+	printf("  -x|--speed <factor>    Replay faster or slower than captured\n");
+	printf("  -T|--tx                Replay what the engine sent instead of\n");
+	printf("                         what it received\n");
+	printf("  -d|--dump              Dissect the capture, send nothing\n");
+	printf("  -v|--version           Print version\n");
+	printf("  -h|--help              Print this help\n");
+	printf("\n");
+	printf("Captures are taken with transsip -c <file>.\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+static void version(void)
+{
+	printf("\n%s %s, the telephony toolkit's capture replay\n",
+	       PROGNAME_STRING, VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+int main(int argc, char **argv)
+{
+	int c, opt_index, ret, dump = 0;
+	char *target = "127.0.0.1:30111";
+	uint64_t linger;
+	struct replay *p;
+
+	p = xzmalloc(sizeof(*p));
+	p->speed = 1.0;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options,
+				&opt_index)) != EOF) {
+		switch (c) {
+		case 't':
+			target = optarg;
+			break;
+		case 'f':
+			p->fast = 1;
+			break;
+		case 'x':
+			p->speed = strtod(optarg, NULL);
+			if (p->speed <= 0.0)
+				panic("Speed must be above 0!\n");
+			break;
+		case 'T':
+			p->dir = CAPTURE_TX;
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		case 'v':
+			version();
+			break;
+		case 'h':
+		default:
+			help();
+			break;
+		}
+	}
+
+	if (optind >= argc)
+		help();
+
+	ret = capture_map(argv[optind], &p->map);
+	if (ret < 0)
+		panic("Cannot read capture %s: %s!\n", argv[optind],
+		      ret == -EINVAL ? "not a capture" : strerror(-ret));
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	if (dump) {
+		replay_dump(p);
+		goto out;
+	}
+
+	replay_resolve(p, target);
+	replay_init(p);
+
+	printf("Replaying %s to %s\n", argv[optind], target);
+	fflush(stdout);
+
+	while (likely(!quit) && !p->done)
+		reactor_run_once(&p->r, -1);
+
+	/* Last answers are still on their way. */
+	linger = replay_now() + REPLAY_LINGER;
+	while (likely(!quit) && replay_now() < linger)
+		reactor_run_once(&p->r, REPLAY_LINGER / 1000000ULL);
+
+	replay_dump_stats(p);
+	replay_cleanup(p);
+out:
+	capture_unmap(&p->map);
+	xfree(p);
+
+	return 0;
+}
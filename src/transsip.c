@@ -5,23 +5,120 @@
  * Subject to the GPL, version 2.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include <sched.h>
 #include <pthread.h>
 
 #include "die.h"
 #include "xutils.h"
+#include "engine.h"
+#include "fec.h"
 
-extern void enter_shell_loop(int tsocki, int tsocko);
-extern void *engine_main(void *arg);
+extern void enter_shell_loop(int tsocki, int tsocko, int port);
 
 static pthread_t tid;
-static struct pipepair pp;
+
+static struct engine_conf conf = {
+	.port = "30111",
+	.alsadev = "plughw:0,0",
+	.workers = 1,
+	.ptime = 1,
+};
+
+static const char *short_options = "p:d:w:eb:t:lf:r:n:sc:R:vh";
+
+static struct option long_options[] = {
+	{"port", required_argument, 0, 'p'},
+	{"dev", required_argument, 0, 'd'},
+	{"workers", required_argument, 0, 'w'},
+	{"echo", no_argument, 0, 'e'},
+	{"backend", required_argument, 0, 'b'},
+	{"pace", required_argument, 0, 't'},
+	{"lowlat", no_argument, 0, 'l'},
+	{"fec", required_argument, 0, 'f'},
+	{"red", required_argument, 0, 'r'},
+	{"ptime", required_argument, 0, 'n'},
+	{"shm", no_argument, 0, 's'},
+	{"capture", required_argument, 0, 'c'},
+	{"relay", required_argument, 0, 'R'},
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void help(void)
+{
+	printf("\n%s %s, the telephony toolkit\n", PROGNAME_STRING,
+	       VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Usage: transsip [options]\n");
+	printf("Options:\n");
+	printf("  -p|--port <port>       UDP port to listen on (default 30111)\n");
+	printf("  -d|--dev <dev>         ALSA device, or none (default plughw:0,0)\n");
+	printf("  -w|--workers <num>     Benchmark only: number of worker threads,\n");
+	printf("                         each with its own SO_REUSEPORT socket,\n");
+	printf("                         one per core, needs --echo\n");
+	printf("  -e|--echo              Benchmark: workers after the first take\n");
+	printf("                         each call and echo it back\n");
+	printf("  -b|--backend <type>    Network I/O: poll or uring (default poll)\n");
+	printf("  -t|--pace <mode>       Pace frames by their sample time: txtime\n");
+	printf("                         (SO_TXTIME, needs the fq qdisc) or wheel\n");
+	printf("                         (user space timer wheel)\n");
+	printf("  -l|--lowlat            Busy poll, EF marking and kernel receive\n");
+	printf("                         timestamps for the jitter buffer\n");
+	printf("  -f|--fec <n>:<k>       Send k Reed-Solomon repair packets per\n");
+	printf("                         n media frames, n <= 16, k <= 8\n");
+	printf("  -r|--red <bytes>       Carry a copy of the frame before with\n");
+	printf("                         each packet, 8 to 32 bytes\n");
+	printf("  -n|--ptime <frames>    Bundle up to 8 frames of 5.3ms per packet\n");
+	printf("                         if the peer agrees (default 1)\n");
+	printf("  -s|--shm               Move media of calls to peers of the same\n");
+	printf("                         user on this host to shared memory rings\n");
+	printf("  -c|--capture <file>    Record all datagrams for transsip-replay,\n");
+	printf("                         workers after the first to <file>.<id>\n");
+	printf("  -R|--relay <host:port> Place calls through transsip-relay, for\n");
+	printf("                         peers behind NATs\n");
+	printf("  -v|--version           Print version\n");
+	printf("  -h|--help              Print this help\n");
+	printf("\n");
+	printf("Calls are spread over workers by their call id. Workers other\n");
+	printf("than the first have no sound device and the shell cannot reach\n");
+	printf("them, so they never carry a real call. More than one worker is\n");
+	printf("a benchmark setup for load tests with --echo.\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
+
+static void version(void)
+{
+	printf("\n%s %s, the telephony toolkit\n", PROGNAME_STRING,
+	       VERSION_STRING);
+	printf("http://www.transsip.org\n\n");
+	printf("Please report bugs to <workgroup@transsip.org>\n");
+	printf("Copyright (C) 2011-2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n");
+	printf("License: GNU GPL version 2\n");
+	printf("This is free software: you are free to change and redistribute it.\n");
+	printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+
+	die();
+}
 
 static void start_server(int usocki, int usocko)
 {
-	pp.i = usocki;
-	pp.o = usocko;
-	int ret = pthread_create(&tid, NULL, engine_main, &pp);
+	int ret;
+
+	conf.pp.i = usocki;
+	conf.pp.o = usocko;
+
+	ret = pthread_create(&tid, NULL, engine_main, &conf);
 	if (ret)
 		panic("Cannot create server thread!\n");
 }
@@ -31,12 +128,95 @@ static void stop_server(void)
 	pthread_join(tid, NULL);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	int ret;
+	int ret, c, opt_index;
 	int efd[2], refd[2];
 	struct sched_param param;
 
+	while ((c = getopt_long(argc, argv, short_options, long_options,
+				&opt_index)) != EOF) {
+		switch (c) {
+		case 'p':
+			conf.port = optarg;
+			break;
+		case 'd':
+			conf.alsadev = optarg;
+			break;
+		case 'w':
+			conf.workers = strtoul(optarg, NULL, 10);
+			if (conf.workers == 0 ||
+			    conf.workers > ENGINE_MAX_WORKERS)
+				panic("Workers must be between 1 and %d!\n",
+				      ENGINE_MAX_WORKERS);
+			break;
+		case 'e':
+			conf.echo = 1;
+			break;
+		case 'b':
+			if (!strncmp(optarg, "uring", strlen("uring")))
+				conf.backend = ENGINE_NET_URING;
+			else if (!strncmp(optarg, "poll", strlen("poll")))
+				conf.backend = ENGINE_NET_POLL;
+			else
+				panic("Unknown backend %s!\n", optarg);
+			break;
+		case 't':
+			if (!strncmp(optarg, "txtime", strlen("txtime")))
+				conf.pace = ENGINE_PACE_TXTIME;
+			else if (!strncmp(optarg, "wheel", strlen("wheel")))
+				conf.pace = ENGINE_PACE_WHEEL;
+			else
+				panic("Unknown pacing mode %s!\n", optarg);
+			break;
+		case 'l':
+			conf.lowlat = 1;
+			break;
+		case 'f':
+			if (sscanf(optarg, "%u:%u", &conf.fec_data,
+				   &conf.fec_parity) != 2 ||
+			    conf.fec_data == 0 ||
+			    conf.fec_data > FEC_MAX_DATA ||
+			    conf.fec_parity > FEC_MAX_PARITY)
+				panic("FEC wants <1-%d>:<0-%d>!\n",
+				      FEC_MAX_DATA, FEC_MAX_PARITY);
+			break;
+		case 'r':
+			conf.red = strtoul(optarg, NULL, 10);
+			if (conf.red < ENGINE_RED_MIN ||
+			    conf.red > ENGINE_RED_MAX)
+				panic("Redundancy must be %d to %d bytes!\n",
+				      ENGINE_RED_MIN, ENGINE_RED_MAX);
+			break;
+		case 'n':
+			conf.ptime = strtoul(optarg, NULL, 10);
+			if (conf.ptime == 0 || conf.ptime > ENGINE_PTIME_MAX)
+				panic("Ptime must be 1 to %d frames!\n",
+				      ENGINE_PTIME_MAX);
+			break;
+		case 's':
+			conf.shm = 1;
+			break;
+		case 'c':
+			conf.capture = optarg;
+			break;
+		case 'R':
+			conf.relay = optarg;
+			break;
+		case 'v':
+			version();
+			break;
+		case 'h':
+		default:
+			help();
+			break;
+		}
+	}
+
+	/* Calls steered to them would never ring. */
+	if (conf.workers > 1 && !conf.echo)
+		panic("More than one worker needs --echo!\n");
+
 	ret = pipe(efd);
 	if (ret < 0)
 		panic("Cannot create event fd!\n");
@@ -48,7 +228,7 @@ int main(void)
 	sched_setscheduler(0, SCHED_FIFO, &param);
 
 	start_server(efd[0], refd[1]);
-	enter_shell_loop(refd[0], efd[1]);
+	enter_shell_loop(refd[0], efd[1], strtoul(conf.port, NULL, 10));
 	stop_server();
 
 	close(efd[0]);
@@ -0,0 +1,379 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "built_in.h"
+#include "die.h"
+#include "xmalloc.h"
+#include "uring.h"
+
+#define URING_BUF_SIZE	2048
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				     struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				     unsigned int min_complete,
+				     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr)
+		munmap(u->sq_ptr, u->sq_len);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+static int uring_init(struct uring *u, unsigned int entries)
+{
+	unsigned int i, *sq_array;
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -errno;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+	    u->sqes == MAP_FAILED) {
+		if (u->sq_ptr == MAP_FAILED)
+			u->sq_ptr = NULL;
+		if (u->cq_ptr == MAP_FAILED)
+			u->cq_ptr = NULL;
+		if (u->sqes == MAP_FAILED)
+			u->sqes = NULL;
+		uring_exit(u);
+		return -ENOMEM;
+	}
+
+	u->sq_entries = p.sq_entries;
+	u->sq_head = u->sq_ptr + p.sq_off.head;
+	u->sq_tail = u->sq_ptr + p.sq_off.tail;
+	u->sq_mask = u->sq_ptr + p.sq_off.ring_mask;
+	u->cq_head = u->cq_ptr + p.cq_off.head;
+	u->cq_tail = u->cq_ptr + p.cq_off.tail;
+	u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+	u->cqes = u->cq_ptr + p.cq_off.cqes;
+
+	/* Slots are submitted in order, so the index array is identity. */
+	sq_array = u->sq_ptr + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i;
+
+	u->sqe_tail = *u->sq_tail;
+
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if (u->sqe_tail - head >= u->sq_entries)
+		return NULL;
+
+	sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+	u->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static int uring_submit(struct uring *u, unsigned int wait)
+{
+	unsigned int todo = u->sqe_tail - *u->sq_tail;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(u->fd, todo, wait, wait ?
+					 IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static struct io_uring_cqe *uring_peek_cqe(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void uring_buf_add(struct uring_net *n, unsigned int bid,
+				 unsigned int off)
+{
+	struct io_uring_buf *buf;
+
+	buf = &n->br->bufs[(n->br->tail + off) & (URING_BUFS - 1)];
+	buf->addr = (unsigned long) (n->bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+}
+
+static inline void uring_buf_advance(struct uring_net *n, unsigned int cnt)
+{
+	__atomic_store_n(&n->br->tail, n->br->tail + cnt, __ATOMIC_RELEASE);
+}
+
+static int uring_net_arm(struct uring_net *n)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&n->rx);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = n->sock;
+	sqe->addr = (unsigned long) &n->rx_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+
+	n->armed = 1;
+	return uring_submit(&n->rx, 0);
+}
+
+/* Returns NULL if the kernel lacks what we need (Linux >= 6.0). */
+struct uring_net *uring_net_open(int sock)
+{
+	int ret;
+	unsigned int i;
+	struct uring_net *n;
+	struct io_uring_buf_reg reg;
+
+	n = xzmalloc(sizeof(*n));
+	n->sock = sock;
+	n->efd = -1;
+	n->tx.fd = -1;
+
+	ret = uring_init(&n->rx, URING_ENTRIES);
+	if (ret < 0) {
+		n->rx.fd = -1;
+		goto err;
+	}
+	ret = uring_init(&n->tx, URING_ENTRIES);
+	if (ret < 0) {
+		n->tx.fd = -1;
+		goto err;
+	}
+
+	n->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (n->efd < 0)
+		goto err;
+	ret = sys_io_uring_register(n->rx.fd, IORING_REGISTER_EVENTFD,
+				    &n->efd, 1);
+	if (ret < 0)
+		goto err;
+
+	n->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+	n->br = mmap(NULL, n->br_len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (n->br == MAP_FAILED) {
+		n->br = NULL;
+		goto err;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) n->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+
+	ret = sys_io_uring_register(n->rx.fd, IORING_REGISTER_PBUF_RING,
+				    &reg, 1);
+	if (ret < 0)
+		goto err;
+
+	n->bufs = xmalloc_aligned(URING_BUFS * URING_BUF_SIZE, 64);
+	for (i = 0; i < URING_BUFS; ++i)
+		uring_buf_add(n, i, i);
+	uring_buf_advance(n, URING_BUFS);
+
+	/* Template only, the kernel lays out each buffer after it. */
+	n->rx_msg.msg_namelen = sizeof(struct sockaddr_storage);
+
+	if (uring_net_arm(n) < 0)
+		goto err;
+
+	return n;
+err:
+	uring_net_close(n);
+	return NULL;
+}
+
+void uring_net_close(struct uring_net *n)
+{
+	if (n->rx.fd >= 0)
+		uring_exit(&n->rx);
+	if (n->tx.fd >= 0)
+		uring_exit(&n->tx);
+	if (n->br)
+		munmap(n->br, n->br_len);
+	if (n->bufs)
+		xfree(n->bufs);
+	if (n->efd >= 0)
+		close(n->efd);
+
+	xfree(n);
+}
+
+/*
+ * Called when the eventfd fires. Each completion carries one datagram
+ * in a provided buffer, which goes back to the ring right after the
+ * callback. A multishot receive that ran out of buffers ends without
+ * IORING_CQE_F_MORE and is armed again once they are back.
+ */
+void uring_net_recv(struct uring_net *n, uring_rx_cb_t cb, void *arg,
+		    struct mmsg_stats *st)
+{
+	int pkts = 0;
+	uint64_t val;
+	ssize_t ret;
+	unsigned int bid, used = 0;
+	struct io_uring_cqe *cqe;
+	struct io_uring_recvmsg_out *out;
+	char *buf, *payload;
+
+	ret = read(n->efd, &val, sizeof(val));
+	if (ret != sizeof(val) && errno != EAGAIN)
+		whine("Cannot read io_uring event fd!\n");
+
+	st->rx_calls++;
+
+	while ((cqe = uring_peek_cqe(&n->rx))) {
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			n->armed = 0;
+
+		if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			buf = n->bufs + bid * URING_BUF_SIZE;
+			out = (struct io_uring_recvmsg_out *) buf;
+			payload = buf + sizeof(*out) + n->rx_msg.msg_namelen;
+
+			if (!(out->flags & MSG_TRUNC)) {
+				cb(arg, payload, out->payloadlen,
+				   (struct sockaddr *) (out + 1),
+				   min(out->namelen, n->rx_msg.msg_namelen));
+				pkts++;
+			}
+
+			uring_buf_add(n, bid, used++);
+		}
+
+		uring_cqe_seen(&n->rx);
+	}
+
+	if (used)
+		uring_buf_advance(n, used);
+	if (!n->armed && uring_net_arm(n) < 0)
+		whine("Cannot re-arm io_uring receive!\n");
+
+	st->rx_pkts += pkts;
+	if (pkts > st->rx_max_batch)
+		st->rx_max_batch = pkts;
+}
+
+/*
+ * One io_uring_enter(2) submits the batch and waits for it; the batch
+ * buffers are reused by the caller right after, so we need the
+ * completions. Non-blocking UDP sends complete inline anyway.
+ */
+int uring_net_flush(struct uring_net *n, struct mmsg_batch *b,
+		    struct mmsg_stats *st)
+{
+	int ret, errs = 0;
+	unsigned int i, queued = 0;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	for (i = 0; i < b->len; ++i) {
+		sqe = uring_get_sqe(&n->tx);
+		if (unlikely(!sqe))
+			bug();
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = b->fd[i];
+		sqe->addr = (unsigned long) &b->hdr[i].msg_hdr;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_DONTWAIT;
+		queued++;
+	}
+
+	if (queued > 0) {
+		ret = uring_submit(&n->tx, queued);
+		st->tx_calls++;
+		if (unlikely(ret < 0))
+			whine("io_uring submit failed: %s\n", strerror(-ret));
+	}
+
+	while (queued > 0 && (cqe = uring_peek_cqe(&n->tx))) {
+		if (cqe->res < 0)
+			errs++;
+		uring_cqe_seen(&n->tx);
+		queued--;
+	}
+
+	st->tx_pkts += b->len - errs;
+	st->tx_errs += errs;
+	if (b->len > st->tx_max_batch)
+		st->tx_max_batch = b->len;
+
+	b->len = 0;
+	b->timed = 0;
+	return errs;
+}
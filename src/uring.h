@@ -0,0 +1,60 @@
+/*
+ * transsip - the telephony toolkit
+ * By Daniel Borkmann <daniel@transsip.org>
+ * Copyright 2011, 2012 Daniel Borkmann <dborkma@tik.ee.ethz.ch>
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "mmsg.h"
+
+#define URING_ENTRIES	64
+#define URING_BUFS	256
+#define URING_BGID	1
+
+/* Bare io_uring instance, we talk to the kernel without liburing. */
+struct uring {
+	int fd;
+	unsigned int sq_entries, sqe_tail;
+	unsigned int *sq_head, *sq_tail, *sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+/*
+ * Datagram I/O on one socket: a multishot recvmsg fills buffers from a
+ * provided buffer ring and signals an eventfd that can be polled by
+ * the reactor. Sends of a whole mmsg batch go through a second ring
+ * with one io_uring_enter(2), so receive completions never get in the
+ * way of reaping send completions.
+ */
+struct uring_net {
+	int sock, efd;
+	struct uring rx, tx;
+	struct msghdr rx_msg;
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	char *bufs;
+	int armed;
+};
+
+typedef void (*uring_rx_cb_t)(void *arg, char *msg, size_t len,
+			      struct sockaddr *addr, socklen_t addrlen);
+
+extern struct uring_net *uring_net_open(int sock);
+extern void uring_net_close(struct uring_net *n);
+extern void uring_net_recv(struct uring_net *n, uring_rx_cb_t cb, void *arg,
+			   struct mmsg_stats *st);
+extern int uring_net_flush(struct uring_net *n, struct mmsg_batch *b,
+			   struct mmsg_stats *st);
+
+#endif /* URING_H */
@@ -127,3 +127,13 @@ char **strntoargv(char *str, size_t len, int *argc)
 out:
 	return argv;
 }
+
+void urandom_bytes(void *buf, size_t len)
+{
+	int fd = open_or_die("/dev/urandom", O_RDONLY);
+	ssize_t ret = read_or_die(fd, buf, len);
+
+	if (ret != len)
+		panic("Short read from /dev/urandom!\n");
+	close(fd);
+}
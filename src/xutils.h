@@ -46,7 +46,12 @@ struct cli_pkt {
 			       fin:1,
 			       hold:1,
 			       unhold:1,
-			       res:11;
+			       list:1,
+			       stats:1,
+			       fec:1,
+			       res:8;
+	uint32_t sid;
+	uint8_t fec_data, fec_parity;
 	char user[USERSIZ];
 	char address[ADDRSIZ];
 	char port[PORTSIZ];
@@ -59,6 +64,7 @@ extern ssize_t write_or_die(int fd, const void *buf, size_t count);
 extern size_t strlcpy(char *dest, const char *src, size_t size);
 extern int slprintf(char *dst, size_t size, const char *fmt, ...);
 extern char **strntoargv(char *str, size_t len, int *argc);
+extern void urandom_bytes(void *buf, size_t len);
 
 #define __reset                 "0"
 #define __bold                  "1"